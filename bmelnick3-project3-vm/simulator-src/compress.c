@@ -0,0 +1,148 @@
+#include "compress.h"
+#include "util.h"
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+
+static inline uint32_t hash4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline int put_varint(uint8_t *dst, size_t cap, size_t *op, size_t value) {
+    do {
+        if (*op == cap) {
+            return 0;
+        }
+        dst[(*op)++] = (uint8_t) ((value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+        value >>= 7;
+    } while (value);
+    return 1;
+}
+
+static inline size_t get_varint(const uint8_t *src, size_t len, size_t *ip) {
+    size_t value = 0;
+    for (uint32_t shift = 0;; shift += 7) {
+        if (*ip == len || shift >= 64) {
+            panic("corrupt compressed page");
+        }
+        uint8_t byte = src[(*ip)++];
+        value |= (size_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+/* The number of bytes, up to limit, for which a and b agree */
+static inline size_t match_length(const uint8_t *a, const uint8_t *b, size_t limit) {
+    size_t n = 0;
+    while (n + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + n, sizeof(x));
+        memcpy(&y, b + n, sizeof(y));
+        if (x != y) {
+            return n + (size_t) __builtin_ctzll(x ^ y) / 8;
+        }
+        n += 8;
+    }
+    while (n < limit && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+/* Emits the literals from anchor up to ip, then a match (or the end marker
+   if match_len is 0) */
+static int emit(const uint8_t *src, size_t anchor, size_t ip, size_t match_len, size_t offset,
+                uint8_t *dst, size_t cap, size_t *op) {
+    size_t literals = ip - anchor;
+    if (!put_varint(dst, cap, op, literals) || cap - *op < literals) {
+        return 0;
+    }
+    memcpy(dst + *op, src + anchor, literals);
+    *op += literals;
+    if (!put_varint(dst, cap, op, match_len)) {
+        return 0;
+    }
+    if (match_len) {
+        if (cap - *op < 2) {
+            return 0;
+        }
+        dst[(*op)++] = (uint8_t) offset;
+        dst[(*op)++] = (uint8_t) (offset >> 8);
+    }
+    return 1;
+}
+
+size_t page_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    /* Positions plus one, so that zero marks an empty slot */
+    uint32_t table[1 << HASH_BITS] = {0};
+    size_t ip = 0, anchor = 0, op = 0;
+
+    while (ip + MIN_MATCH <= len) {
+        uint32_t h = hash4(src + ip);
+        size_t ref = table[h];
+        table[h] = (uint32_t) ip + 1;
+        if (!ref || ip - (ref - 1) > MAX_OFFSET || memcmp(src + ref - 1, src + ip, MIN_MATCH)) {
+            ip++;
+            continue;
+        }
+
+        /* Extend the match as far as it goes; it may overlap ip */
+        ref--;
+        size_t match_len = MIN_MATCH + match_length(src + ref + MIN_MATCH, src + ip + MIN_MATCH,
+                                                    len - ip - MIN_MATCH);
+        if (!emit(src, anchor, ip, match_len, ip - ref, dst, cap, &op)) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    if (!emit(src, anchor, len, 0, 0, dst, cap, &op)) {
+        return 0;
+    }
+    return op;
+}
+
+void page_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len) {
+    size_t ip = 0, op = 0;
+    for (;;) {
+        size_t literals = get_varint(src, len, &ip);
+        if (literals > len - ip || literals > out_len - op) {
+            panic("corrupt compressed page");
+        }
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+
+        size_t match_len = get_varint(src, len, &ip);
+        if (!match_len) {
+            break;
+        }
+        if (len - ip < 2) {
+            panic("corrupt compressed page");
+        }
+        size_t offset = (size_t) src[ip] | (size_t) src[ip + 1] << 8;
+        ip += 2;
+        if (!offset || offset > op || match_len > out_len - op) {
+            panic("corrupt compressed page");
+        }
+        /* A match that overlaps what it produces repeats its first offset
+           bytes. Any multiple of offset back is just as good a source, so
+           the span copied at once doubles as the output grows. */
+        for (size_t span = offset; match_len;) {
+            size_t n = match_len < span ? match_len : span;
+            memcpy(dst + op, dst + op - span, n);
+            op += n;
+            match_len -= n;
+            span *= 2;
+        }
+    }
+    if (op != out_len) {
+        panic("corrupt compressed page");
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Page compression for the compressed swap tier (see -Z).
+ *
+ * A small LZ77 compressor in the spirit of LZ4: matches are found through a
+ * hash table of 4-byte sequences and encoded as (length, offset) pairs, with
+ * offsets of at most 64 KiB. It trades ratio for speed, which is what a
+ * compressed swap cache wants. The format is a sequence of
+ *
+ *   <literal count> <literals> <match length> [<offset>]
+ *
+ * where the counts are LEB128 varints, the offset is two bytes little-endian
+ * and a match length of zero ends the stream.
+ */
+
+/**
+ * Compresses len bytes from src into dst.
+ *
+ * @return the compressed size, or 0 if it would exceed cap
+ */
+size_t page_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+/**
+ * Decompresses the len bytes at src, which must have come from
+ * page_compress(), into the out_len bytes at dst.
+ */
+void page_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len);
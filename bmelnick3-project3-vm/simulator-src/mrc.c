@@ -0,0 +1,332 @@
+#include "mrc.h"
+#include "pagesim.h"
+#include "util.h"
+
+/*
+ * Stack distances are counted with a Fenwick tree over access positions:
+ * every resident page has a single marker at the position of its latest
+ * access, so the number of markers after a page's position is the number of
+ * distinct pages touched since. Positions are handed out in access order
+ * and renumbered densely whenever the tree fills up, so the tree stays
+ * proportional to the number of live pages rather than the trace length,
+ * and every access costs O(log pages) amortized.
+ */
+
+#define NIL UINT32_MAX
+
+/* Live pages, kept in a node pool so STOP can find a process's pages */
+static uint64_t *node_key;
+static uint32_t *node_pos;
+static uint32_t *node_next;     /* Per-process list, or the free list */
+static uint32_t node_capacity;
+static uint32_t node_free = NIL;
+static uint32_t *proc_pages;    /* Head of each process's list */
+
+/* Page key -> node, open addressing with backward-shift deletion */
+static uint64_t *map_keys;
+static uint32_t *map_vals;      /* NIL marks an empty slot */
+static uint64_t map_mask;
+static uint64_t map_size;
+
+/* Fenwick tree over positions, and the node holding each position */
+static uint32_t *tree;
+static uint32_t *owner;
+static uint32_t tree_capacity;
+static uint32_t next_pos;
+static uint32_t live;
+
+/* hist[d] counts accesses with stack distance d */
+static uint64_t *hist;
+static uint64_t hist_capacity;
+static uint64_t cold_misses;
+static uint64_t accesses;
+static uint64_t max_distance;
+
+static void *mrc_alloc(void *ptr, size_t count, size_t size) {
+    ptr = realloc(ptr, count * size);
+    if (!ptr) {
+        panic("could not allocate miss ratio curve state");
+    }
+    return ptr;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static inline uint64_t map_home(uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ULL >> 17) & map_mask;
+}
+
+static uint64_t map_find(uint64_t key) {
+    uint64_t i = map_home(key);
+    while (map_vals[i] != NIL && map_keys[i] != key) {
+        i = (i + 1) & map_mask;
+    }
+    return i;
+}
+
+static void map_resize(uint64_t capacity) {
+    uint64_t *old_keys = map_keys;
+    uint32_t *old_vals = map_vals;
+    uint64_t old_capacity = map_vals ? map_mask + 1 : 0;
+
+    map_keys = mrc_alloc(NULL, capacity, sizeof(uint64_t));
+    map_vals = mrc_alloc(NULL, capacity, sizeof(uint32_t));
+    map_mask = capacity - 1;
+    for (uint64_t i = 0; i < capacity; i++) {
+        map_vals[i] = NIL;
+    }
+    for (uint64_t i = 0; i < old_capacity; i++) {
+        if (old_vals[i] != NIL) {
+            uint64_t slot = map_find(old_keys[i]);
+            map_keys[slot] = old_keys[i];
+            map_vals[slot] = old_vals[i];
+        }
+    }
+    free(old_keys);
+    free(old_vals);
+}
+
+static void map_del(uint64_t hole) {
+    map_vals[hole] = NIL;
+    map_size--;
+    for (uint64_t i = (hole + 1) & map_mask; map_vals[i] != NIL; i = (i + 1) & map_mask) {
+        uint64_t home = map_home(map_keys[i]);
+        if (((i - home) & map_mask) >= ((i - hole) & map_mask)) {
+            map_keys[hole] = map_keys[i];
+            map_vals[hole] = map_vals[i];
+            map_vals[i] = NIL;
+            hole = i;
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void tree_add(uint32_t pos, uint32_t delta) {
+    for (uint32_t i = pos + 1; i <= tree_capacity; i += i & -i) {
+        tree[i - 1] += delta;
+    }
+}
+
+/* The number of markers at positions 0..pos */
+static uint32_t tree_prefix(uint32_t pos) {
+    uint32_t sum = 0;
+    for (uint32_t i = pos + 1; i > 0; i -= i & -i) {
+        sum += tree[i - 1];
+    }
+    return sum;
+}
+
+/* Renumbers the live markers to 0..live-1, growing the tree if they would
+   otherwise fill more than half of it */
+static void tree_compact(void) {
+    uint32_t old_capacity = tree_capacity;
+    if ((uint64_t) live * 2 > tree_capacity) {
+        if (tree_capacity > UINT32_MAX / 2) {
+            panic("too many live pages for the miss ratio curve");
+        }
+        tree_capacity *= 2;
+        tree = mrc_alloc(tree, tree_capacity, sizeof(uint32_t));
+        owner = mrc_alloc(owner, tree_capacity, sizeof(uint32_t));
+    }
+
+    next_pos = 0;
+    for (uint32_t pos = 0; pos < old_capacity; pos++) {
+        if (owner[pos] != NIL) {
+            node_pos[owner[pos]] = next_pos;
+            owner[next_pos++] = owner[pos];
+        }
+    }
+    for (uint32_t pos = next_pos; pos < tree_capacity; pos++) {
+        owner[pos] = NIL;
+    }
+
+    /* Linear-time Fenwick build over the dense prefix */
+    for (uint32_t i = 1; i <= tree_capacity; i++) {
+        tree[i - 1] = i <= next_pos;
+    }
+    for (uint32_t i = 1; i <= tree_capacity; i++) {
+        uint32_t parent = i + (i & -i);
+        if (parent <= tree_capacity) {
+            tree[parent - 1] += tree[i - 1];
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static uint32_t node_alloc(uint64_t key, uint32_t pid) {
+    if (node_free == NIL) {
+        uint32_t old_capacity = node_capacity;
+        node_capacity *= 2;
+        node_key = mrc_alloc(node_key, node_capacity, sizeof(uint64_t));
+        node_pos = mrc_alloc(node_pos, node_capacity, sizeof(uint32_t));
+        node_next = mrc_alloc(node_next, node_capacity, sizeof(uint32_t));
+        for (uint32_t i = node_capacity; i-- > old_capacity;) {
+            node_next[i] = node_free;
+            node_free = i;
+        }
+    }
+    uint32_t n = node_free;
+    node_free = node_next[n];
+
+    node_key[n] = key;
+    node_next[n] = proc_pages[pid];
+    proc_pages[pid] = n;
+    return n;
+}
+
+static void hist_count(uint64_t distance) {
+    if (distance >= hist_capacity) {
+        uint64_t old_capacity = hist_capacity;
+        while (distance >= hist_capacity) {
+            hist_capacity *= 2;
+        }
+        hist = mrc_alloc(hist, hist_capacity, sizeof(uint64_t));
+        memset(hist + old_capacity, 0, (hist_capacity - old_capacity) * sizeof(uint64_t));
+    }
+    hist[distance]++;
+    if (distance > max_distance) {
+        max_distance = distance;
+    }
+}
+
+/* Places a marker for node n at the newest position */
+static void mark(uint32_t n) {
+    if (next_pos == tree_capacity) {
+        tree_compact();
+    }
+    node_pos[n] = next_pos;
+    owner[next_pos] = n;
+    tree_add(next_pos++, 1);
+}
+
+static void unmark(uint32_t n) {
+    owner[node_pos[n]] = NIL;
+    tree_add(node_pos[n], (uint32_t) -1);
+}
+
+static void mrc_access(uint32_t pid, uint32_t address) {
+    uint64_t key = ((uint64_t) pid << 32) | (address >> OFFSET_LEN);
+    uint64_t slot = map_find(key);
+    accesses++;
+
+    if (map_vals[slot] == NIL) {
+        cold_misses++;
+        uint32_t n = node_alloc(key, pid);
+        map_keys[slot] = key;
+        map_vals[slot] = n;
+        if (++map_size * 2 > map_mask + 1) {
+            map_resize((map_mask + 1) * 2);
+        }
+        live++;
+        mark(n);
+        return;
+    }
+
+    uint32_t n = map_vals[slot];
+    hist_count((uint64_t) live - tree_prefix(node_pos[n]) + 1);
+    unmark(n);
+    mark(n);
+}
+
+static void mrc_stop(uint32_t pid) {
+    for (uint32_t n = proc_pages[pid]; n != NIL;) {
+        uint32_t next = node_next[n];
+        unmark(n);
+        map_del(map_find(node_key[n]));
+        node_next[n] = node_free;
+        node_free = n;
+        live--;
+        n = next;
+    }
+    proc_pages[pid] = NIL;
+}
+
+void mrc_init(void) {
+    node_capacity = 1024;
+    node_key = mrc_alloc(NULL, node_capacity, sizeof(uint64_t));
+    node_pos = mrc_alloc(NULL, node_capacity, sizeof(uint32_t));
+    node_next = mrc_alloc(NULL, node_capacity, sizeof(uint32_t));
+    for (uint32_t i = node_capacity; i-- > 0;) {
+        node_next[i] = node_free;
+        node_free = i;
+    }
+    proc_pages = mrc_alloc(NULL, MAX_PID, sizeof(uint32_t));
+    for (uint32_t pid = 0; pid < MAX_PID; pid++) {
+        proc_pages[pid] = NIL;
+    }
+
+    map_resize(2048);
+
+    tree_capacity = 4096;
+    tree = mrc_alloc(NULL, tree_capacity, sizeof(uint32_t));
+    owner = mrc_alloc(NULL, tree_capacity, sizeof(uint32_t));
+    memset(tree, 0, tree_capacity * sizeof(uint32_t));
+    for (uint32_t pos = 0; pos < tree_capacity; pos++) {
+        owner[pos] = NIL;
+    }
+
+    hist_capacity = 1024;
+    hist = mrc_alloc(NULL, hist_capacity, sizeof(uint64_t));
+    memset(hist, 0, hist_capacity * sizeof(uint64_t));
+}
+
+void mrc_record(const trace_record_t *rec) {
+    if (rec->pid >= MAX_PID) {
+        printf("Unable to parse trace file: PID %" PRIu32 " is out of range\n", rec->pid);
+        exit(1);
+    }
+    switch (rec->op) {
+    case TRACE_START:
+    case TRACE_SHM_CREATE:
+    case TRACE_SHM_ATTACH:
+    case TRACE_SHM_DETACH:
+        break;
+    case TRACE_FORK:
+        if (rec->address >= MAX_PID) {
+            printf("Unable to parse trace file: PID %" PRIu32 " is out of range\n", rec->address);
+            exit(1);
+        }
+        break;
+    case TRACE_STOP:
+        mrc_stop(rec->pid);
+        break;
+    case TRACE_ACCESS:
+        if (VADDR_LEN < 32 && rec->address >> VADDR_LEN) {
+            printf("Unable to parse trace file: Address 0x%x is outside the %u-bit virtual address space\n",
+                   rec->address, VADDR_LEN);
+            exit(1);
+        }
+        mrc_access(rec->pid, rec->address);
+        break;
+    default:
+        printf("Unable to parse trace file: Invalid command encountered\n");
+        exit(1);
+    }
+}
+
+void mrc_write(const char *path) {
+    FILE *fout = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (!fout) {
+        perror("Unable to open miss ratio curve file");
+        exit(1);
+    }
+
+    fprintf(fout, "frames,page_faults,miss_ratio\n");
+    uint64_t misses = accesses - cold_misses;
+    uint64_t last = max_distance ? max_distance : 1;
+    for (uint64_t frames = 1; frames <= last; frames++) {
+        if (frames < hist_capacity) {
+            misses -= hist[frames];
+        }
+        uint64_t faults = cold_misses + misses;
+        fprintf(fout, "%" PRIu64 ",%" PRIu64 ",%f\n", frames, faults,
+                accesses ? (double) faults / (double) accesses : 0.0);
+    }
+
+    if (fout != stdout && (ferror(fout) || fclose(fout))) {
+        perror("Unable to write miss ratio curve file");
+        exit(1);
+    }
+}
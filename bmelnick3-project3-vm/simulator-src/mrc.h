@@ -0,0 +1,45 @@
+#pragma once
+
+#include "trace.h"
+#include "types.h"
+
+/*
+ * Miss ratio curves.
+ *
+ * Instead of simulating one memory size, -M reads the trace once and works
+ * out how many page faults LRU replacement would take with every possible
+ * number of frames. Each access is given its LRU stack distance (Mattson et
+ * al.): the number of distinct pages, itself included, touched since the
+ * last access to the same page. With k frames an access hits if and only if
+ * its stack distance is at most k, so a histogram of stack distances yields
+ * the whole curve.
+ *
+ * Pages are identified by (pid, vpn) using the -v/-p geometry. A STOP drops
+ * the process's pages from the stack, just as proc_cleanup() frees them.
+ * Strictly, LRU stops being a stack algorithm once frames are freed (real
+ * LRU refills the free frames first), so on traces with STOPs the curve is
+ * a close approximation; without them it is exact. A FORK starts the child
+ * with none of its parent's pages, so pages the simulator would share copy-
+ * on-write count as the child's own, and likewise every process attached to
+ * an SHM segment has its own copy of its pages.
+ * Frame counts are data frames: the frame table and page tables the real
+ * simulator also keeps in memory are not included.
+ */
+
+/**
+ * Prepares to build a curve. Must be called once, after the geometry is set.
+ */
+void mrc_init(void);
+
+/**
+ * Feeds the next trace record into the curve.
+ */
+void mrc_record(const trace_record_t *rec);
+
+/**
+ * Writes the curve as CSV, one row per frame count from 1 up to the largest
+ * stack distance seen. Beyond that, every further frame saves nothing.
+ *
+ * @param path the file to write, or "-" for standard output
+ */
+void mrc_write(const char *path);
@@ -1,39 +1,282 @@
 #include <stdio.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
 
 #include "pagesim.h"
 #include "paging.h"
 #include "swap.h"
 #include "stats.h"
 #include "swapops.h"
+#include "swapfile.h"
+#include "trace.h"
+#include "vlog.h"
+#include "tlb.h"
+#include "replacement.h"
+#include "mrc.h"
+
+/* Memory geometry, see pagesim.h */
+SIM_LOCAL uint32_t num_frames = 64;
+SIM_LOCAL uint8_t vaddr_len = 24;
+SIM_LOCAL uint8_t offset_len = 14;
+SIM_LOCAL uint8_t pt_levels = 1;
 
 /* Simulator data structures */
-uint8_t *mem;
-pfn_t PTBR;
-pcb_t *current_process;
+SIM_LOCAL uint8_t *mem;
+SIM_LOCAL pfn_t PTBR;
+SIM_LOCAL pcb_t *current_process;
+uint32_t num_cpus = 1;
+SIM_LOCAL uint32_t current_cpu;
 uint8_t check_corruption = 0;
-uint8_t replacement = 0;
-timestamp_t step = 0;
+uint8_t zero_pages = 0;
+uint64_t zswap_budget = 0;
+const char *swap_dir = NULL;
+uint32_t readahead_max = 0;
+uint8_t reclaim_low_pct = 0;
+uint8_t reclaim_high_pct = 0;
+uint8_t huge_order = 0;
+uint64_t fast_tier_size = 0;
+SIM_LOCAL uint32_t fast_frames = 0;
+SIM_LOCAL uint32_t reclaim_low = 0;
+SIM_LOCAL uint32_t reclaim_high = 0;
+SIM_LOCAL uint8_t replacement = 0;
+SIM_LOCAL timestamp_t step = 0;
 
 /* Internal array of running processes (we only expose current_process
    to the user) */
-static pcb_t *procs;
+static SIM_LOCAL pcb_t *procs;
+
+/* The registers of every CPU but the one running the step, which are in
+   PTBR and current_process (see pagesim.h) */
+typedef struct cpu_regs {
+    pfn_t ptbr;
+    pcb_t *process;
+} cpu_regs_t;
+
+static SIM_LOCAL cpu_regs_t cpu_regs[MAX_CPUS];
+
+/* Trace input, set up by read_args. Exactly one of these is used. */
+static FILE *trace_in;
+static const char *trace_bin_path;
+/* The whole trace, when it has to be read before it is simulated */
+static const trace_record_t *trace_records;
+static trace_record_t *trace_loaded;
+static uint64_t trace_count;
+/* If set, convert the trace to this binary file instead of simulating */
+static const char *convert_path;
+/* If set, write the miss ratio curve here instead of simulating */
+static const char *mrc_path;
+/* Verification log settings */
+static uint8_t log_mode = VLOG_TEXT;
+static const char *log_path;
+/* Comma-separated lists of replacement algorithms, memory sizes and TLB
+   geometries; every combination is simulated */
+static const char *policy_list;
+static const char *mem_list;
+static const char *tlb_list = "0";
+/* Threads simulating a sweep at once */
+static uint32_t jobs;
+/* Run the full validity sweep every this many steps, or only at the start
+   and end of the run if zero */
+static uint32_t audit_interval;
 
-/* Constants used in parsing the trace file */
-static const char *START = "START";
-static const char *STOP = "STOP";
+/*
+ * One simulated machine. Normally there is just one, but a parameter sweep
+ * (lists given to -r, -m or -t) simulates every combination, each on its
+ * own thread, and prints their results as a table.
+ */
+typedef struct sim_config {
+    uint8_t replacement;
+    uint64_t mem_size;
+    uint32_t num_frames;
+    uint8_t vaddr_len;
+    uint8_t offset_len;
+    uint8_t pt_levels;
+    uint32_t tlb_entries;
+    uint32_t tlb_ways;
 
-static FILE* read_args(int argc, char **argv);
+    /* Results */
+    stats_t stats;
+    uint64_t swap_max;
+    pthread_t thread;
+} sim_config_t;
 
-static void sim_cmd(const char* cmd);
+static sim_config_t *configs;
+static uint32_t config_count;
+static sem_t job_slots;
+
+static void read_args(int argc, char **argv);
+static void build_configs(uint64_t page_size);
+static void simulate(const sim_config_t *config);
+static void sim_teardown(void);
+static void run_sweep(void);
+static void run_trace(void (*cmd)(const trace_record_t *));
+
+static void sim_cmd(const trace_record_t *cmd);
 static void sim_start_proc(uint32_t pid);
 static void sim_stop_proc(uint32_t pid);
-static void sim_mem_access(uint32_t pid, char rw, uint32_t address, uint8_t data);
+static void sim_fork_proc(uint32_t pid, uint32_t child);
+static void sim_shm_create(uint32_t id, uint32_t pages);
+static void sim_shm_attach(uint32_t pid, uint32_t id, uint32_t address);
+static void sim_shm_detach(uint32_t pid, uint32_t id);
+static void sim_mem_access(uint32_t cpu, uint32_t pid, char rw, uint32_t address, uint8_t data);
 
 static void print_help_and_exit(void);
+static uint64_t parse_size(const char *arg);
+static void check_geometry(void);
 static void check_validity(int checks);
+static void check_step(uint32_t pid);
+static void check_cpu(uint32_t cpu);
+static void check_teardown(void);
 
 int main(int argc, char **argv) {
+    vlog_buffer_stdout();
+
+    /* Read command line options */
+
+    read_args(argc, argv);
+
+    if (convert_path) {
+        trace_convert(trace_in, convert_path);
+        fclose(trace_in);
+        return 0;
+    }
+
+    if (mrc_path) {
+        mrc_init();
+        run_trace(mrc_record);
+        mrc_write(mrc_path);
+        return 0;
+    }
+
+    /* OPT and sweeps need the whole trace before they can simulate any of
+       it. Binary traces are always mapped whole. */
+    if (trace_bin_path) {
+        trace_records = trace_map(trace_bin_path, &trace_count);
+    } else if (replacement == OPT || config_count > 1) {
+        trace_records = trace_loaded = trace_load(trace_in, &trace_count);
+        fclose(trace_in);
+    }
+
+    if (config_count > 1) {
+        vlog_open(VLOG_QUIET, NULL);
+        run_sweep();
+    } else {
+        vlog_open(log_mode, log_path);
+        simulate(&configs[0]);
+    }
+
+    if (trace_loaded) {
+        free(trace_loaded);
+    } else if (trace_records) {
+        trace_unmap(trace_records, trace_count);
+    }
+    if (config_count > 1) {
+        return 0;
+    }
+
+    /* Print statistics */
+    printf("Total Accesses     : %" PRIu64 "\n", stats.accesses);
+    printf("Reads              : %" PRIu64 "\n", stats.reads);
+    printf("Writes             : %" PRIu64 "\n", stats.writes);
+    printf("Page Faults        : %" PRIu64 "\n", stats.page_faults);
+    printf("Writes to disk     : %" PRIu64 "\n", stats.writebacks + stats.bg_writebacks);
+    if (tlb_enabled()) {
+        printf("TLB Hits           : %" PRIu64 "\n", stats.tlb_hits);
+        printf("TLB Misses         : %" PRIu64 "\n", stats.tlb_misses);
+        printf("TLB Dirty Walks    : %" PRIu64 "\n", stats.tlb_dirty_walks);
+        printf("TLB Shootdowns     : %" PRIu64 "\n", stats.tlb_shootdowns);
+        if (num_cpus > 1) {
+            printf("TLB Shootdown IPIs : %" PRIu64 "\n", stats.tlb_ipis);
+        }
+    }
+    printf("Average Access Time: %f\n", stats.aat);
+    if (pt_levels > 1) {
+        printf("Max Inner PT Frames: %" PRIu64 "\n", stats.pt_frames_max);
+    }
+    if (zero_pages) {
+        printf("Zero Page Maps     : %" PRIu64 "\n", stats.zero_maps);
+        printf("Zero Page Copies   : %" PRIu64 "\n", stats.zero_copies);
+        printf("Zero Writebacks    : %" PRIu64 "\n", stats.zero_writebacks);
+    }
+    if (zswap_budget) {
+        printf("Compressed Stores  : %" PRIu64 "\n", stats.zswap_stores);
+        printf("Compressed Hits    : %" PRIu64 "\n", stats.zswap_hits);
+        printf("Compressed Spills  : %" PRIu64 "\n", stats.zswap_spills);
+        printf("Compression Ratio  : %.2f\n", stats.zswap_bytes_out
+               ? (double) stats.zswap_bytes_in / (double) stats.zswap_bytes_out : 0.0);
+        printf("Compressed Max Use : %" PRIu64 " KB of %" PRIu64 " KB\n",
+               swap_tier.used_max >> 10, zswap_budget >> 10);
+    }
+    if (swap_dir) {
+        printf("Swap File Writes   : %" PRIu64 " in %" PRIu64 " batches\n", swap_file.writes, swap_file.batches);
+        printf("Swap File Reads    : %" PRIu64 " (%" PRIu64 " waited for writeback)\n",
+               swap_file.reads, swap_file.read_waits);
+        printf("Swap File Stalls   : %.3f ms\n", (double) swap_file.stall_ns / 1e6);
+    }
+    if (readahead_max) {
+        printf("Prefetches         : %" PRIu64 "\n", stats.prefetches);
+        printf("Prefetch Reads     : %" PRIu64 "\n", stats.prefetch_reads);
+        printf("Prefetches Used    : %" PRIu64 "\n", stats.prefetch_hits);
+        printf("Prefetches Wasted  : %" PRIu64 "\n", stats.prefetch_wasted);
+    }
+    if (reclaim_high_pct) {
+        printf("Direct Evictions   : %" PRIu64 "\n", stats.direct_evictions);
+        printf("Reclaim Passes     : %" PRIu64 "\n", stats.reclaim_passes);
+        printf("Reclaim Evictions  : %" PRIu64 "\n", stats.reclaim_evictions);
+        printf("Reclaim Cleanings  : %" PRIu64 "\n", stats.reclaim_cleans);
+        printf("Reclaim Writebacks : %" PRIu64 "\n", stats.bg_writebacks);
+    }
+    if (stats.forks) {
+        printf("Forks              : %" PRIu64 "\n", stats.forks);
+        printf("COW Faults         : %" PRIu64 "\n", stats.cow_faults);
+        printf("COW Reuses         : %" PRIu64 "\n", stats.cow_reuses);
+    }
+    if (stats.shm_creates) {
+        printf("SHM Faults         : %" PRIu64 "\n", stats.shm_faults);
+        printf("SHM Minor Faults   : %" PRIu64 "\n", stats.shm_minor_faults);
+    }
+    if (stats.forks || stats.shm_creates) {
+        printf("Shared Frames Saved: %" PRIu64 " at most\n", stats.frames_saved_max);
+    }
+    if (huge_order) {
+        printf("Huge Reservations  : %" PRIu64 "\n", stats.huge_reserved);
+        printf("Huge Promotions    : %" PRIu64 " (%" PRIu64 " pages copied)\n", stats.huge_promotions, stats.huge_copies);
+        printf("Huge Splits        : %" PRIu64 "\n", stats.huge_splits);
+        printf("Huge Mappings      : %" PRIu64 " at most\n", stats.huge_mappings_max);
+    }
+    if (fast_tier_size) {
+        printf("Fast Tier Accesses : %" PRIu64 "\n", stats.fast_accesses);
+        printf("Slow Tier Accesses : %" PRIu64 "\n", stats.slow_accesses);
+        printf("Tier Promotions    : %" PRIu64 "\n", stats.tier_promotions);
+        printf("Tier Demotions     : %" PRIu64 "\n", stats.tier_demotions);
+    }
+    if (fast_tier_size || huge_order) {
+        printf("Migration Time     : %f\n", stats.migration_time);
+    }
+    printf("Max Swap Size      : %" PRIu64 " KB\n",
+           ((swap_pool.in_use_max + swap_file.in_use_max) * PAGE_SIZE) >> 10);
+    printf("Swap Pool High Mark: %" PRIu64 " entries (%" PRIu64 " KB reserved)\n",
+           swap_pool.in_use_max, ((swap_pool.chunks * SWAP_POOL_CHUNK) * PAGE_SIZE) >> 10);
+
+    if (swap_queue.size > 0)  {
+        printf("Swap Not Freed     : %" PRIu64 " KB\n", (((uint64_t) swap_queue.size) * PAGE_SIZE) >> 10);
+    }
+
+    sim_teardown();
+}
+
+/* Sets up the machine described by config on this thread and runs the
+   whole trace on it */
+void simulate(const sim_config_t *config)
+{
+    replacement = config->replacement;
+    num_frames = config->num_frames;
+    vaddr_len = config->vaddr_len;
+    offset_len = config->offset_len;
+    pt_levels = config->pt_levels;
+
     /* Allocate some memory! */
     if (!(mem = calloc(1, MEM_SIZE))) {
         exit(1);
@@ -44,71 +287,262 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    /* Read command line options */
+    tlb_init(config->tlb_entries, config->tlb_ways < config->tlb_entries ? config->tlb_ways : config->tlb_entries);
+    if (replacement == OPT) {
+        opt_prepare(trace_records, trace_count);
+    }
+    if (swap_dir) {
+        swap_file_open(swap_dir);
+    }
+    /* Watermarks are shares of all frames, but at least one frame apart */
+    reclaim_low = (uint32_t) ((uint64_t) NUM_FRAMES * reclaim_low_pct / 100);
+    reclaim_high = (uint32_t) ((uint64_t) NUM_FRAMES * reclaim_high_pct / 100);
+    if (reclaim_high_pct) {
+        if (!reclaim_low) {
+            reclaim_low = 1;
+        }
+        if (reclaim_high <= reclaim_low) {
+            reclaim_high = reclaim_low + 1;
+        }
+    }
 
-    FILE* fin = read_args(argc, argv);
+    fast_frames = (uint32_t) (fast_tier_size >> OFFSET_LEN);
 
     /* Start the simulation */
 
     system_init();
     if (check_corruption) check_validity(0);
 
-    char buf[120];
+    run_trace(sim_cmd);
+    if (check_corruption) check_validity(1);
 
-    while ((fgets(buf, sizeof(buf), fin))) {
-        sim_cmd(buf);
-        step++;  // Increment the timestamp
-    }
-    fclose(fin);
+    /* Let the swap file catch up, so its statistics are complete */
+    swap_file_close();
+    compute_stats();
+}
 
-    /* Cleanup and print statistics */
+/* Frees everything simulate() and the machine it ran allocated */
+void sim_teardown(void)
+{
     free(mem);
+    for (uint32_t pid = 0; procs && pid < MAX_PID; pid++) {
+        free(procs[pid].pages);
+        free(procs[pid].shm);
+    }
     free(procs);
-    compute_stats();
+    free(free_frame_map);
+    swap_teardown(&swap_queue);
+    tlb_teardown();
+    replacement_teardown();
+    rmap_teardown();
+    shm_teardown();
+    tier_teardown();
+    check_teardown();
+}
 
-    printf("Total Accesses     : %" PRIu64 "\n", stats.accesses);
-    printf("Reads              : %" PRIu64 "\n", stats.reads);
-    printf("Writes             : %" PRIu64 "\n", stats.writes);
-    printf("Page Faults        : %" PRIu64 "\n", stats.page_faults);
-    printf("Writes to disk     : %" PRIu64 "\n", stats.writebacks);
-    printf("Average Access Time: %f\n", stats.aat);
-    printf("Max Swap Size      : %" PRIu64 " KB\n", (((uint64_t) swap_queue.size_max) * PAGE_SIZE) >> 10);
+static void *sweep_run(void *arg)
+{
+    sim_config_t *config = arg;
 
-    if (swap_queue.size > 0)  {
-        printf("Swap Not Freed     : %" PRIu64 " KB\n", (((uint64_t) swap_queue.size) * PAGE_SIZE) >> 10);
+    vlog_mode = VLOG_QUIET;
+    simulate(config);
+    config->stats = stats;
+    config->swap_max = swap_pool.in_use_max + swap_file.in_use_max;
+    sim_teardown();
+
+    sem_post(&job_slots);
+    return NULL;
+}
+
+/* Formats a size in bytes with the largest suffix parse_size() accepts
+   that represents it exactly */
+static const char *format_size(uint64_t size, char *buf, size_t len)
+{
+    const char *suffix = "KMG";
+    int shift = 0;
+    while (shift < 3 && size && !(size & 1023)) {
+        size >>= 10;
+        shift++;
+    }
+    if (shift) {
+        snprintf(buf, len, "%" PRIu64 "%c", size, suffix[shift - 1]);
+    } else {
+        snprintf(buf, len, "%" PRIu64, size);
+    }
+    return buf;
+}
+
+/* Simulates every configuration on its own thread, at most jobs at a time,
+   and prints their results in the order they were listed */
+void run_sweep(void)
+{
+    if (sem_init(&job_slots, 0, jobs)) {
+        panic("could not set up the sweep");
+    }
+    for (uint32_t i = 0; i < config_count; i++) {
+        sem_wait(&job_slots);
+        if (pthread_create(&configs[i].thread, NULL, sweep_run, &configs[i])) {
+            panic("could not start a sweep thread");
+        }
+    }
+    for (uint32_t i = 0; i < config_count; i++) {
+        pthread_join(configs[i].thread, NULL);
+    }
+    sem_destroy(&job_slots);
+
+    printf("%-10s %7s %7s %12s %12s %14s %12s %12s %13s %20s\n",
+           "Policy", "Memory", "TLB", "Accesses", "Page Faults", "Writes to disk",
+           "TLB Hits", "TLB Misses", "Max Swap (KB)", "Average Access Time");
+    for (uint32_t i = 0; i < config_count; i++) {
+        const sim_config_t *config = &configs[i];
+        char mem_buf[24], tlb_buf[24];
+        if (config->tlb_entries) {
+            snprintf(tlb_buf, sizeof(tlb_buf), "%" PRIu32 ":%" PRIu32, config->tlb_entries,
+                     config->tlb_ways < config->tlb_entries ? config->tlb_ways : config->tlb_entries);
+        } else {
+            snprintf(tlb_buf, sizeof(tlb_buf), "off");
+        }
+        printf("%-10s %7s %7s %12" PRIu64 " %12" PRIu64 " %14" PRIu64 " %12" PRIu64 " %12" PRIu64 " %13" PRIu64 " %20f\n",
+               replacement_name(config->replacement),
+               format_size(config->mem_size, mem_buf, sizeof(mem_buf)), tlb_buf,
+               config->stats.accesses, config->stats.page_faults,
+               config->stats.writebacks + config->stats.bg_writebacks,
+               config->stats.tlb_hits, config->stats.tlb_misses,
+               (config->swap_max << config->offset_len) >> 10, config->stats.aat);
     }
 }
 
-FILE* read_args(int argc, char **argv)
+void read_args(int argc, char **argv)
 {
-    FILE *fin = 0;
+    uint64_t page_size = (uint64_t) 1 << offset_len;
     int opt;
-    while (-1 != (opt = getopt(argc, argv, "i:hscr:"))) {
+    while (-1 != (opt = getopt(argc, argv, "i:b:o:M:l:L:t:m:v:p:n:a:j:Z:F:R:W:H:P:T:hqsczr:"))) {
         switch (opt) {
         case 'i':
-            fin = fopen(optarg, "r");
+            trace_in = fopen(optarg, "r");
 
-            if (!fin) {
+            if (!trace_in) {
                 perror("Unable to open trace file");
                 exit(1);
             }
             break;
         case 's':
-            fin = stdin;
+            trace_in = stdin;
+            break;
+        case 'b':
+            trace_bin_path = optarg;
+            break;
+        case 'o':
+            convert_path = optarg;
+            break;
+        case 'M':
+            mrc_path = optarg;
+            break;
+        case 'q':
+            log_mode = VLOG_QUIET;
+            break;
+        case 'l':
+            log_mode = VLOG_BINARY;
+            log_path = optarg;
+            break;
+        case 'L':
+            vlog_render(optarg);
+            exit(0);
+        case 't':
+            tlb_list = optarg;
+            break;
+        case 'm':
+            mem_list = optarg;
+            break;
+        case 'j': {
+            uint64_t count = parse_size(optarg);
+            if (count > UINT32_MAX) {
+                fprintf(stderr, "ERROR: -j takes at most %" PRIu32 " machines.\n", UINT32_MAX);
+                exit(1);
+            }
+            jobs = (uint32_t) count;
+            break;
+        }
+        case 'v': {
+            uint64_t bits = parse_size(optarg);
+            if (bits > 32) {
+                fprintf(stderr, "ERROR: Virtual addresses must be wider than the page offset and at most 32 bits.\n");
+                exit(1);
+            }
+            vaddr_len = (uint8_t) bits;
+            break;
+        }
+        case 'p':
+            page_size = parse_size(optarg);
+            break;
+        case 'n': {
+            uint64_t levels = parse_size(optarg);
+            if (levels < 1 || levels > 3) {
+                fprintf(stderr, "ERROR: Page tables may have between one and three levels.\n");
+                exit(1);
+            }
+            pt_levels = (uint8_t) levels;
+            break;
+        }
+        case 'z':
+            zero_pages = 1;
+            break;
+        case 'Z':
+            zswap_budget = parse_size(optarg);
+            break;
+        case 'F':
+            swap_dir = optarg;
+            break;
+        case 'R': {
+            uint64_t pages = parse_size(optarg);
+            if (pages > UINT32_MAX) {
+                fprintf(stderr, "ERROR: -R takes at most %" PRIu32 " pages.\n", UINT32_MAX);
+                exit(1);
+            }
+            readahead_max = (uint32_t) pages;
+            break;
+        }
+        case 'W': {
+            unsigned low, high;
+            char end;
+            if (sscanf(optarg, "%u:%u%c", &low, &high, &end) != 2 || !low || low >= high || high > 100) {
+                fprintf(stderr, "ERROR: -W takes low:high watermarks, in percent of memory, with low < high.\n");
+                exit(1);
+            }
+            reclaim_low_pct = (uint8_t) low;
+            reclaim_high_pct = (uint8_t) high;
+            break;
+        }
+        case 'H': {
+            uint64_t order = parse_size(optarg);
+            if (!order || order > 6) {
+                fprintf(stderr, "ERROR: -H takes the huge page order, from 1 to 6.\n");
+                exit(1);
+            }
+            huge_order = (uint8_t) order;
+            break;
+        }
+        case 'P': {
+            uint64_t cpus = parse_size(optarg);
+            if (!cpus || cpus > MAX_CPUS) {
+                fprintf(stderr, "ERROR: -P takes the number of CPUs, from 1 to %d.\n", MAX_CPUS);
+                exit(1);
+            }
+            num_cpus = (uint32_t) cpus;
+            break;
+        }
+        case 'T':
+            fast_tier_size = parse_size(optarg);
             break;
         case 'c':
             check_corruption = 1;
             printf("-> Note: Strict memory corruption checking is enabled.\n");
             break;
+        case 'a':
+            audit_interval = (uint32_t) parse_size(optarg);
+            break;
         case 'r':
-            if (strcmp(optarg, "random") == 0) {
-                replacement = RANDOM;
-            } else if (strcmp(optarg, "clocksweep") == 0) {
-                replacement = CLOCKSWEEP;
-            } else {
-                fprintf(stderr, "Unknown replacement algorithm: %s", optarg);
-                exit(1);
-            }
+            policy_list = optarg;
             break;
         case 'h':
         default:
@@ -117,71 +551,256 @@ FILE* read_args(int argc, char **argv)
         }
     }
 
-    if (!fin) {
-        fprintf(stderr, "ERROR: You must specify a trace filename or stdin.\n");
+    if (!page_size || (page_size & (page_size - 1))) {
+        fprintf(stderr, "ERROR: The page size must be a power of two.\n");
+        exit(1);
+    }
+    offset_len = (uint8_t) __builtin_ctzll(page_size);
+    build_configs(page_size);
+    if (!jobs) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (uint32_t) cpus : 1;
+    }
+
+    if (!trace_in == !trace_bin_path) {
+        fprintf(stderr, "ERROR: You must specify exactly one of a trace filename, a binary trace or stdin.\n");
         print_help_and_exit();
     }
+    if (convert_path) {
+        if (!trace_in) {
+            fprintf(stderr, "ERROR: -o converts a text trace; use -i or -s.\n");
+            print_help_and_exit();
+        }
+        return;
+    }
+    if (mrc_path) {
+        return;
+    }
     if (!replacement) {
         fprintf(stderr, "ERROR: You must select a replacement algorithm using -r.\n");
         print_help_and_exit();
     }
-
-    return fin;
 }
 
-// The sim_cmd function is run for each line/command in the trace file
-// There are three types of commands:
-//      Start Process:  START <PID>
-//      Stop Process:   STOP <PID>
-//      Memory Access:  <PID> <r/w> <Address> <Value>
-void sim_cmd(const char* cmd)
+/* Returns the next comma-separated item of *list in buf, advancing *list
+   past it, or NULL once the list is exhausted */
+static const char *next_item(const char **list, char *buf, size_t len)
 {
-    char rw;
-    uint8_t data;
-    uint32_t address;
-    uint32_t pid;
+    if (!*list) {
+        return NULL;
+    }
+    const char *comma = strchr(*list, ',');
+    size_t n = comma ? (size_t) (comma - *list) : strlen(*list);
+    if (n >= len) {
+        n = len - 1;
+    }
+    memcpy(buf, *list, n);
+    buf[n] = '\0';
+    *list = comma ? comma + 1 : NULL;
+    return buf;
+}
 
-    if (!strncmp(cmd, START, 5))  // Start Process Command
-    {
-        int ret = sscanf(cmd+6, "%" PRIu32 "\n", &pid);  // Get the PID from the command
+/* Expands the -r, -m and -t lists into one configuration per combination,
+   validating each. The first configuration's policy and geometry are left
+   in the globals, for the checks and modes that run on the main thread. */
+void build_configs(uint64_t page_size)
+{
+    char policy_buf[32], mem_buf[32], tlb_buf[32];
+    const char *policies_left = policy_list ? policy_list : "";
+    const char *policy_name;
+    uint32_t capacity = 0;
 
-        if (ret == 1)
-        {
-            sim_start_proc(pid);
-        }
-        else
-        {
-            printf("Unable to parse trace file: Invalid START command encountered\n");
+    while ((policy_name = next_item(&policies_left, policy_buf, sizeof(policy_buf)))) {
+        uint8_t policy_id = 0;
+        if (policy_list && !(policy_id = replacement_lookup(policy_name))) {
+            fprintf(stderr, "Unknown replacement algorithm: %s", policy_name);
             exit(1);
         }
-    }
-    else if (!strncmp(cmd, STOP, 4))  // Stop Process Command
-    {
-        /* Start scanning from the pid digits */
-        int ret = sscanf((cmd+5), "%" PRIu32 "\n", &pid);
-        if (ret == 1)
-        {
-            sim_stop_proc(pid);
-        }
-        else
-        {
-            printf("Unable to parse trace file: Invalid STOP command encountered\n");
+        if (policy_id == OPT && readahead_max) {
+            /* OPT's next-use index only knows the page each step accesses */
+            fprintf(stderr, "ERROR: OPT cannot be combined with readahead (-R).\n");
             exit(1);
         }
+
+        const char *mems_left = mem_list ? mem_list : "1M";
+        const char *mem_arg;
+        while ((mem_arg = next_item(&mems_left, mem_buf, sizeof(mem_buf)))) {
+            uint64_t mem_size = parse_size(mem_arg);
+            if (mem_size % page_size) {
+                fprintf(stderr, "ERROR: Physical memory must be a whole number of pages.\n");
+                exit(1);
+            }
+            if (mem_size > ((uint64_t) 1 << 32)) {
+                fprintf(stderr, "ERROR: Physical memory is limited to 4 GiB.\n");
+                exit(1);
+            }
+            num_frames = (uint32_t) (mem_size / page_size);
+            check_geometry();
+
+            const char *tlbs_left = tlb_list;
+            const char *tlb_arg;
+            while ((tlb_arg = next_item(&tlbs_left, tlb_buf, sizeof(tlb_buf)))) {
+                uint32_t entries = 0, ways = 4;
+                if (sscanf(tlb_arg, "%" SCNu32 ":%" SCNu32, &entries, &ways) < 1) {
+                    fprintf(stderr, "Invalid TLB geometry: %s\n", tlb_arg);
+                    exit(1);
+                }
+
+                if (config_count == capacity) {
+                    capacity = capacity ? capacity * 2 : 4;
+                    if (!(configs = realloc(configs, capacity * sizeof(sim_config_t)))) {
+                        panic("could not allocate sweep configurations");
+                    }
+                }
+                sim_config_t *config = &configs[config_count++];
+                memset(config, 0, sizeof(*config));
+                config->replacement = policy_id;
+                config->mem_size = mem_size;
+                config->num_frames = num_frames;
+                config->vaddr_len = vaddr_len;
+                config->offset_len = offset_len;
+                config->pt_levels = pt_levels;
+                config->tlb_entries = entries;
+                config->tlb_ways = ways;
+            }
+        }
     }
-    else  // Memory Access Command
-    {
-        int ret = sscanf(cmd, "%u %c %x %hhu\n", &pid, &rw, &address, &data);
 
-        if (ret == 4)
-        {
-            sim_mem_access(pid, rw, address, data);
+    replacement = configs[0].replacement;
+    num_frames = configs[0].num_frames;
+}
+
+/* Parses a size with an optional K, M or G suffix */
+uint64_t parse_size(const char *arg)
+{
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+    switch (*end) {
+    case 'G': case 'g': size <<= 10; /* fall through */
+    case 'M': case 'm': size <<= 10; /* fall through */
+    case 'K': case 'k': size <<= 10; end++; break;
+    default: break;
+    }
+    if (end == arg || *end) {
+        fprintf(stderr, "Invalid size: %s\n", arg);
+        exit(1);
+    }
+    return size;
+}
+
+/* Rejects memory geometries the simulator can't represent */
+void check_geometry(void)
+{
+    if (offset_len < 8 || offset_len > 24) {
+        fprintf(stderr, "ERROR: The page size must be between 256 bytes and 16 MiB.\n");
+        exit(1);
+    }
+    if (vaddr_len <= offset_len || vaddr_len > 32) {
+        fprintf(stderr, "ERROR: Virtual addresses must be wider than the page offset and at most 32 bits.\n");
+        exit(1);
+    }
+    if (pt_levels < 1 || pt_levels > 3) {
+        fprintf(stderr, "ERROR: Page tables may have between one and three levels.\n");
+        exit(1);
+    }
+    if (PT_VPN_BITS > pt_levels * PT_INDEX_BITS) {
+        fprintf(stderr, "ERROR: A %u-page address space does not fit in a %u-level page table of %u entries per frame.\n",
+                NUM_PAGES, pt_levels, PTES_PER_FRAME);
+        exit(1);
+    }
+    if ((uint32_t) huge_order > (uint32_t) (VADDR_LEN - OFFSET_LEN)) {
+        fprintf(stderr, "ERROR: A huge page cannot be larger than the virtual address space.\n");
+        exit(1);
+    }
+    if (fast_tier_size && (fast_tier_size >> OFFSET_LEN == 0 || fast_tier_size >> OFFSET_LEN >= NUM_FRAMES)) {
+        fprintf(stderr, "ERROR: The fast tier must hold at least one frame, but not all of physical memory.\n");
+        exit(1);
+    }
+    if (NUM_FRAMES < FRAME_TABLE_FRAMES + 2 + zero_pages) {
+        fprintf(stderr, "ERROR: Physical memory is too small to hold the frame table and a process.\n");
+        exit(1);
+    }
+}
+
+// Feeds every record of the trace to cmd, whichever form the trace is in
+void run_trace(void (*cmd)(const trace_record_t *))
+{
+    if (trace_records) {
+        /* main() releases the trace once every machine has run it */
+        for (uint64_t i = 0; i < trace_count; i++) {
+            cmd(&trace_records[i]);
+            step++;  // Increment the timestamp
         }
-        else
-        {
-            printf("Unable to parse trace file: Invalid memory access command encountered\n");
-            exit(1);
+    } else if (trace_bin_path) {
+        uint64_t count;
+        const trace_record_t *records = trace_map(trace_bin_path, &count);
+        for (uint64_t i = 0; i < count; i++) {
+            cmd(&records[i]);
+            step++;  // Increment the timestamp
+        }
+        trace_unmap(records, count);
+    } else {
+        /* Parse on another thread while this one simulates */
+        trace_reader_t *reader = trace_reader_start(trace_in);
+        const trace_record_t *rec;
+
+        while ((rec = trace_reader_next(reader))) {
+            cmd(rec);
+            step++;  // Increment the timestamp
         }
+        trace_reader_stop(reader);
+        fclose(trace_in);
+    }
+}
+
+// The sim_cmd function is run for each command in the trace file, after it
+// has been decoded into a trace record (see trace.h)
+void sim_cmd(const trace_record_t *cmd)
+{
+    /* Reclaim ahead of the step, so the step's checks cover it */
+    if (free_frames < reclaim_low) {
+        reclaim();
+    }
+
+    /* Like khugepaged, look for regions to promote every so often */
+    if (huge_order && step % HUGE_SCAN_INTERVAL == 0) {
+        for (uint32_t pid = 0; pid < MAX_PID; pid++) {
+            if (procs[pid].state == PROC_RUNNING) {
+                huge_scan(&procs[pid]);
+            }
+        }
+    }
+
+    /* Move hot pages to the fast tier, and cold ones out of their way */
+    if (fast_frames && step && step % TIER_SCAN_INTERVAL == 0) {
+        tier_migrate();
+    }
+
+    switch (cmd->op) {
+    case TRACE_START:
+        sim_start_proc(cmd->pid);
+        break;
+    case TRACE_STOP:
+        sim_stop_proc(cmd->pid);
+        break;
+    case TRACE_FORK:
+        sim_fork_proc(cmd->pid, cmd->address);
+        break;
+    case TRACE_SHM_CREATE:
+        sim_shm_create(cmd->data, cmd->address);
+        break;
+    case TRACE_SHM_ATTACH:
+        sim_shm_attach(cmd->pid, cmd->data, cmd->address);
+        break;
+    case TRACE_SHM_DETACH:
+        sim_shm_detach(cmd->pid, cmd->data);
+        break;
+    case TRACE_ACCESS:
+        sim_mem_access(cmd->cpu, cmd->pid, (char) cmd->rw, cmd->address, cmd->data);
+        break;
+    default:
+        printf("Unable to parse trace file: Invalid command encountered\n");
+        exit(1);
     }
 }
 
@@ -192,10 +811,10 @@ void sim_start_proc(uint32_t pid)
     new_proc->state = PROC_RUNNING;
     proc_init(new_proc);
 
-    printf("%8u: PID %u started\n", step, pid);
+    vlog_emit(step, 'S', pid, 0, 0);
     if (check_corruption)
     {
-        check_validity(1);
+        check_step(pid);
     }
 }
 
@@ -205,15 +824,129 @@ void sim_stop_proc(uint32_t pid)
     procs[pid].saved_ptbr = 0;
     procs[pid].state = PROC_STOPPED;
 
-    printf("%8u: PID %u stopped\n", step, pid);
+    /* No CPU runs the process any more, so the next access on a CPU that
+       ran it always switches to the process making that access */
+    for (uint32_t cpu = 0; cpu < num_cpus; cpu++) {
+        if (cpu_regs[cpu].process == &procs[pid]) {
+            cpu_regs[cpu].process = NULL;
+            cpu_regs[cpu].ptbr = 0;
+        }
+    }
+    if (current_process == &procs[pid]) {
+        current_process = NULL;
+        PTBR = 0;
+    }
+
+    vlog_emit(step, 'T', pid, 0, 0);
     if (check_corruption)
     {
-        check_validity(1);
+        check_step(pid);
+    }
+}
+
+void sim_fork_proc(uint32_t pid, uint32_t child)
+{
+    if (pid >= MAX_PID || child >= MAX_PID
+        || procs[pid].state != PROC_RUNNING || procs[child].state == PROC_RUNNING) {
+        printf("Unable to parse trace file: PID %u cannot fork PID %u\n", pid, child);
+        exit(1);
+    }
+
+    pcb_t *new_proc = &procs[child];
+    new_proc->pid = child;
+    new_proc->state = PROC_RUNNING;
+    proc_fork(&procs[pid], new_proc);
+
+    vlog_emit(step, 'F', pid, child, 0);
+    if (check_corruption)
+    {
+        check_step(child);
     }
 }
 
-void sim_mem_access(uint32_t pid, char rw, uint32_t address, uint8_t data)
+void sim_shm_create(uint32_t id, uint32_t pages)
 {
+    if (shm_segments[id].pages || pages == 0 || pages > NUM_PAGES) {
+        printf("Unable to parse trace file: Cannot create SHM %u with %u pages\n", id, pages);
+        exit(1);
+    }
+    shm_create(id, pages);
+
+    /* Nothing is mapped yet, so there is nothing to check */
+    vlog_emit(step, 'C', 0, pages, (uint8_t) id);
+}
+
+/* Whether the pages from base on are clear of anything the process has
+   mapped, swapped out or attached already */
+static int shm_range_free(pcb_t *proc, vpn_t base, uint32_t pages)
+{
+    for (uint32_t i = 0; i < pages; i++) {
+        pte_t *pte = pt_walk(proc->saved_ptbr, base + i, 0);
+        if ((pte && (pte->valid || pte->swap)) || shm_backing(proc, base + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void sim_shm_attach(uint32_t pid, uint32_t id, uint32_t address)
+{
+    uint32_t pages = shm_segments[id].pages;
+    vpn_t base = vaddr_vpn(address);
+    if (pid >= MAX_PID || procs[pid].state != PROC_RUNNING || !pages || shm_find(&procs[pid], id)
+        || vaddr_offset(address) || (uint64_t) address >> VADDR_LEN || pages > NUM_PAGES - base
+        || !shm_range_free(&procs[pid], base, pages)) {
+        printf("Unable to parse trace file: PID %u cannot attach SHM %u at 0x%x\n", pid, id, address);
+        exit(1);
+    }
+    shm_attach(&procs[pid], id, base);
+
+    vlog_emit(step, 'A', pid, address, (uint8_t) id);
+    if (check_corruption)
+    {
+        check_step(pid);
+    }
+}
+
+void sim_shm_detach(uint32_t pid, uint32_t id)
+{
+    if (pid >= MAX_PID || procs[pid].state != PROC_RUNNING || !shm_find(&procs[pid], id)) {
+        printf("Unable to parse trace file: PID %u cannot detach SHM %u\n", pid, id);
+        exit(1);
+    }
+    shm_detach(&procs[pid], id);
+
+    vlog_emit(step, 'D', pid, 0, (uint8_t) id);
+    if (check_corruption)
+    {
+        check_step(pid);
+    }
+}
+
+void sim_mem_access(uint32_t cpu, uint32_t pid, char rw, uint32_t address, uint8_t data)
+{
+    if ((uint64_t) address >> VADDR_LEN) {
+        printf("Unable to parse trace file: Address 0x%x is outside the %u-bit virtual address space\n",
+               address, VADDR_LEN);
+        exit(1);
+    }
+    if (cpu >= num_cpus) {
+        printf("Unable to parse trace file: CPU %u is not one of the %u CPUs (see -P)\n", cpu, num_cpus);
+        exit(1);
+    }
+
+    // If the access runs on another CPU than the last one, save the
+    // registers of that CPU and load those of this one
+    if (cpu != current_cpu)
+    {
+        cpu_regs[current_cpu].ptbr = PTBR;
+        cpu_regs[current_cpu].process = current_process;
+        current_cpu = cpu;
+        PTBR = cpu_regs[cpu].ptbr;
+        current_process = cpu_regs[cpu].process;
+        tlb_select_cpu(cpu);
+    }
+
     // If a process is currently running, and it's not this one,
     // do a context switch
     if (!current_process || current_process->pid != pid)
@@ -226,25 +959,360 @@ void sim_mem_access(uint32_t pid, char rw, uint32_t address, uint8_t data)
     uint8_t new_data = mem_access(address, rw, data);
 
     /* Print data for trace verification */
-    if (rw == 'r')
+    vlog_emit(step, (uint8_t) (rw == 'r' ? 'r' : 'w'), pid, address, rw == 'r' ? new_data : data);
+
+    if (check_corruption)
     {
-        printf("%8u: %3u  r  0x%05x -> %02hhx\n", step, pid, address, new_data);
+        check_touch_page(&procs[pid], vaddr_vpn(address));
+        check_step(pid);
     }
-    else
-    {
-        printf("%8u: %3u  w  0x%05x <- %02hhx\n", step, pid, address, data);
+}
+
+/* Frames changed since the last check, see check_touch_frame() */
+static SIM_LOCAL pfn_t *dirty_frames;
+static SIM_LOCAL uint32_t dirty_count;
+static SIM_LOCAL uint8_t *dirty_flag;
+static SIM_LOCAL pcb_t **dirty_owner;     /* The process and page mapped in each frame */
+static SIM_LOCAL vpn_t *dirty_owner_vpn;  /* when it was first touched */
+
+/* Pages changed since the last check, see check_touch_page() */
+typedef struct check_page_ref {
+    pcb_t *proc;
+    vpn_t vpn;
+} check_page_ref_t;
+
+static SIM_LOCAL check_page_ref_t *dirty_pages;
+static SIM_LOCAL uint32_t dirty_page_count;
+static SIM_LOCAL uint32_t dirty_page_capacity;
+
+void check_touch_frame(pfn_t pfn) {
+    if (!dirty_flag) {
+        dirty_frames = malloc(NUM_FRAMES * sizeof(pfn_t));
+        dirty_flag = calloc(NUM_FRAMES, sizeof(uint8_t));
+        dirty_owner = malloc(NUM_FRAMES * sizeof(pcb_t *));
+        dirty_owner_vpn = malloc(NUM_FRAMES * sizeof(vpn_t));
+        if (!dirty_frames || !dirty_flag || !dirty_owner || !dirty_owner_vpn) {
+            panic("could not allocate validity checker state");
+        }
+    }
+    if (dirty_flag[pfn]) {
+        return;
     }
+    dirty_flag[pfn] = 1;
+    dirty_frames[dirty_count++] = pfn;
+    dirty_owner[pfn] = frame_table[pfn].process;
+    dirty_owner_vpn[pfn] = frame_table[pfn].vpn;
+}
 
-    if (check_corruption)
-    {
+void check_touch_page(pcb_t *proc, vpn_t vpn) {
+    if (dirty_page_count == dirty_page_capacity) {
+        dirty_page_capacity = dirty_page_capacity ? dirty_page_capacity * 2 : 64;
+        dirty_pages = realloc(dirty_pages, dirty_page_capacity * sizeof(check_page_ref_t));
+        if (!dirty_pages) {
+            panic("could not allocate validity checker state");
+        }
+    }
+    dirty_pages[dirty_page_count].proc = proc;
+    dirty_pages[dirty_page_count].vpn = vpn;
+    dirty_page_count++;
+}
+
+/* Walks proc's page table to the entry for vpn like pt_walk(), but checks
+   every inner table on the way. Returns NULL if an inner table is missing. */
+static pte_t *check_walk(pcb_t *proc, vpn_t vpn) {
+    pfn_t table = proc->saved_ptbr;
+    for (uint32_t level = 0; level + 1 < pt_levels; level++) {
+        pte_t *dir = (pte_t *)(mem + (table * PAGE_SIZE)) + pt_index(vpn, level);
+        if (dir->valid != 0 && dir->valid != 1) {
+            panic("Page directory entry valid bit should either be zero or one");
+        }
+        if (!dir->valid) {
+            return NULL;
+        }
+        if (dir->pfn < FRAME_TABLE_FRAMES || dir->pfn >= NUM_FRAMES) {
+            panic("Page directory entry cannot point into the frame table or be >= the number of frames in the system");
+        }
+        if (!frame_table[dir->pfn].protected) {
+            panic("Frames holding inner page tables must be marked as protected");
+        }
+        table = dir->pfn;
+    }
+    return (pte_t *)(mem + (table * PAGE_SIZE)) + pt_index(vpn, pt_levels - 1);
+}
+
+/* Checks a single page table entry of a running process, and that the
+   frame table agrees with it */
+static pte_t *check_page(pcb_t *proc, vpn_t vpn) {
+    pte_t *pte = check_walk(proc, vpn);
+    if (!pte) {
+        return NULL;
+    }
+
+    if (pte->valid != 0 && pte->valid != 1) {
+        panic("Page table entry valid bit should either be zero or one");
+    }
+    if (pte->dirty != 0 && pte->dirty != 1) {
+        panic("Page table entry dirty bit should either be zero or one");
+    }
+
+    if (pte->zero) {
+        if (!pte->valid) {
+            panic("Only valid page table entries may map the zero frame");
+        }
+        if (pte->pfn != zero_frame || !zero_pages) {
+            panic("Zero page table entry does not map the zero frame");
+        }
+        if (pte->dirty) {
+            panic("Zero page table entry must not be dirty");
+        }
+        if (pte->swap && !swap_is_zero(pte)) {
+            panic("Zero page table entry has a swap entry that is not a zero marker");
+        }
+    } else if (pte->valid) {
+        pfn_t found_pfn = pte->pfn;
+        if (found_pfn < FRAME_TABLE_FRAMES || found_pfn > NUM_FRAMES - 1)  {
+            panic("PFN of page table entry cannot point into the frame table or be >= the number of frames in the system");
+        }
+        if (frame_table[found_pfn].protected) {
+            panic("Page table entry should not map to a protected frame");
+        }
+        if (!frame_table[found_pfn].mapped || !rmap_maps(found_pfn, proc, vpn)) {
+            panic("Frame table is inconsistent with page table entry");
+        }
+        if (pte->shm) {
+            pte_t *backing = shm_backing(proc, vpn);
+            if (!backing || !backing->valid || backing->pfn != found_pfn) {
+                panic("SHM page table entry does not map the frame its segment has the page in");
+            }
+            if (pte->cow || pte->swap) {
+                panic("SHM page table entry cannot be copy-on-write or have a swap entry");
+            }
+        } else if (frame_table[found_pfn].refcount > 1 && !pte->cow) {
+            panic("Page table entry maps a shared frame but is not copy-on-write");
+        }
+    } else if (pte->cow || pte->shm) {
+        panic("Only valid page table entries may be copy-on-write or map SHM pages");
+    }
+
+    if (pte->huge && (!huge_order || !pte->valid || pte->zero || pte->cow || pte->shm)) {
+        panic("Only valid pages a process has to itself may be part of a huge page");
+    }
+
+    if (pte->swap && !swap_queue_find(&swap_queue, pte->swap)) {
+        panic("Page table entry points to swap entry that does not exist");
+    }
+    return pte;
+}
+
+/* Re-validates the pages in the dirty set, and adds the frames they map to
+   that of the frames */
+static void check_dirty_pages(void) {
+    for (uint32_t i = 0; i < dirty_page_count; i++) {
+        pcb_t *proc = dirty_pages[i].proc;
+        if (proc->state != PROC_RUNNING) {
+            continue;
+        }
+        pte_t *pte = check_page(proc, dirty_pages[i].vpn);
+        if (pte && pte->valid && !pte->zero) {
+            check_touch_frame(pte->pfn);
+        }
+    }
+    dirty_page_count = 0;
+}
+
+/* Re-validates the frames in the dirty set, the page table entries that map
+   them now, and those of the pages they held before */
+static void check_dirty_frames(void) {
+    for (uint32_t i = 0; i < dirty_count; i++) {
+        pfn_t pfn = dirty_frames[i];
+        fte_t *fte = frame_table + pfn;
+        dirty_flag[pfn] = 0;
+
+        int is_free = !fte->protected && !fte->mapped;
+        if (frame_is_free(pfn) != is_free) {
+            panic("Free frame bitmap is inconsistent with the frame table");
+        }
+        if (fte->prefetched && !fte->mapped) {
+            panic("Only mapped frames can hold pages that were read ahead");
+        }
+        if (pfn < FRAME_TABLE_FRAMES) {
+            if (!fte->protected) {
+                panic("Frames holding the frame table should be marked as protected");
+            }
+            continue;
+        }
+
+        if (fte->protected) {
+            if (fte->mapped) {
+                panic("Page table entry should not map to a protected frame");
+            }
+        } else if (fte->mapped) {
+            if (fte->process < procs || fte->process >= procs + MAX_PID) {
+                panic("Mapped frame table entry contains invalid process pointer");
+            }
+            if (fte->process->state != PROC_RUNNING) {
+                panic("Found frame table entry mapped by a process that is not running");
+            }
+            pte_t *pte = check_page(fte->process, fte->vpn);
+            if (!pte || !pte->valid || pte->pfn != pfn) {
+                panic("Found frame table entry marked as mapped with no corresponding page table entry");
+            }
+
+            /* And every other page sharing it */
+            uint32_t cursor = 0, sharers = 1;
+            pcb_t *proc;
+            vpn_t vpn;
+            while (rmap_next(pfn, &cursor, &proc, &vpn)) {
+                if (proc < procs || proc >= procs + MAX_PID || proc->state != PROC_RUNNING) {
+                    panic("Found a shared frame mapped by a process that is not running");
+                }
+                pte = check_page(proc, vpn);
+                if (!pte || !pte->valid || pte->pfn != pfn) {
+                    panic("Found a shared frame with no corresponding page table entry");
+                }
+                sharers++;
+            }
+            if (fte->refcount != sharers) {
+                panic("Reference count of a frame does not match the pages mapping it");
+            }
+        } else if (fte->refcount || fte->rmap) {
+            panic("Frame table entry that is not mapped has pages sharing it");
+        }
+
+        /* The page that was evicted from the frame */
+        pcb_t *owner = dirty_owner[pfn];
+        if (owner >= procs && owner < procs + MAX_PID && owner->state == PROC_RUNNING) {
+            check_page(owner, dirty_owner_vpn[pfn]);
+        }
+    }
+    dirty_count = 0;
+}
+
+/* Runs after every step of the trace: either a full sweep, or just the
+   frames touched by the step and the PTBR of the process that ran it */
+void check_step(uint32_t pid) {
+    if (audit_interval && step % audit_interval == 0) {
         check_validity(1);
+        return;
+    }
+
+    if (procs[pid].state == PROC_RUNNING) {
+        pfn_t found_ptbr = procs[pid].saved_ptbr;
+        if (found_ptbr < FRAME_TABLE_FRAMES || found_ptbr >= NUM_FRAMES)  {
+            panic("PTBR of running process cannot point into the frame table or be >= the number of frames in the system");
+        }
+        if (!frame_table[found_ptbr].protected) {
+            panic("Frames corresponding to the page tables of running processes must be marked as protected");
+        }
+    }
+    check_cpu(current_cpu);
+    check_dirty_pages();
+    check_dirty_frames();
+}
+
+/* Checks that cpu runs a running process, on that process's page table */
+void check_cpu(uint32_t cpu) {
+    pcb_t *proc = cpu == current_cpu ? current_process : cpu_regs[cpu].process;
+    pfn_t ptbr = cpu == current_cpu ? PTBR : cpu_regs[cpu].ptbr;
+    if (proc && (proc->state != PROC_RUNNING || ptbr != proc->saved_ptbr)) {
+        panic("CPU runs a process that is not running, or not on its page table");
+    }
+}
+
+/* Scratch state for check_validity, one flag per frame */
+static SIM_LOCAL uint8_t *protected_frames_accounted_for;
+static SIM_LOCAL uint16_t *mapped_frames_accounted_for;  /* Pages seen mapping each frame */
+static SIM_LOCAL uint64_t huge_pages_accounted_for;
+
+/* Accounts for the inner tables of a multi-level page table */
+static void check_inner_tables(pfn_t table, uint32_t level) {
+    pte_t *dir = (pte_t *)(mem + (table * PAGE_SIZE));
+    if (level + 1 >= pt_levels) {
+        return;
+    }
+    for (uint32_t i = 0; i < pt_entries(level); i++) {
+        if (dir[i].valid != 0 && dir[i].valid != 1) {
+            panic("Page directory entry valid bit should either be zero or one");
+        }
+        if (!dir[i].valid) {
+            continue;
+        }
+        pfn_t found_pfn = dir[i].pfn;
+        if (found_pfn < FRAME_TABLE_FRAMES || found_pfn >= NUM_FRAMES) {
+            panic("Page directory entry cannot point into the frame table or be >= the number of frames in the system");
+        }
+        if (!frame_table[found_pfn].protected) {
+            panic("Frames holding inner page tables must be marked as protected");
+        }
+        if (protected_frames_accounted_for[found_pfn]) {
+            panic("Inner page table frame is referenced more than once");
+        }
+        protected_frames_accounted_for[found_pfn] = 1;
+        check_inner_tables(found_pfn, level + 1);
+    }
+}
+
+/* Checks every page on a running process's resident set, making sure the
+   frame table is consistent with any valid pages. Returns the number of
+   those pages that are swapped out. */
+static uint64_t check_resident_set(pcb_t *proc) {
+    uint64_t swapped = 0;
+    if (proc->page_count > proc->page_capacity) {
+        panic("Resident set is larger than its capacity");
+    }
+    for (uint32_t i = 0; i < proc->page_count; i++) {
+        pte_t *pte = check_page(proc, proc->pages[i]);
+        if (!pte) {
+            panic("Page on a resident set has no page table entry");
+        }
+        if (pte->listed != 1) {
+            panic("Page on a resident set is not marked as listed");
+        }
+
+        /* If valid, check sanity of pfn */
+        if (pte->valid && !pte->zero) {
+            pfn_t found_pfn = pte->pfn;
+
+            if (protected_frames_accounted_for[found_pfn]) {
+                panic("Page table entry should not map to a protected frame");
+            }
+
+            if (mapped_frames_accounted_for[found_pfn] >= frame_table[found_pfn].refcount) {
+                panic("Duplicate PFN found in page table");
+            }
+            mapped_frames_accounted_for[found_pfn]++;
+        }
+        if (pte->swap) {
+            swapped++;
+        }
+
+        /* Check a huge page as a whole through its first page */
+        vpn_t huge_mask = ((vpn_t) 1 << huge_order) - 1;
+        if (pte->huge && !(proc->pages[i] & huge_mask)) {
+            if (pte->pfn & huge_mask) {
+                panic("Huge page is not resident in an aligned block of frames");
+            }
+            for (vpn_t j = 1; j <= huge_mask; j++) {
+                pte_t *page = check_page(proc, proc->pages[i] + j);
+                if (!page || !page->huge || page->pfn != pte->pfn + j || page->dirty != pte->dirty) {
+                    panic("Huge page does not map its whole block of frames the same way");
+                }
+            }
+            huge_pages_accounted_for++;
+        }
     }
+    return swapped;
 }
 
 void check_validity(int checks) {
-    uint32_t pid, vpn, pfn, running_procs;
-    uint8_t protected_frames_accounted_for[NUM_FRAMES];
-    uint8_t mapped_frames_accounted_for[NUM_FRAMES];
+    uint32_t pid, pfn, running_procs;
+    if (!protected_frames_accounted_for) {
+        protected_frames_accounted_for = malloc(NUM_FRAMES);
+        mapped_frames_accounted_for = malloc(NUM_FRAMES * sizeof(uint16_t));
+        if (!protected_frames_accounted_for || !mapped_frames_accounted_for) {
+            panic("could not allocate validity checker state");
+        }
+    }
     for (pfn = 0; pfn < NUM_FRAMES; pfn++) {
         protected_frames_accounted_for[pfn] = 0;
         mapped_frames_accounted_for[pfn] = 0;
@@ -255,13 +1323,32 @@ void check_validity(int checks) {
         panic("Frame table should begin at the first frame in memory");
     }
 
-    if (!frame_table[0].protected) {
-        panic("Frame 0 should be marked as protected");
+    for (pfn = 0; pfn < FRAME_TABLE_FRAMES; pfn++) {
+        if (!frame_table[pfn].protected) {
+            panic("Frames holding the frame table should be marked as protected");
+        }
+        protected_frames_accounted_for[pfn] = 1;
+    }
+
+    if (zero_pages) {
+        if (zero_frame != FRAME_TABLE_FRAMES || !frame_table[zero_frame].protected) {
+            panic("The zero frame should follow the frame table and be marked as protected");
+        }
+        if (!page_is_zero(mem + (zero_frame * PAGE_SIZE))) {
+            panic("The zero frame must only hold zeroes");
+        }
+        protected_frames_accounted_for[zero_frame] = 1;
     }
-    protected_frames_accounted_for[0] = 1;
 
     if (checks < 1) return;
 
+    /* Everything is about to be checked anyway */
+    for (uint32_t i = 0; i < dirty_count; i++) {
+        dirty_flag[dirty_frames[i]] = 0;
+    }
+    dirty_count = 0;
+    dirty_page_count = 0;
+
     /* Validate the PTBRs are correct */
     running_procs = 0;
     for (pid = 0; pid < MAX_PID; pid++) {
@@ -270,8 +1357,8 @@ void check_validity(int checks) {
 
             /* Validate that PTBR points to a correct physical frame number */
             pfn_t found_ptbr = procs[pid].saved_ptbr;
-            if (found_ptbr <= 0 || found_ptbr > NUM_FRAMES)  {
-                panic("PTBR of running process cannot be zero or >= the number of frames in the system");
+            if (found_ptbr < FRAME_TABLE_FRAMES || found_ptbr >= NUM_FRAMES)  {
+                panic("PTBR of running process cannot point into the frame table or be >= the number of frames in the system");
             }
 
             /* Validate that page table page is marked as protected */
@@ -279,8 +1366,12 @@ void check_validity(int checks) {
                 panic("Frames corresponding to the page tables of running processes must be marked as protected");
             }
             protected_frames_accounted_for[found_ptbr] = 1;
+            check_inner_tables(found_ptbr, 0);
         }
     }
+    for (uint32_t cpu = 0; cpu < num_cpus; cpu++) {
+        check_cpu(cpu);
+    }
 
     /* Check for any protected frames that should not be protected */
     for (pfn = 0; pfn < NUM_FRAMES; pfn++) {
@@ -289,79 +1380,139 @@ void check_validity(int checks) {
         }
     }
 
-    /* Validate the page table entries are correct */
+    /* Check that the free frame bitmap and counts agree with the frame table */
+    uint32_t free_count = 0, mapped_count = 0;
+    for (pfn = 0; pfn < NUM_FRAMES; pfn++) {
+        int is_free = !frame_table[pfn].protected && !frame_table[pfn].mapped;
+        if (frame_is_free((pfn_t) pfn) != is_free) {
+            panic("Free frame bitmap is inconsistent with the frame table");
+        }
+        free_count += (uint32_t) is_free;
+        mapped_count += !frame_table[pfn].protected && frame_table[pfn].mapped;
+    }
+    if (free_count != free_frames || mapped_count != mapped_frames) {
+        panic("Free or mapped frame count is inconsistent with the frame table");
+    }
+
+    /* Validate the page table entries on every resident set are correct */
+    uint64_t swapped = 0;
+    huge_pages_accounted_for = 0;
     for (pid = 0; pid < MAX_PID; pid++) {
         if (procs[pid].state == PROC_RUNNING) {
-            pfn_t found_ptbr = procs[pid].saved_ptbr;
-
-            /* Scan the entire page table, make sure frame table is
-               consistent with any valid pages */
-            pte_t *pgtable = (pte_t *)(mem + (found_ptbr * PAGE_SIZE));
-            for (vpn = 0; vpn < NUM_PAGES; vpn++) {
-                /* Check basic sanity of boolean flags */
-                if (pgtable[vpn].valid != 0 && pgtable[vpn].valid != 1) {
-                    panic("Page table entry valid bit should either be zero or one");
-                }
-
-                if (pgtable[vpn].dirty != 0 && pgtable[vpn].dirty != 1) {
-                    panic("Page table entry dirty bit should either be zero or one");
-                }
-
-                /* If valid, check sanity of pfn */
-                if (pgtable[vpn].valid) {
-                    pfn_t found_pfn = pgtable[vpn].pfn;
-
-                    /* Check basic ranges */
-                    if (found_pfn <= 0 || found_pfn > NUM_FRAMES - 1)  {
-                        panic("PFN of page table entry cannot be zero or >= the number of frames in the system");
-                    }
-
-                    if (protected_frames_accounted_for[found_pfn]) {
-                        panic("Page table entry should not map to a protected frame");
-                    }
-
-                    if (mapped_frames_accounted_for[found_pfn]) {
-                        panic("Duplicate PFN found in page table");
-                    }
-
-                    if (frame_table[found_pfn].process < procs
-                        || frame_table[found_pfn].process >= procs + MAX_PID) {
-                        panic("Mapped frame table entry contains invalid process pointer");
-                    }
+            swapped += check_resident_set(&procs[pid]);
+        }
+    }
 
-                    /* Check that frame table agrees with page table */
-                    if (!frame_table[found_pfn].mapped
-                        || !(frame_table[found_pfn].process->pid == pid)
-                        || !(frame_table[found_pfn].vpn == vpn)) {
-                        panic("Frame table is inconsistent with page table entry");
-                    }
-                    mapped_frames_accounted_for[found_pfn] = 1;
-                }
+    if (huge_pages_accounted_for != stats.huge_mappings) {
+        panic("Count of huge pages is inconsistent with the page tables");
+    }
+    if (fast_frames && stats.fast_accesses + stats.slow_accesses != stats.accesses) {
+        panic("Every access must be to either the fast or the slow memory tier");
+    }
 
-                /* Check the validity of swap entry */
-                if (pgtable[vpn].swap && !swap_queue_find(&swap_queue, pgtable[vpn].swap)) {
-                    panic("Page table entry points to swap entry that does not exist");
+    /* As are those of the SHM segments, whose resident pages must be mapped */
+    for (uint32_t id = 0; id < MAX_SHM; id++) {
+        const shm_segment_t *seg = shm_segments + id;
+        for (uint32_t i = 0; i < seg->pages; i++) {
+            const pte_t *backing = seg->backing + i;
+            if (backing->valid && (backing->pfn >= NUM_FRAMES || !frame_table[backing->pfn].mapped)) {
+                panic("SHM page is resident in a frame that is not mapped");
+            }
+            if (backing->swap) {
+                if (!swap_queue_find(&swap_queue, backing->swap)) {
+                    panic("SHM page points to swap entry that does not exist");
                 }
+                swapped++;
             }
         }
     }
 
+    /* A swapped out page missing from its resident set would never be freed */
+    if (swapped != swap_queue.size) {
+        panic("Swap entries are in use by pages that are not on any resident set");
+    }
+
     /* Check that all frames that are mapped are accounted for */
     for (pfn = 0; pfn < NUM_FRAMES; pfn++){
         if (!frame_table[pfn].protected && frame_table[pfn].mapped && !(mapped_frames_accounted_for[pfn])) {
             printf("%u\n", pfn);
             panic("Found frame table entry marked as mapped with no corresponding page table entry");
         }
+        if (!frame_table[pfn].protected && mapped_frames_accounted_for[pfn] != frame_table[pfn].refcount) {
+            panic("Reference count of a frame does not match the pages mapping it");
+        }
     }
 }
 
+/* Frees the checker's state */
+void check_teardown(void) {
+    /* A sweep may run another machine on this thread next */
+    free(dirty_frames);
+    free(dirty_flag);
+    free(dirty_owner);
+    free(dirty_owner_vpn);
+    dirty_frames = NULL;
+    dirty_flag = NULL;
+    dirty_owner = NULL;
+    dirty_owner_vpn = NULL;
+    dirty_count = 0;
+    free(dirty_pages);
+    dirty_pages = NULL;
+    dirty_page_count = 0;
+    dirty_page_capacity = 0;
+    free(protected_frames_accounted_for);
+    free(mapped_frames_accounted_for);
+    protected_frames_accounted_for = NULL;
+    mapped_frames_accounted_for = NULL;
+}
+
 void print_help_and_exit() {
     printf("./vm-sim [OPTIONS] -i traces/file.trace -r<replacement algorithm>\n");
     printf("  -i\t\tReads the trace from the specified path\n");
     printf("  -s\t\tReads the trace from standard input\n");
-    printf("  -r\t\tSelect the replacement algorithm (either 'random' or 'clocksweep')\n");
+    printf("  -b\t\tReads a binary trace (see -o) from the specified path\n");
+    printf("  -o\t\tConverts the text trace given by -i or -s to a binary trace\n");
+    printf("    \t\tat the specified path instead of simulating it\n");
+    printf("  -M\t\tWrites the LRU miss ratio curve for every frame count\n");
+    printf("    \t\tas CSV to the specified path (- for stdout) instead of\n");
+    printf("    \t\tsimulating the trace\n");
+    printf("  -r\t\tSelect the replacement algorithm, one of\n");
+    printf("    \t\trandom, clocksweep, aging, wsclock, 2q, arc, clockpro\n");
+    printf("    \t\tor opt (offline optimal, reads the whole trace first)\n");
+    printf("  -q\t\tQuiet mode: print only the summary statistics\n");
+    printf("  -l\t\tWrites the per-step verification log to the specified\n");
+    printf("    \t\tpath in binary form instead of printing it\n");
+    printf("  -L\t\tRenders a binary verification log (see -l) as text\n");
+    printf("  -t\t\tEnables a TLB of <entries>[:<ways>] (default 4-way)\n");
+    printf("  -j\t\tSimulates at most this many machines at once in a sweep\n");
+    printf("    \t\t(default: one per CPU). A sweep simulates every combination\n");
+    printf("    \t\tof comma-separated lists given to -r, -m and -t, e.g.\n");
+    printf("    \t\t-r clocksweep,arc -m 256K,1M -t 0,64\n");
+    printf("  -m\t\tPhysical memory size, e.g. 1M (default 1M)\n");
+    printf("  -v\t\tVirtual address width in bits (default 24)\n");
+    printf("  -p\t\tPage size, a power of two, e.g. 16K (default 16K)\n");
+    printf("  -n\t\tNumber of page table levels, 1 to 3 (default 1)\n");
+    printf("  -z\t\tMaps pages first touched by a read to a shared zero frame,\n");
+    printf("    \t\tcopying on write, and swaps out all-zero pages as markers\n");
+    printf("  -Z\t\tKeeps up to this many bytes of compressed pages in memory,\n");
+    printf("    \t\te.g. 256K, before writing evicted pages to disk\n");
+    printf("  -F\t\tKeeps swap in a sparse file in the specified directory,\n");
+    printf("    \t\twritten back by a separate thread, instead of in memory\n");
+    printf("  -R\t\tReads up to this many pages ahead of sequential or strided\n");
+    printf("    \t\tfaults into free frames (default 0, off)\n");
+    printf("  -W\t\t<low>:<high> reclaims pages in the background whenever fewer than\n");
+    printf("    \t\tlow percent of frames are free, until high percent are (default off)\n");
+    printf("  -H\t\tMaps fully resident, aligned regions of 2^<order> pages as\n");
+    printf("    \t\thuge pages, <order> from 1 to 6 (default 0, off)\n");
+    printf("  -P\t\tSimulates this many CPUs, each with its own TLB; accesses\n");
+    printf("    \t\tname their CPU after the value (default 1). TLB shootdown\n");
+    printf("    \t\tinterrupts are only modelled with -t\n");
+    printf("  -T\t\tMakes the first <size> bytes of memory a fast tier and the\n");
+    printf("    \t\trest a slow one, migrating hot pages to the fast tier\n");
     printf("  -c\t\tEnables strict memory corruption checking\n");
     printf("    \t\t(automatically checks a variety of conditions that can cause bugs)\n");
+    printf("  -a\t\tWith -c, sweeps all page tables every <steps> steps instead\n");
+    printf("    \t\tof only at the start and end (1 sweeps after every step)\n");
     printf("  -h\t\tThis helpful output\n");
     exit(0);
 }
@@ -11,6 +11,12 @@
 #define PROC_RUNNING 1
 #define PROC_STOPPED 0
 
+/* A shared memory segment attached to a process (see shm.c) */
+typedef struct shm_attachment {
+    uint32_t id;
+    uint32_t base;              /* The VPN of its first page */
+} shm_attachment_t;
+
 /*
  * A process control block (PCB).
  *
@@ -21,24 +27,44 @@ typedef struct process {
     uint32_t pid;
     uint8_t state;
     pfn_t saved_ptbr;
+    vpn_t *pages;               /* The process's resident set, see
+                                   proc_track_page() */
+    uint32_t page_count;
+    uint32_t page_capacity;
+    /* Readahead state, see readahead.c */
+    vpn_t ra_prev;              /* The last fault, or the last page read ahead */
+    vpn_t ra_expect;            /* Where a continuing scan faults next */
+    int32_t ra_stride;
+    uint32_t ra_window;
+    uint32_t ra_issued;         /* Pages read ahead by the last batch */
+    uint32_t ra_hits;           /* and how many of them were used since */
+    shm_attachment_t *shm;      /* Shared memory segments attached */
+    uint32_t shm_count;
+    uint32_t shm_capacity;
 } pcb_t;
 
 /*
  * Memory parameters.
  *
- * These will be provided by the user when they run the simulator.
+ * These will be provided by the user when they run the simulator (see -m, -v
+ * and -p). The defaults model 1 MiB of physical memory, 24-bit virtual
+ * addresses and 16 KiB pages. Pages are always a power of two in size, so
+ * splitting an address stays a shift and a mask; physical memory may be any
+ * whole number of frames.
  */
+extern SIM_LOCAL uint32_t num_frames;     /* Number of physical frames */
+extern SIM_LOCAL uint8_t vaddr_len;       /* Width of a virtual address, in bits */
+extern SIM_LOCAL uint8_t offset_len;      /* Width of the page offset, in bits */
 
-#define PADDR_LEN 20
-#define VADDR_LEN 24
-#define OFFSET_LEN 14
+#define VADDR_LEN vaddr_len
+#define OFFSET_LEN offset_len
 
-#define PAGE_SIZE (1 << OFFSET_LEN)
+#define PAGE_SIZE ((size_t) 1 << OFFSET_LEN)
 
-#define MEM_SIZE (1 << PADDR_LEN)
+#define MEM_SIZE ((size_t) NUM_FRAMES << OFFSET_LEN)
 
-#define NUM_PAGES (1 << (VADDR_LEN - OFFSET_LEN))
-#define NUM_FRAMES (1 << (PADDR_LEN - OFFSET_LEN))
+#define NUM_PAGES ((uint32_t) 1 << (VADDR_LEN - OFFSET_LEN))
+#define NUM_FRAMES num_frames
 
 /*
  * Global Data Structures
@@ -46,22 +72,42 @@ typedef struct process {
 
 /* These will be provided by the simulator, but managed by the student. */
 
-extern uint8_t *mem;            /* physical memory itself */
+extern SIM_LOCAL uint8_t *mem;            /* physical memory itself */
 
-extern pfn_t PTBR;              /* The page table base register.
+extern SIM_LOCAL pfn_t PTBR;              /* The page table base register.
 
-                                   The PTBR tells the paging hardware
-                                   where to look to find the page table
-                                   for the currently running process. */
+                                             The PTBR tells the paging hardware
+                                             where to look to find the page table
+                                             for the currently running process. */
 
 /* This will be provided and managed by the simulator */
-extern pcb_t *current_process;  /* The currently running process */
+extern SIM_LOCAL pcb_t *current_process;  /* The currently running process */
+
+/*
+ * CPUs
+ *
+ * With -P the machine has several CPUs, each running a process of its own
+ * with its own TLB, and every access in the trace names the CPU it runs on.
+ * PTBR and current_process are always the registers of the CPU running the
+ * current step: the simulator saves them and loads those of the next CPU
+ * whenever the trace moves to another one.
+ */
+#define MAX_CPUS 64
+
+extern uint32_t num_cpus;
+extern SIM_LOCAL uint32_t current_cpu;
 
 
 /* The replacement strategy to use */
-extern uint8_t replacement;
+extern SIM_LOCAL uint8_t replacement;
 #define RANDOM 1
 #define CLOCKSWEEP 2
+#define AGING 3
+#define WSCLOCK 4
+#define TWOQ 5
+#define ARC 6
+#define CLOCKPRO 7
+#define OPT 8
 
 /*
  * Timestamps
@@ -69,3 +115,74 @@ extern uint8_t replacement;
  * Used in the simulator
  */
 typedef uint32_t timestamp_t;
+
+/* The index of the trace record being simulated */
+extern SIM_LOCAL timestamp_t step;
+
+/*
+ * Corruption checking
+ *
+ * With -c the simulator validates its data structures after every step.
+ * Rather than sweeping every page table each time, it re-validates only the
+ * frames the paging code changed, which report themselves through
+ * check_touch_frame(), the pages whose entries changed without any frame
+ * changing state, through check_touch_page(), and the page each access
+ * went to; a full sweep still runs at the start and end of the run and,
+ * with -a, every so many steps.
+ */
+extern uint8_t check_corruption;
+
+/*
+ * Zero pages
+ *
+ * With -z, a page first touched by a read is mapped to one shared, protected
+ * frame of zeroes (zero_frame, see paging.h) instead of a frame of its own,
+ * and gets a frame only when it is first written (copy-on-write). Dirty
+ * pages that hold nothing but zeroes when evicted are recorded in swap as a
+ * zero marker instead of a copy of the page.
+ */
+extern uint8_t zero_pages;
+
+/*
+ * Compressed swap
+ *
+ * With -Z, evicted pages are compressed and kept in memory, up to this many
+ * compressed bytes, before any are written to disk (see swap.h). 0 disables
+ * the compressed tier.
+ */
+extern uint64_t zswap_budget;
+
+/* With -F, the directory to keep swap files in (see swapfile.h), or NULL to
+   keep swap in the heap */
+extern const char *swap_dir;
+
+/* With -R, the most pages readahead maps around a fault (see readahead.c);
+   0 disables readahead */
+extern uint32_t readahead_max;
+
+/* With -W, the free-frame watermarks for background reclaim, in percent of
+   memory (see paging.h); 0 disables reclaim */
+extern uint8_t reclaim_low_pct;
+extern uint8_t reclaim_high_pct;
+
+/* With -H, huge pages span 2^huge_order pages (see paging.h); 0 disables
+   them */
+extern uint8_t huge_order;
+
+/* With -T, the size in bytes of the fast memory tier, which is the first
+   fast_frames frames of memory (see paging.h); 0 disables tiering */
+extern uint64_t fast_tier_size;
+extern SIM_LOCAL uint32_t fast_frames;
+
+/**
+ * Adds pfn, and the page that was mapped in it, to the set of frames to
+ * re-validate after this step. Only called while checking is enabled.
+ */
+void check_touch_frame(pfn_t pfn);
+
+/**
+ * Adds vpn of proc, and the frame it maps, to the set of pages to re-validate
+ * after this step. For changes to a page table entry that leave the state of
+ * every frame alone. Only called while checking is enabled.
+ */
+void check_touch_page(pcb_t *proc, vpn_t vpn);
@@ -18,6 +18,17 @@ typedef struct ptable_entry {
     uint8_t dirty;              /* 1 if the entry has been modified from its
                                    form on disk and must be written back when it
                                    is next evicted. */
+    uint8_t listed;             /* 1 if the VPN is on the owning process's
+                                   resident set list */
+    unsigned zero : 1;          /* 1 if the entry maps the shared zero frame
+                                   read-only, to be copied on the first write */
+    unsigned cow : 1;           /* 1 if the entry maps a frame shared since a
+                                   FORK read-only, to be copied on the first
+                                   write (see fork.c) */
+    unsigned shm : 1;           /* 1 if the entry maps a page of a shared
+                                   memory segment (see shm.c) */
+    unsigned huge : 1;          /* 1 if the entry is part of a huge page
+                                   (see huge.c) */
     pfn_t pfn;                 /* The physical frame number (PFN) this entry
                                    maps to. */
     swap_entry_t swap;          /* The swap entry mapped to this page. Use this
@@ -26,7 +37,46 @@ typedef struct ptable_entry {
                                    when a dirty frame is written to the disk. */
 } pte_t;
 
-// NOTE: the entire page table for a process is found in a single frame table entry
+// NOTE: by default the entire page table for a process is found in a single
+// frame table entry
+
+/* The number of page table entries that fit in one frame */
+#define PTES_PER_FRAME ((uint32_t) (PAGE_SIZE / sizeof(pte_t)))
+
+/*
+ * Hierarchical page tables.
+ *
+ * With pt_levels > 1 (see -n), the VPN is split into pt_levels indices. The
+ * frame named by the PTBR holds the top-level table, whose valid entries
+ * point (through their pfn) at the next level down; only the last level
+ * holds real page mappings. Inner tables are allocated on demand through
+ * free_frame() and are protected like the top-level table. Every level but
+ * the top indexes a full frame of PTES_PER_FRAME entries; the top level
+ * takes whatever VPN bits remain. With more levels than the address space
+ * needs, none remain, and the top-level table only ever uses its first
+ * entry, like a real machine running a 5-level table over a smaller space.
+ */
+extern SIM_LOCAL uint8_t pt_levels;
+
+#define PT_INDEX_BITS ((uint32_t) __builtin_ctz(PTES_PER_FRAME))
+#define PT_VPN_BITS ((uint32_t) (VADDR_LEN - OFFSET_LEN))
+#define PT_INNER_BITS ((uint32_t) (pt_levels - 1) * PT_INDEX_BITS)
+#define PT_TOP_BITS (PT_VPN_BITS > PT_INNER_BITS ? PT_VPN_BITS - PT_INNER_BITS : 0)
+
+/* The number of entries in a table at the given level (0 is the top) */
+static inline uint32_t pt_entries(uint32_t level) {
+    return level ? PTES_PER_FRAME : (uint32_t) 1 << PT_TOP_BITS;
+}
+
+/* The VPN bits covered by one entry of a table at the given level */
+static inline uint32_t pt_shift(uint32_t level) {
+    return (pt_levels - 1 - level) * PT_INDEX_BITS;
+}
+
+/* The index of vpn's entry in its table at the given level */
+static inline uint32_t pt_index(vpn_t vpn, uint32_t level) {
+    return (vpn >> pt_shift(level)) & (pt_entries(level) - 1);
+}
 
 /*
  * An entry in the frame table.
@@ -52,13 +102,116 @@ typedef struct ft_entry {
                                    otherwise */
     uint8_t referenced;      /* 1 if the entry has been recently
                                    accessed, 0 otherwise */
+    uint8_t prefetched;         /* 1 if the page was read ahead and has not
+                                   been accessed since */
+    uint16_t refcount;          /* The number of pages mapping the frame: 1
+                                   unless it is shared since a FORK or holds
+                                   a page of an SHM segment */
+    uint16_t heat;              /* With -T, the recent accesses to the page,
+                                   see tier_migrate() */
     pcb_t *process;             /* A pointer to the owning process's PCB */
     vpn_t vpn;                  /* The VPN mapped by the process using this frame. */
+    uint32_t rmap;              /* The other pages sharing the frame, see
+                                   rmap_next() */
 } fte_t;
 
 /* A convenient global reference to the frame table, which you will
    set up in paging.c */
-extern fte_t *frame_table;      /* The frame table */
+extern SIM_LOCAL fte_t *frame_table;      /* The frame table */
+
+/* The number of frames, starting at frame 0, occupied by the frame table */
+#define FRAME_TABLE_FRAMES ((uint32_t) ((NUM_FRAMES * sizeof(fte_t) + PAGE_SIZE - 1) / PAGE_SIZE))
+
+/* With -z, the protected frame of zeroes shared by every zero page (see
+   zero_pages in pagesim.h), right after the frame table. 0 otherwise. */
+extern SIM_LOCAL pfn_t zero_frame;
+
+/*
+ * The free frame bitmap.
+ *
+ * Bit i is set iff frame i is neither protected nor mapped, so the lowest
+ * free frame can be found a word at a time instead of scanning the whole
+ * frame table. free_frame() clears the bit of every frame it hands out, and
+ * proc_cleanup() sets it again for every frame a process releases. As every
+ * change of a frame's state goes through here, these also feed the dirty set
+ * of the corruption checker (see check_touch_frame()).
+ */
+#define FREE_MAP_WORDS ((NUM_FRAMES + 63) / 64)
+
+extern SIM_LOCAL uint64_t *free_frame_map;
+
+/* The number of free frames, and of frames holding a mapped page */
+extern SIM_LOCAL uint32_t free_frames;
+extern SIM_LOCAL uint32_t mapped_frames;
+
+static inline void frame_mark_free(pfn_t pfn) {
+    uint64_t bit = (uint64_t) 1 << (pfn % 64);
+    free_frames += !(free_frame_map[pfn / 64] & bit);
+    free_frame_map[pfn / 64] |= bit;
+    if (check_corruption) {
+        check_touch_frame(pfn);
+    }
+}
+
+static inline void frame_mark_used(pfn_t pfn) {
+    uint64_t bit = (uint64_t) 1 << (pfn % 64);
+    free_frames -= !!(free_frame_map[pfn / 64] & bit);
+    free_frame_map[pfn / 64] &= ~bit;
+    if (check_corruption) {
+        check_touch_frame(pfn);
+    }
+}
+
+static inline int frame_is_free(pfn_t pfn) {
+    return (free_frame_map[pfn / 64] >> (pfn % 64)) & 1;
+}
+
+/* Returns the lowest-numbered free frame, or NUM_FRAMES if there is none. */
+static inline pfn_t frame_find_free(void) {
+    for (uint32_t w = 0; w < FREE_MAP_WORDS; w++) {
+        if (free_frame_map[w]) {
+            return (pfn_t) (w * 64 + (uint32_t) __builtin_ctzll(free_frame_map[w]));
+        }
+    }
+    return NUM_FRAMES;
+}
+
+/* Returns the lowest-numbered frame starting a run of 2^order free frames
+   aligned to 2^order, or NUM_FRAMES if there is none. order is at most 6, so
+   such a run never straddles two words of the map. */
+static inline pfn_t frame_find_free_block(uint32_t order) {
+    uint32_t n = 1u << order;
+    uint64_t starts = 0;
+    for (uint32_t i = 0; i < 64; i += n) {
+        starts |= (uint64_t) 1 << i;
+    }
+    for (uint32_t w = 0; w < FREE_MAP_WORDS; w++) {
+        /* Leave bit i set only if bits i to i + n - 1 all are */
+        uint64_t run = free_frame_map[w];
+        for (uint32_t s = 1; s < n; s <<= 1) {
+            run &= run >> s;
+        }
+        run &= starts;
+        if (run) {
+            return (pfn_t) (w * 64 + (uint32_t) __builtin_ctzll(run));
+        }
+    }
+    return NUM_FRAMES;
+}
+
+/*
+ * Resident sets.
+ *
+ * Every process keeps a list (pcb_t.pages) of the VPNs it may have a valid
+ * mapping or a swap entry for, so proc_cleanup() and the corruption checker
+ * visit only the pages a process actually touched rather than every entry of
+ * its page table. page_fault() adds a page the first time it is mapped, and
+ * the listed bit of its page table entry keeps it from being added twice.
+ * Evicting a page does not take it off the list: a clean page that was never
+ * swapped out leaves nothing behind, and such pages are dropped whenever the
+ * list fills up and is compacted, which keeps the list at most about twice
+ * the number of pages the process has in memory or in swap.
+ */
 
 /*
  * Paging functions.
@@ -75,4 +228,215 @@ void proc_cleanup(pcb_t *proc);
 uint8_t mem_access(vaddr_t address, char write, uint8_t data);
 
 pfn_t free_frame(void);
-void page_fault(vaddr_t address);
+void evict_frame(pfn_t victim_pfn, int background);
+pte_t *pt_walk(pfn_t root, vpn_t vpn, int alloc);
+void proc_track_page(pcb_t *proc, vpn_t vpn, pte_t *pte);
+void readahead(vpn_t vpn);
+void readahead_reset(pcb_t *proc);
+
+/*
+ * Background reclaim.
+ *
+ * With -W, the simulator calls reclaim() before a step whenever fewer than
+ * reclaim_low frames are free. Like kswapd, it evicts the pages the
+ * replacement policy picks, writing back the dirty ones, until
+ * reclaim_high frames are free, so faults find a clean free frame instead of
+ * paying for an eviction and writeback themselves. Both watermarks are 0
+ * without -W.
+ *
+ * Each pass then cleans up to RECLAIM_CLEAN_MAX dirty pages that have not
+ * been accessed in the last RECLAIM_CLEAN_AGE accesses: they are written
+ * back but stay resident, so when they are evicted later they are clean.
+ * reclaim_last_use holds the access count at each frame's last access.
+ */
+#define RECLAIM_CLEAN_MAX 32
+#define RECLAIM_CLEAN_AGE ((uint64_t) NUM_FRAMES)
+
+extern SIM_LOCAL uint32_t reclaim_low;
+extern SIM_LOCAL uint32_t reclaim_high;
+extern SIM_LOCAL uint64_t *reclaim_last_use;
+
+void reclaim(void);
+
+/*
+ * Huge pages.
+ *
+ * With -H, an aligned region of 2^huge_order pages of a process that is
+ * resident in 2^huge_order contiguous, aligned frames is mapped as one huge
+ * page, which the TLB caches in a single entry. A huge page is also dirty
+ * as a whole: a write to any of its pages marks them all dirty.
+ *
+ * huge_frame() gives a faulting page a frame through a reservation: the
+ * frame at the page's offset in the block its region's other pages are
+ * resident in, or in a whole free block if none is resident yet.
+ * Reservations are best-effort: the rest of the block stays free for
+ * anything else to take, as holding it would leave frames idle that could
+ * not be given back under memory pressure. A page whose frame in the block
+ * was taken gets one from free_frame() instead, and its region can then
+ * only be promoted by copying. Every HUGE_SCAN_INTERVAL steps, huge_scan()
+ * looks for regions that are fully resident, like khugepaged, and promotes
+ * them, first copying their pages into a free block if they are not in one
+ * already. A huge page is
+ * split back into its pages by huge_split() before any of them is evicted
+ * or shared.
+ */
+#define HUGE_SCAN_INTERVAL 256
+
+pfn_t huge_frame(vpn_t vpn);
+void huge_scan(pcb_t *proc);
+void huge_split(pcb_t *proc, vpn_t vpn);
+
+/**
+ * Marks every page of the huge page vpn of proc is in dirty.
+ */
+void huge_mark_dirty(pcb_t *proc, vpn_t vpn);
+
+/*
+ * Memory tiers.
+ *
+ * With -T, the first fast_frames frames of memory are a fast tier, like
+ * local DRAM, and the rest a slow one, like CXL-attached memory, which
+ * takes SLOW_MEMORY_ACCESS_TIME to access (see stats.h). Free frames are
+ * handed out lowest first, so new pages land in the fast tier while it has
+ * room.
+ *
+ * Every access adds to the heat of its frame. Every TIER_SCAN_INTERVAL
+ * steps, tier_migrate() promotes the hottest pages of the slow tier, at
+ * most TIER_MIGRATE_MAX pages at a time: into free frames of the fast tier
+ * while there are any, then by trading places with pages of the fast tier
+ * that are less than half as hot, which demotes those. It then halves the
+ * heat of every frame, so heat follows recent use. Page tables, the zero
+ * frame and the pages of huge pages never move.
+ */
+#define TIER_SCAN_INTERVAL 1024
+#define TIER_MIGRATE_MAX 32
+#define TIER_HOT 4              /* The least heat worth promoting */
+
+void tier_migrate(void);
+
+/**
+ * Frees the state tier_migrate() keeps between passes.
+ */
+void tier_teardown(void);
+
+/**
+ * Moves the page in the mapped frame from to the free frame to, updating
+ * every page table entry that maps it.
+ */
+void frame_move(pfn_t from, pfn_t to);
+
+/**
+ * Trades the pages in the mapped frames a and b, updating every page table
+ * entry that maps them.
+ */
+void frame_exchange(pfn_t a, pfn_t b);
+
+/*
+ * FORK and copy-on-write.
+ *
+ * proc_fork() starts child as a copy of parent. Resident pages are not
+ * copied: both processes map the same frame read-only (the cow bit), and
+ * the first write from either copies the page into a frame of its own (see
+ * page_fault()). Pages that are swapped out get a copy of their swap entry.
+ * The child is also attached to every SHM segment its parent has attached,
+ * whose pages the two share outright.
+ *
+ * A shared frame keeps its first page in the frame table entry as usual,
+ * and every other page mapping it on a reverse map chain, so that it can be
+ * unmapped from all of them when it is evicted. refcount counts them all.
+ */
+void proc_fork(pcb_t *parent, pcb_t *child);
+
+/**
+ * Adds vpn of proc to the pages sharing the mapped frame pfn.
+ */
+void rmap_add(pfn_t pfn, pcb_t *proc, vpn_t vpn);
+
+/**
+ * Removes vpn of proc from the pages sharing pfn, which must be more than
+ * one. If it was the page in the frame table entry, another takes its place,
+ * which the replacement policy sees as the frame being evicted and faulted
+ * in again.
+ */
+void rmap_remove(pfn_t pfn, pcb_t *proc, vpn_t vpn);
+
+/**
+ * Takes a page other than the one in the frame table entry off the pages
+ * sharing pfn. Returns 0 if there is none.
+ */
+int rmap_pop(pfn_t pfn, pcb_t **proc, vpn_t *vpn);
+
+/**
+ * Steps through the pages sharing pfn other than the one in the frame table
+ * entry. Start with *cursor set to 0; returns 0 once there are no more.
+ */
+int rmap_next(pfn_t pfn, uint32_t *cursor, pcb_t **proc, vpn_t *vpn);
+
+/**
+ * Returns 1 if vpn of proc is one of the pages mapping pfn.
+ */
+int rmap_maps(pfn_t pfn, const pcb_t *proc, vpn_t vpn);
+
+/**
+ * Frees the reverse map.
+ */
+void rmap_teardown(void);
+
+/*
+ * Shared memory segments.
+ *
+ * SHM_CREATE makes a segment of some number of pages, which processes map
+ * into their address space with SHM_ATTACH and unmap with SHM_DETACH. A
+ * page of a segment is faulted in like any other the first time, but a
+ * process faulting on a page another process already has resident just maps
+ * the same frame (a minor fault), shared through the reverse map.
+ *
+ * Each page of a segment has a backing entry, which holds the frame the
+ * page is resident in and the page's swap entry. The segment, not the
+ * processes, owns the swap entry, so a page is written back once however
+ * many processes mapped it. Once no process maps a page any more it is
+ * written back to the segment; the segment itself, swap and all, goes away
+ * when the last process detaches from it.
+ */
+#define MAX_SHM 256
+
+typedef struct shm_segment {
+    uint32_t pages;             /* 0 if there is no such segment */
+    uint32_t attached;          /* The processes attached to it */
+    pte_t *backing;             /* One entry per page */
+} shm_segment_t;
+
+extern SIM_LOCAL shm_segment_t shm_segments[MAX_SHM];
+
+void shm_create(uint32_t id, uint32_t pages);
+void shm_attach(pcb_t *proc, uint32_t id, vpn_t base);
+void shm_detach(pcb_t *proc, uint32_t id);
+
+/**
+ * Copies parent's attachments to child, for proc_fork().
+ */
+void shm_fork(pcb_t *parent, pcb_t *child);
+
+/**
+ * Returns proc's attachment of segment id, or NULL if it has none.
+ */
+shm_attachment_t *shm_find(const pcb_t *proc, uint32_t id);
+
+/**
+ * Returns the backing entry of the segment page proc has attached at vpn,
+ * or NULL if vpn is not in any segment proc has attached.
+ */
+pte_t *shm_backing(const pcb_t *proc, vpn_t vpn);
+
+/**
+ * Maps vpn of the current process, whose page table entry is pte, if it is
+ * in a segment the process has attached. Returns 0 if it is not.
+ */
+int shm_fault(vpn_t vpn, pte_t *pte);
+
+/**
+ * Frees every segment.
+ */
+void shm_teardown(void);
+
+void page_fault(vaddr_t address, char rw);
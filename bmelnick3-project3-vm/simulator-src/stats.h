@@ -5,10 +5,35 @@
 
 /* The time taken to read/write a byte to/from memory */
 #define MEMORY_ACCESS_TIME 200
+/* With -T, the time taken to read/write a byte to/from the slow memory
+   tier; MEMORY_ACCESS_TIME is that of the fast one */
+#define SLOW_MEMORY_ACCESS_TIME 600
+/* The time taken to copy a page to another frame, from one memory tier to
+   the other, into a block to promote it to a huge page, or out of a frame
+   shared copy-on-write */
+#define PAGE_MIGRATE_TIME 8000
+/* With -z, the time taken to fill a frame with zeroes for a write to a
+   page mapped to the zero frame */
+#define PAGE_ZERO_TIME 4000
 /* The time taken to read a page from the disk */
 #define DISK_PAGE_READ_TIME 150000
+/* With -R, the time taken to read a page ahead from the disk: it goes out
+   in the same request as the fault that triggered it, which already paid
+   for the seek */
+#define DISK_PAGE_READAHEAD_TIME 50000
 /* The time taken to write a page to the disk */
 #define DISK_PAGE_WRITE_TIME 250000
+/* The time taken to compress a page into, and decompress a page from, the
+   compressed swap tier (-Z) */
+#define COMPRESS_PAGE_TIME 20000
+#define DECOMPRESS_PAGE_TIME 5000
+/* The time taken to look up a translation in the TLB */
+#define TLB_ACCESS_TIME 10
+/* The time taken to walk the page table after a TLB miss */
+#define PAGE_WALK_TIME MEMORY_ACCESS_TIME
+/* The time a CPU tearing down a mapping waits for another CPU to take the
+   interrupt and invalidate the translation in its TLB (-P) */
+#define TLB_SHOOTDOWN_TIME 4000
 
 typedef struct stats_t {
     /* Reads, writes and accesses */
@@ -19,10 +44,86 @@ typedef struct stats_t {
     uint64_t page_faults;
     /* Writebacks to disk */
     uint64_t writebacks;
+    /* TLB lookups that hit and missed, and cached translations
+       invalidated by the OS (only counted when the TLB is enabled) */
+    uint64_t tlb_hits;
+    uint64_t tlb_misses;
+    uint64_t tlb_shootdowns;
+    /* Writes that hit a clean translation and walked the page table
+       anyway, to set the dirty bit */
+    uint64_t tlb_dirty_walks;
+    /* With -P, the interrupts sent to other CPUs to invalidate their TLBs */
+    uint64_t tlb_ipis;
+    /* Inner page table frames in use with multi-level page tables */
+    uint64_t pt_frames;
+    uint64_t pt_frames_max;
+    /* With -z: pages mapped to the zero frame instead of a frame of their
+       own, zero pages later given a zeroed frame on write (which reads
+       nothing from disk), and dirty all-zero pages swapped out as a zero
+       marker instead of written to disk */
+    uint64_t zero_maps;
+    uint64_t zero_copies;
+    uint64_t zero_writebacks;
+    /* With -Z: pages stored in the compressed tier, faults served from it,
+       pages it spilled to disk (also counted as writebacks), and the bytes
+       it was given and kept */
+    uint64_t zswap_stores;
+    uint64_t zswap_hits;
+    uint64_t zswap_spills;
+    uint64_t zswap_bytes_in;
+    uint64_t zswap_bytes_out;
+    /* With -R: pages read ahead, those of them read from the disk rather
+       than zero-filled, and how many were used or evicted (or freed at exit)
+       unused */
+    uint64_t prefetches;
+    uint64_t prefetch_reads;
+    uint64_t prefetch_hits;
+    uint64_t prefetch_wasted;
+    /* Evictions on the fault path, and with -W, background reclaim passes,
+       the evictions they made, the dirty pages they cleaned without evicting
+       them and the writebacks both took. Background writebacks are kept out
+       of writebacks, but are writes to disk all the same, and cost as much. */
+    uint64_t direct_evictions;
+    uint64_t reclaim_passes;
+    uint64_t reclaim_evictions;
+    uint64_t reclaim_cleans;
+    uint64_t bg_writebacks;
+    /* FORKs, writes that copied a page shared copy-on-write since one, and
+       writes that found the page no longer shared and just kept its frame.
+       Neither kind of write reads the disk. */
+    uint64_t forks;
+    uint64_t cow_faults;
+    uint64_t cow_reuses;
+    /* SHM segments created, faults on their pages, and those of the faults
+       that found the page already resident and just mapped its frame */
+    uint64_t shm_creates;
+    uint64_t shm_faults;
+    uint64_t shm_minor_faults;
+    /* The frames sharing saves, whether through FORK or SHM (pages mapping
+       a frame beyond the first), now and at most */
+    uint64_t frames_saved;
+    uint64_t frames_saved_max;
+    /* With -H, faults given a frame in a reserved block, promotions to huge
+       pages, the pages copied into a free block to promote them, splits, and
+       the huge pages mapped, now and at most */
+    uint64_t huge_reserved;
+    uint64_t huge_promotions;
+    uint64_t huge_copies;
+    uint64_t huge_splits;
+    uint64_t huge_mappings;
+    uint64_t huge_mappings_max;
+    /* With -T, accesses to each memory tier, and the pages promoted to the
+       fast tier and demoted to the slow one */
+    uint64_t fast_accesses;
+    uint64_t slow_accesses;
+    uint64_t tier_promotions;
+    uint64_t tier_demotions;
+    /* The share of the average access time spent migrating pages */
+    double migration_time;
     /* Average Access Time */
     double aat;
 } stats_t;
 
-extern stats_t stats;
+extern SIM_LOCAL stats_t stats;
 
 void compute_stats(void);
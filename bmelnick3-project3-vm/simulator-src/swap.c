@@ -2,29 +2,195 @@
 #include <string.h>
 
 #include "swap.h"
+#include "swapfile.h"
 #include "util.h"
 
-static uint64_t TOKEN = 1;
+#define SWAP_TABLE_MIN_CAPACITY 1024
 
-swap_info_t *create_entry(void)
+static SIM_LOCAL uint64_t TOKEN = 1;
+
+SIM_LOCAL swap_pool_t swap_pool;
+
+SIM_LOCAL swap_pool_t swap_header_pool;
+SIM_LOCAL swap_tier_t swap_tier;
+
+static void swap_pool_refill(swap_pool_t *pool, size_t entry_size)
 {
-    swap_info_t *new_info = calloc(1, sizeof(swap_info_t));
-    if (!new_info) {
+    swap_slab_t *slab = malloc(sizeof(swap_slab_t) + SWAP_POOL_CHUNK * entry_size);
+    if (!slab) {
         panic("could not allocate swap entry");
     }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    uint8_t *chunk = (uint8_t *) (slab + 1);
+    for (size_t i = 0; i < SWAP_POOL_CHUNK; i++) {
+        swap_info_t *info = (swap_info_t *) (chunk + i * entry_size);
+        info->next = pool->free_list;
+        pool->free_list = info;
+    }
+    pool->chunks++;
+}
+
+static swap_info_t *swap_pool_take(swap_pool_t *pool, size_t entry_size)
+{
+    if (!pool->free_list) {
+        swap_pool_refill(pool, entry_size);
+    }
+    swap_info_t *new_info = pool->free_list;
+    pool->free_list = new_info->next;
+    new_info->next = NULL;
     new_info->token = TOKEN++;
+
+    pool->in_use++;
+    if (pool->in_use > pool->in_use_max) {
+        pool->in_use_max = pool->in_use;
+    }
     return new_info;
 }
 
-void swap_queue_enqueue(swap_queue_t *queue, swap_info_t* info)
+/* An entry for a whole page, in the heap or, with -F, the swap file */
+swap_info_t *create_entry(void)
+{
+    if (swap_file_enabled()) {
+        swap_info_t *new_info = swap_pool_take(&swap_header_pool, sizeof(swap_info_t));
+        new_info->kind = SWAP_FILE;
+        new_info->slot = swap_file_alloc();
+        return new_info;
+    }
+    swap_info_t *new_info = swap_pool_take(&swap_pool, SWAP_ENTRY_SIZE);
+    new_info->kind = SWAP_PAGE;
+    return new_info;
+}
+
+swap_info_t *create_zero_entry(void)
+{
+    swap_info_t *new_info = swap_pool_take(&swap_header_pool, sizeof(swap_info_t));
+    new_info->kind = SWAP_ZERO;
+    return new_info;
+}
+
+/* Copies zdata into a new entry, which becomes the newest in the tier */
+swap_info_t *create_compressed_entry(const uint8_t *zdata, uint32_t zsize)
+{
+    swap_info_t *new_info = swap_pool_take(&swap_header_pool, sizeof(swap_info_t));
+    new_info->kind = SWAP_COMPRESSED;
+    new_info->zsize = zsize;
+    if (!(new_info->zdata = malloc(zsize))) {
+        panic("could not allocate compressed swap entry");
+    }
+    memcpy(new_info->zdata, zdata, zsize);
+
+    new_info->older = swap_tier.newest;
+    new_info->newer = NULL;
+    if (swap_tier.newest) {
+        swap_tier.newest->newer = new_info;
+    } else {
+        swap_tier.oldest = new_info;
+    }
+    swap_tier.newest = new_info;
+
+    swap_tier.used += zsize;
+    return new_info;
+}
+
+static void swap_tier_unlink(swap_info_t *info)
 {
-    info->next = NULL;
-    if (queue->head == NULL) {
-        queue->head = queue->tail = info;
+    if (info->older) {
+        info->older->newer = info->newer;
     } else {
-        queue->tail->next = info;
-        queue->tail = info;
+        swap_tier.oldest = info->newer;
+    }
+    if (info->newer) {
+        info->newer->older = info->older;
+    } else {
+        swap_tier.newest = info->older;
+    }
+}
+
+/* Makes a compressed entry the newest in the tier */
+void swap_tier_touch(swap_info_t *info)
+{
+    if (swap_tier.newest == info) {
+        return;
+    }
+    swap_tier_unlink(info);
+    info->older = swap_tier.newest;
+    info->newer = NULL;
+    swap_tier.newest->newer = info;
+    swap_tier.newest = info;
+}
+
+void release_entry(swap_info_t *info)
+{
+    if (info->kind == SWAP_COMPRESSED) {
+        swap_tier_unlink(info);
+        swap_tier.used -= info->zsize;
+        free(info->zdata);
+    } else if (info->kind == SWAP_FILE) {
+        swap_file_release(info->slot);
     }
+    swap_pool_t *pool = info->kind == SWAP_PAGE ? &swap_pool : &swap_header_pool;
+    info->next = pool->free_list;
+    pool->free_list = info;
+    pool->in_use--;
+}
+
+/* Fibonacci hashing spreads the sequential tokens across the table. */
+static inline uint64_t swap_slot(const swap_queue_t *queue, uint64_t token)
+{
+    return (token * 0x9E3779B97F4A7C15ULL) & (queue->capacity - 1);
+}
+
+static void swap_table_insert(swap_queue_t *queue, swap_info_t *info)
+{
+    uint64_t i = swap_slot(queue, info->token);
+    while (queue->slots[i]) {
+        i = (i + 1) & (queue->capacity - 1);
+    }
+    queue->slots[i] = info;
+}
+
+static void swap_table_grow(swap_queue_t *queue)
+{
+    swap_info_t **old_slots = queue->slots;
+    uint64_t old_capacity = queue->capacity;
+
+    queue->capacity = old_capacity ? old_capacity * 2 : SWAP_TABLE_MIN_CAPACITY;
+    queue->slots = calloc(queue->capacity, sizeof(swap_info_t *));
+    if (!queue->slots) {
+        panic("could not allocate swap table");
+    }
+    for (uint64_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i]) {
+            swap_table_insert(queue, old_slots[i]);
+        }
+    }
+    free(old_slots);
+}
+
+/* Returns the slot holding token, or capacity if it is not present. */
+static uint64_t swap_table_lookup(const swap_queue_t *queue, uint64_t token)
+{
+    if (!queue->capacity) {
+        return 0;
+    }
+    uint64_t i = swap_slot(queue, token);
+    while (queue->slots[i]) {
+        if (queue->slots[i]->token == token) {
+            return i;
+        }
+        i = (i + 1) & (queue->capacity - 1);
+    }
+    return queue->capacity;
+}
+
+void swap_queue_enqueue(swap_queue_t *queue, swap_info_t* info)
+{
+    if ((queue->size + 1) * 2 > queue->capacity) {
+        swap_table_grow(queue);
+    }
+    swap_table_insert(queue, info);
     queue->size++;
     if (queue->size > queue->size_max) {
         queue->size_max = queue->size;
@@ -34,38 +200,65 @@ void swap_queue_enqueue(swap_queue_t *queue, swap_info_t* info)
 
 void swap_queue_dequeue(swap_queue_t *queue, uint64_t token)
 {
-    swap_info_t *curr = queue->head;
-    swap_info_t *prev = NULL;
-
-    while (curr) {
-        if (curr->token == token) {
-            if (prev) {
-                prev->next = curr->next;
-            } else {
-                queue->head = curr->next;
-            }
-            if (curr == queue->tail) {
-                queue->tail = prev;
-            }
-            break;
-        }
-        prev = curr;
-        curr = curr->next;
+    uint64_t mask = queue->capacity - 1;
+    uint64_t hole = swap_table_lookup(queue, token);
+    if (hole >= queue->capacity) {
+        panic("Attempted to dequeue a swap entry that does not exist");
     }
+    release_entry(queue->slots[hole]);
+    queue->slots[hole] = NULL;
     queue->size--;
-    curr->next = NULL;
-    free(curr);
+
+    /* Backward-shift deletion: pull later members of the probe run into
+       the hole so that no lookup ever stops early at it. */
+    for (uint64_t i = (hole + 1) & mask; queue->slots[i]; i = (i + 1) & mask) {
+        uint64_t home = swap_slot(queue, queue->slots[i]->token);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            queue->slots[hole] = queue->slots[i];
+            queue->slots[i] = NULL;
+            hole = i;
+        }
+    }
 }
 
 swap_info_t *swap_queue_find(swap_queue_t *queue, uint64_t token)
 {
-    swap_info_t *curr = queue->head;
+    uint64_t i = swap_table_lookup(queue, token);
+    return i < queue->capacity ? queue->slots[i] : NULL;
+}
 
-    while (curr) {
-        if (curr->token == token) {
-            return curr;
-        }
-        curr = curr->next;
+void swap_queue_replace(swap_queue_t *queue, swap_info_t *old, swap_info_t *info)
+{
+    uint64_t i = swap_table_lookup(queue, old->token);
+    if (i >= queue->capacity) {
+        panic("Attempted to replace a swap entry that does not exist");
     }
-    return NULL;
+    info->token = old->token;
+    queue->slots[i] = info;
+    release_entry(old);
+}
+
+static void swap_pool_teardown(swap_pool_t *pool)
+{
+    while (pool->slabs) {
+        swap_slab_t *next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+void swap_teardown(swap_queue_t *queue)
+{
+    while (swap_tier.oldest) {
+        release_entry(swap_tier.oldest);
+    }
+    free(swap_tier.scratch);
+    memset(&swap_tier, 0, sizeof(swap_tier));
+
+    swap_pool_teardown(&swap_pool);
+    swap_pool_teardown(&swap_header_pool);
+
+    free(queue->slots);
+    memset(queue, 0, sizeof(*queue));
 }
@@ -5,22 +5,112 @@
 
 typedef uint64_t swap_entry_t;
 
+/* What a swap entry holds */
+#define SWAP_PAGE 0             /* The page itself, in page_data */
+#define SWAP_ZERO 1             /* Nothing: the page is all zeroes (-z) */
+#define SWAP_COMPRESSED 2       /* The page compressed, in zdata (-Z) */
+#define SWAP_FILE 3             /* The page, in the swap file (-F) */
+
 typedef struct swap_info {
 
     uint64_t token;
-    uint8_t  page_data[PAGE_SIZE];
 
-    struct swap_info *next;
+    uint8_t kind;               /* One of the SWAP_ kinds above. Only
+                                   SWAP_PAGE entries have page_data. */
+
+    uint64_t slot;              /* -- Used for SWAP_FILE entries -- */
+
+    uint32_t zsize;             /* -- Used for SWAP_COMPRESSED entries -- */
+    uint8_t *zdata;
+    struct swap_info *older;    /* Neighbours in the compressed tier */
+    struct swap_info *newer;
+
+    struct swap_info *next;     /* Free list link while in the pool */
+
+    uint8_t  page_data[];       /* PAGE_SIZE bytes */
 } swap_info_t;
 
+/* The size of one swap entry, including its page */
+#define SWAP_ENTRY_SIZE (sizeof(swap_info_t) + PAGE_SIZE)
+
+/*
+ * The swap entry pool.
+ *
+ * Entries are carved out of SWAP_POOL_CHUNK-sized slabs and recycled through
+ * a free list instead of being returned to malloc. Recycled entries are not
+ * zeroed, since swap_write() always overwrites the whole page.
+ */
+#define SWAP_POOL_CHUNK 64
+
+/* Header of each slab, linking the slabs for swap_teardown() */
+typedef struct swap_slab {
+    struct swap_slab *next;
+} swap_slab_t;
+
+typedef struct swap_pool {
+    swap_info_t *free_list;
+    swap_slab_t *slabs;
+    uint64_t chunks;            /* Slabs allocated so far (never released) */
+    uint64_t in_use;
+    uint64_t in_use_max;
+} swap_pool_t;
+
+extern SIM_LOCAL swap_pool_t swap_pool;
+
+/* Entries without page_data come from a pool of their own, without room
+   for a page */
+extern SIM_LOCAL swap_pool_t swap_header_pool;
+
+/*
+ * The compressed swap tier.
+ *
+ * With -Z, swap_write() compresses pages and keeps them in memory, up to a
+ * budget of compressed bytes, instead of writing them to the backing store.
+ * Entries are kept in LRU order, a fault served from the tier making its
+ * entry the newest; when the tier goes over budget its oldest pages are
+ * spilled to the backing store as ordinary SWAP_PAGE entries.
+ */
+typedef struct swap_tier {
+    swap_info_t *oldest;
+    swap_info_t *newest;
+    uint64_t used;              /* Compressed bytes held */
+    uint64_t used_max;
+    uint8_t *scratch;           /* A page to compress into */
+} swap_tier_t;
+
+extern SIM_LOCAL swap_tier_t swap_tier;
+
+/*
+ * The swap store.
+ *
+ * Entries are kept in an open-addressing hash table keyed by token, using
+ * linear probing and backward-shift deletion so that lookups, inserts and
+ * frees are all O(1) regardless of how many pages are swapped out. The
+ * table doubles whenever it becomes more than half full.
+ */
 typedef struct _swap_queue_t {
-    swap_info_t *head;
-    swap_info_t *tail;
+    swap_info_t **slots;
+    uint64_t capacity;          /* Number of slots, always a power of two */
     uint64_t size;
     uint64_t size_max;
 } swap_queue_t;
 
 swap_info_t *create_entry(void);
+swap_info_t *create_zero_entry(void);
+swap_info_t *create_compressed_entry(const uint8_t *zdata, uint32_t zsize);
+void swap_tier_touch(swap_info_t *info);
+void release_entry(swap_info_t *info);
 void swap_queue_enqueue(swap_queue_t *queue, swap_info_t* info);
 void swap_queue_dequeue(swap_queue_t *queue, uint64_t token);
 swap_info_t *swap_queue_find(swap_queue_t *queue, uint64_t token);
+
+/**
+ * Puts info in the place of old, taking over its token, and releases old.
+ */
+void swap_queue_replace(swap_queue_t *queue, swap_info_t *old, swap_info_t *info);
+
+/**
+ * Releases every swap entry and the swap table, leaving the swap store
+ * empty, as it is before the first swap_write().
+ */
+void swap_teardown(swap_queue_t *queue);
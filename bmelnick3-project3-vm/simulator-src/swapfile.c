@@ -0,0 +1,197 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "swapfile.h"
+#include "pagesim.h"
+#include "util.h"
+
+#define SWAP_FILE_MIN_SLOTS 1024
+
+SIM_LOCAL swap_file_t swap_file = { .fd = -1 };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/* Waits on cond, adding the time waited to the stall time */
+static void stall(swap_file_t *file, pthread_cond_t *cond) {
+    uint64_t start = now_ns();
+    pthread_cond_wait(cond, &file->lock);
+    file->stall_ns += now_ns() - start;
+}
+
+static void *swap_file_writeback(void *arg) {
+    swap_file_t *file = arg;
+    pthread_mutex_lock(&file->lock);
+    for (;;) {
+        while (file->head == file->tail && !file->stopping) {
+            pthread_cond_wait(&file->work, &file->lock);
+        }
+        if (file->head == file->tail) {
+            break;
+        }
+
+        /* Write out everything queued so far as one batch. The producer
+           only appends, so these entries stay put while unlocked. */
+        uint64_t head = file->head, tail = file->tail;
+        pthread_mutex_unlock(&file->lock);
+        for (uint64_t i = head; i < tail; i++) {
+            uint64_t pos = i % SWAP_FILE_QUEUE;
+            const uint8_t *page = file->buffers + pos * file->page_size;
+            off_t offset = (off_t) (file->queue_slot[pos] * file->page_size);
+            for (size_t written = 0; written < file->page_size;) {
+                ssize_t n = pwrite(file->fd, page + written, file->page_size - written,
+                                   offset + (off_t) written);
+                if (n < 0 && errno != EINTR) {
+                    perror("Unable to write swap file");
+                    exit(1);
+                }
+                written += n > 0 ? (size_t) n : 0;
+            }
+        }
+        pthread_mutex_lock(&file->lock);
+
+        for (uint64_t i = head; i < tail; i++) {
+            file->pending[file->queue_slot[i % SWAP_FILE_QUEUE]]--;
+        }
+        file->head = tail;
+        file->writes += tail - head;
+        file->batches++;
+        pthread_cond_broadcast(&file->done);
+    }
+    pthread_mutex_unlock(&file->lock);
+    return NULL;
+}
+
+/* Makes room for capacity slots, in the file and in the pending counts */
+static void swap_file_grow(uint64_t capacity) {
+    if (ftruncate(swap_file.fd, (off_t) (capacity * swap_file.page_size))) {
+        perror("Unable to extend swap file");
+        exit(1);
+    }
+    pthread_mutex_lock(&swap_file.lock);
+    uint16_t *pending = realloc(swap_file.pending, capacity * sizeof(uint16_t));
+    if (!pending) {
+        panic("could not allocate swap file state");
+    }
+    memset(pending + swap_file.capacity, 0, (capacity - swap_file.capacity) * sizeof(uint16_t));
+    swap_file.pending = pending;
+    pthread_mutex_unlock(&swap_file.lock);
+    swap_file.capacity = capacity;
+}
+
+void swap_file_open(const char *dir) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/vm-sim-swap.XXXXXX", dir);
+    swap_file.fd = mkstemp(path);
+    if (swap_file.fd < 0) {
+        perror("Unable to create swap file");
+        exit(1);
+    }
+    unlink(path);
+
+    swap_file.page_size = PAGE_SIZE;
+    if (!(swap_file.buffers = malloc(SWAP_FILE_QUEUE * PAGE_SIZE))) {
+        panic("could not allocate swap file state");
+    }
+    pthread_mutex_init(&swap_file.lock, NULL);
+    pthread_cond_init(&swap_file.work, NULL);
+    pthread_cond_init(&swap_file.done, NULL);
+    swap_file_grow(SWAP_FILE_MIN_SLOTS);
+
+    if (pthread_create(&swap_file.thread, NULL, swap_file_writeback, &swap_file)) {
+        panic("could not start the swap writeback thread");
+    }
+}
+
+void swap_file_close(void) {
+    if (!swap_file_enabled()) {
+        return;
+    }
+    pthread_mutex_lock(&swap_file.lock);
+    swap_file.stopping = 1;
+    pthread_cond_signal(&swap_file.work);
+    pthread_mutex_unlock(&swap_file.lock);
+    pthread_join(swap_file.thread, NULL);
+
+    close(swap_file.fd);
+    pthread_mutex_destroy(&swap_file.lock);
+    pthread_cond_destroy(&swap_file.work);
+    pthread_cond_destroy(&swap_file.done);
+    free(swap_file.buffers);
+    free(swap_file.free_slots);
+    free(swap_file.pending);
+    swap_file.buffers = NULL;
+    swap_file.free_slots = NULL;
+    swap_file.pending = NULL;
+    swap_file.fd = -1;
+}
+
+uint64_t swap_file_alloc(void) {
+    uint64_t slot;
+    if (swap_file.free_count) {
+        slot = swap_file.free_slots[--swap_file.free_count];
+    } else {
+        if (swap_file.next_slot == swap_file.capacity) {
+            swap_file_grow(swap_file.capacity * 2);
+        }
+        slot = swap_file.next_slot++;
+    }
+    if (++swap_file.in_use > swap_file.in_use_max) {
+        swap_file.in_use_max = swap_file.in_use;
+    }
+    return slot;
+}
+
+void swap_file_release(uint64_t slot) {
+    if (swap_file.free_count == swap_file.free_capacity) {
+        swap_file.free_capacity = swap_file.free_capacity ? swap_file.free_capacity * 2 : 64;
+        swap_file.free_slots = realloc(swap_file.free_slots, swap_file.free_capacity * sizeof(uint64_t));
+        if (!swap_file.free_slots) {
+            panic("could not allocate swap file state");
+        }
+    }
+    swap_file.free_slots[swap_file.free_count++] = slot;
+    swap_file.in_use--;
+}
+
+void swap_file_write(uint64_t slot, const void *src) {
+    pthread_mutex_lock(&swap_file.lock);
+    while (swap_file.tail - swap_file.head == SWAP_FILE_QUEUE) {
+        stall(&swap_file, &swap_file.done);
+    }
+    uint64_t pos = swap_file.tail % SWAP_FILE_QUEUE;
+    memcpy(swap_file.buffers + pos * swap_file.page_size, src, swap_file.page_size);
+    swap_file.queue_slot[pos] = slot;
+    swap_file.pending[slot]++;
+    swap_file.tail++;
+    pthread_cond_signal(&swap_file.work);
+    pthread_mutex_unlock(&swap_file.lock);
+}
+
+void swap_file_read(uint64_t slot, void *dst) {
+    pthread_mutex_lock(&swap_file.lock);
+    if (swap_file.pending[slot]) {
+        swap_file.read_waits++;
+        while (swap_file.pending[slot]) {
+            stall(&swap_file, &swap_file.done);
+        }
+    }
+    swap_file.reads++;
+    pthread_mutex_unlock(&swap_file.lock);
+
+    uint8_t *page = dst;
+    off_t offset = (off_t) (slot * swap_file.page_size);
+    for (size_t done = 0; done < swap_file.page_size;) {
+        ssize_t n = pread(swap_file.fd, page + done, swap_file.page_size - done, offset + (off_t) done);
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            perror("Unable to read swap file");
+            exit(1);
+        }
+        done += n > 0 ? (size_t) n : 0;
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "types.h"
+
+/*
+ * The swap file.
+ *
+ * With -F, pages swapped out to the backing store are kept in a sparse file
+ * instead of the heap, so swap may grow far beyond host memory. Each machine
+ * gets its own file, created in the given directory and unlinked at once so
+ * nothing is left behind. Pages live in fixed-size slots, handed out from a
+ * free list; the file is extended (sparsely) whenever it runs out of slots.
+ *
+ * Writes are asynchronous: swap_file_write() copies the page into one of
+ * SWAP_FILE_QUEUE buffers and returns, and a writeback thread drains the
+ * queued pages with pwrite() in batches. An eviction only waits when every
+ * buffer is in flight, and swap_file_read() waits only for pending writes
+ * to the slot it reads. The time spent waiting is reported, as a measure of
+ * how well the writeback overlaps with the simulation.
+ */
+
+#define SWAP_FILE_QUEUE 64
+
+typedef struct swap_file {
+    int fd;                     /* -1 while there is no swap file */
+    size_t page_size;           /* The writeback thread has no geometry */
+
+    uint64_t capacity;          /* Slots the file has room for */
+    uint64_t next_slot;         /* Slots below this have been handed out */
+    uint64_t *free_slots;       /* Released slots, as a stack */
+    uint64_t free_count;
+    uint64_t free_capacity;
+    uint64_t in_use;
+    uint64_t in_use_max;
+
+    /* Shared with the writeback thread, under lock */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* Signalled when writes are queued */
+    pthread_cond_t done;        /* Broadcast when writes complete */
+    uint8_t *buffers;           /* SWAP_FILE_QUEUE pages, one per queue entry */
+    uint64_t queue_slot[SWAP_FILE_QUEUE];
+    uint64_t head;              /* Queue entries below head are written */
+    uint64_t tail;              /* Entries from head up to tail are queued */
+    uint16_t *pending;          /* Queued writes to each slot */
+    uint8_t stopping;
+
+    /* Statistics */
+    uint64_t writes;
+    uint64_t batches;
+    uint64_t reads;
+    uint64_t read_waits;        /* Reads that waited for a pending write */
+    uint64_t stall_ns;          /* Time spent waiting for the writeback */
+} swap_file_t;
+
+extern SIM_LOCAL swap_file_t swap_file;
+
+/**
+ * Creates this machine's swap file in dir and starts its writeback thread.
+ */
+void swap_file_open(const char *dir);
+
+/**
+ * Waits for every queued write, stops the writeback thread and closes the
+ * swap file, keeping its statistics. Does nothing if there is no swap file.
+ */
+void swap_file_close(void);
+
+static inline int swap_file_enabled(void) {
+    return swap_file.fd >= 0;
+}
+
+uint64_t swap_file_alloc(void);
+void swap_file_release(uint64_t slot);
+
+/**
+ * Queues a page to be written to slot. The page is copied, so src may be
+ * reused as soon as this returns.
+ */
+void swap_file_write(uint64_t slot, const void *src);
+
+/**
+ * Reads the page in slot into dst, after any queued writes to it.
+ */
+void swap_file_read(uint64_t slot, void *dst);
@@ -1,7 +1,10 @@
 #include "swapops.h"
+#include "swapfile.h"
+#include "compress.h"
+#include "stats.h"
 #include "util.h"
 
-swap_queue_t swap_queue;
+SIM_LOCAL swap_queue_t swap_queue;
 
 void swap_read(pte_t *pte, void *dst) {
 
@@ -9,17 +12,171 @@ void swap_read(pte_t *pte, void *dst) {
     if (!info) {
         panic("Attempted to read an invalid swap entry.\nHINT: How do you check if a swap entry exists, and if it does not, what should you put in memory instead?");
     }
-    memcpy(dst, info->page_data, PAGE_SIZE);
+    switch (info->kind) {
+    case SWAP_ZERO:
+        memset(dst, 0, PAGE_SIZE);
+        break;
+    case SWAP_COMPRESSED:
+        page_decompress(info->zdata, info->zsize, dst, PAGE_SIZE);
+        swap_tier_touch(info);
+        stats.zswap_hits++;
+        break;
+    case SWAP_FILE:
+        swap_file_read(info->slot, dst);
+        break;
+    default:
+        memcpy(dst, info->page_data, PAGE_SIZE);
+    }
 }
 
-void swap_write(pte_t *pte, void *src) {
+/* Spills the oldest pages of the compressed tier to the backing store until
+   it is within budget. Each spill is a writeback to disk, and counts as
+   background reclaim's if that is what pushed the tier over. */
+static void swap_tier_shrink(int background) {
+    while (swap_tier.used > zswap_budget) {
+        swap_info_t *old = swap_tier.oldest;
+        swap_info_t *info = create_entry();
+        if (info->kind == SWAP_FILE) {
+            page_decompress(old->zdata, old->zsize, swap_tier.scratch, PAGE_SIZE);
+            swap_file_write(info->slot, swap_tier.scratch);
+        } else {
+            page_decompress(old->zdata, old->zsize, info->page_data, PAGE_SIZE);
+        }
+        swap_queue_replace(&swap_queue, old, info);
+        stats.zswap_spills++;
+        if (background) {
+            stats.bg_writebacks++;
+        } else {
+            stats.writebacks++;
+        }
+    }
+}
+
+/* Tries to keep the page in the compressed tier. Pages that do not compress
+   are left to the backing store. */
+static int swap_tier_store(pte_t *pte, const void *src, int background) {
+    if (!swap_tier.scratch && !(swap_tier.scratch = malloc(PAGE_SIZE))) {
+        panic("could not allocate compressed swap state");
+    }
+    size_t zsize = page_compress(src, PAGE_SIZE, swap_tier.scratch, PAGE_SIZE - 1);
+    if (!zsize || zsize > zswap_budget) {
+        return 0;
+    }
+
+    if (swap_queue_find(&swap_queue, pte->swap)) {
+        swap_queue_dequeue(&swap_queue, pte->swap);
+    }
+    swap_info_t *info = create_compressed_entry(swap_tier.scratch, (uint32_t) zsize);
+    swap_queue_enqueue(&swap_queue, info);
+    pte->swap = info->token;
+
+    stats.zswap_stores++;
+    stats.zswap_bytes_in += PAGE_SIZE;
+    stats.zswap_bytes_out += zsize;
+    swap_tier_shrink(background);
+    if (swap_tier.used > swap_tier.used_max) {
+        swap_tier.used_max = swap_tier.used;
+    }
+    return 1;
+}
+
+int swap_write(pte_t *pte, void *src, int background) {
+    if (zswap_budget && swap_tier_store(pte, src, background)) {
+        return 0;
+    }
+
     swap_info_t *info = swap_queue_find(&swap_queue, pte->swap);
+    if (info && info->kind != SWAP_PAGE && info->kind != SWAP_FILE) {
+        /* Only a SWAP_PAGE or SWAP_FILE entry has room for the page */
+        swap_queue_dequeue(&swap_queue, pte->swap);
+        info = NULL;
+    }
     if (!info) {
         info = create_entry(); // creates a swap entry and assigns a token
         swap_queue_enqueue(&swap_queue, info);
         pte->swap = info->token;
     }
-    memcpy(info->page_data, src, PAGE_SIZE);
+    if (info->kind == SWAP_FILE) {
+        swap_file_write(info->slot, src);
+    } else {
+        memcpy(info->page_data, src, PAGE_SIZE);
+    }
+    return 1;
+}
+
+void swap_write_zero(pte_t *pte) {
+    swap_info_t *info = swap_queue_find(&swap_queue, pte->swap);
+    if (info && info->kind == SWAP_ZERO) {
+        return;
+    }
+    if (info) {
+        swap_queue_dequeue(&swap_queue, pte->swap);
+    }
+    info = create_zero_entry();
+    swap_queue_enqueue(&swap_queue, info);
+    pte->swap = info->token;
+}
+
+void swap_duplicate(pte_t *src, pte_t *dst) {
+    swap_info_t *info = swap_queue_find(&swap_queue, src->swap);
+    if (!info) {
+        panic("Attempted to duplicate an invalid swap entry");
+    }
+    swap_info_t *copy;
+    switch (info->kind) {
+    case SWAP_ZERO:
+        copy = create_zero_entry();
+        break;
+    case SWAP_COMPRESSED:
+        copy = create_compressed_entry(info->zdata, info->zsize);
+        break;
+    default:
+        copy = create_entry();
+        if (info->kind == SWAP_FILE || copy->kind == SWAP_FILE) {
+            if (!swap_tier.scratch && !(swap_tier.scratch = malloc(PAGE_SIZE))) {
+                panic("could not allocate compressed swap state");
+            }
+            uint8_t *page = info->kind == SWAP_FILE ? swap_tier.scratch : info->page_data;
+            if (info->kind == SWAP_FILE) {
+                swap_file_read(info->slot, page);
+            }
+            if (copy->kind == SWAP_FILE) {
+                swap_file_write(copy->slot, page);
+            } else {
+                memcpy(copy->page_data, page, PAGE_SIZE);
+            }
+        } else {
+            memcpy(copy->page_data, info->page_data, PAGE_SIZE);
+        }
+    }
+    swap_queue_enqueue(&swap_queue, copy);
+    dst->swap = copy->token;
+
+    if (copy->kind == SWAP_COMPRESSED) {
+        swap_tier_shrink(0);
+        if (swap_tier.used > swap_tier.used_max) {
+            swap_tier.used_max = swap_tier.used;
+        }
+    }
+}
+
+uint8_t swap_kind(pte_t *pte) {
+    swap_info_t *info = swap_queue_find(&swap_queue, pte->swap);
+    if (!info) {
+        panic("Attempted to look up an invalid swap entry");
+    }
+    return info->kind;
+}
+
+int swap_is_zero(pte_t *pte) {
+    swap_info_t *info = swap_queue_find(&swap_queue, pte->swap);
+    return info && info->kind == SWAP_ZERO;
+}
+
+int page_is_zero(const void *page) {
+    const uint8_t *bytes = page;
+    /* Every byte equals the next, and the first is zero */
+    return bytes[0] == 0 && memcmp(bytes, bytes + 1, PAGE_SIZE - 1) == 0;
 }
 
 void swap_free(pte_t *pte) {
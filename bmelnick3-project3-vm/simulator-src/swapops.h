@@ -5,7 +5,7 @@
 #include "swap.h"
 #include "types.h"
 
-extern swap_queue_t swap_queue;
+extern SIM_LOCAL swap_queue_t swap_queue;
 
 /**
  * Determines if the given page table entry has a swap entry.
@@ -37,12 +37,62 @@ void swap_read(pte_t *entry, void *dst);
  * avoid a memory leak. The page table entry's swap field is updated
  * automatically.
  *
+ * With -Z the page may be kept in the compressed tier instead of being
+ * written to disk (see swap.h).
+ *
  * @param entry a pointer to the page table entry
  * @param src the source address from which bytes should be copied
  * into swap. This should be a pointer to the start of the relevant
  * frame in your mem[] array.
+ * @param background whether background reclaim is writing the page, so
+ * that pages it spills from the compressed tier to disk count as reclaim
+ * writebacks
+ * @return 1 if the page was written to disk, 0 if it went to the
+ * compressed tier
+ */
+int swap_write(pte_t *entry, void *src, int background);
+
+/**
+ * Records that the page of a page table entry is all zeroes, as a zero
+ * marker in swap instead of a copy of the page. swap_read() fills the page
+ * back in with zeroes. Like swap_write(), this allocates a swap entry if
+ * the page has none, and the entry must later be freed with swap_free().
+ *
+ * @param entry a pointer to the page table entry
+ */
+void swap_write_zero(pte_t *entry);
+
+/**
+ * Gives the page table entry dst a swap entry of its own holding a copy of
+ * the page in src's swap entry, which must exist. Nothing is counted as a
+ * read or a writeback: a real kernel would share the swap slot instead.
+ *
+ * @param src a pointer to the page table entry to copy from
+ * @param dst a pointer to the page table entry to copy to
+ */
+void swap_duplicate(pte_t *src, pte_t *dst);
+
+/**
+ * Returns the kind (see swap.h) of the given page table entry's swap entry,
+ * which must exist.
+ *
+ * @param entry a pointer to the page table entry to check
+ */
+uint8_t swap_kind(pte_t *entry);
+
+/**
+ * Determines if the given page table entry's swap entry is a zero marker.
+ *
+ * @param entry a pointer to the page table entry to check
+ */
+int swap_is_zero(pte_t *entry);
+
+/**
+ * Determines if the PAGE_SIZE bytes starting at page are all zero.
+ *
+ * @param page the start of the page, e.g. a frame in your mem[] array
  */
-void swap_write(pte_t *entry, void *src);
+int page_is_zero(const void *page);
 
 /**
  * Frees the swap entry associated with the given page table entry.
@@ -0,0 +1,232 @@
+#include "tlb.h"
+#include "stats.h"
+#include "util.h"
+
+static SIM_LOCAL tlb_entry_t *tlbs;       /* The TLB of every CPU, in turn */
+static SIM_LOCAL tlb_entry_t *tlb;        /* That of the CPU running the step */
+static SIM_LOCAL uint32_t tlb_cpu;
+static SIM_LOCAL uint64_t *tlb_cpus;      /* For each ASID, the CPUs that
+                                             cache any of its translations */
+static SIM_LOCAL uint32_t *tlb_counts;    /* For each CPU and ASID, how many */
+static SIM_LOCAL uint32_t tlb_batch_depth;
+static SIM_LOCAL uint64_t tlb_batch_cpus; /* The CPUs the batch interrupts */
+static SIM_LOCAL uint32_t tlb_sets;
+static SIM_LOCAL uint32_t tlb_ways;
+static SIM_LOCAL uint32_t tlb_clock;
+
+void tlb_init(uint32_t entries, uint32_t ways)
+{
+    if (!entries) {
+        return;
+    }
+    if ((entries & (entries - 1)) || !ways || (ways & (ways - 1)) || ways > entries) {
+        fprintf(stderr, "ERROR: TLB entries and ways must be powers of two with ways <= entries.\n");
+        exit(1);
+    }
+    if (!(tlbs = calloc((size_t) entries * num_cpus, sizeof(tlb_entry_t)))
+        || !(tlb_cpus = calloc(MAX_PID, sizeof(uint64_t)))
+        || !(tlb_counts = calloc((size_t) MAX_PID * num_cpus, sizeof(uint32_t)))) {
+        panic("could not allocate TLB");
+    }
+    tlb_ways = ways;
+    tlb_sets = entries / ways;
+    tlb_select_cpu(0);
+}
+
+void tlb_teardown(void)
+{
+    free(tlbs);
+    free(tlb_cpus);
+    free(tlb_counts);
+    tlbs = tlb = NULL;
+    tlb_cpus = NULL;
+    tlb_counts = NULL;
+}
+
+int tlb_enabled(void)
+{
+    return tlb != NULL;
+}
+
+/* The TLB of cpu */
+static inline tlb_entry_t *tlb_of(uint32_t cpu)
+{
+    return tlbs + (size_t) cpu * tlb_sets * tlb_ways;
+}
+
+void tlb_select_cpu(uint32_t cpu)
+{
+    if (!tlbs) {
+        return;
+    }
+    tlb = tlb_of(cpu);
+    tlb_cpu = cpu;
+}
+
+/* The first page of the huge page vpn is in */
+static inline vpn_t tlb_huge_base(vpn_t vpn)
+{
+    return vpn & ~(((vpn_t) 1 << huge_order) - 1);
+}
+
+/* Huge pages are spread over the sets by their own number, not that of
+   their first page, which would leave most sets without any */
+static inline tlb_entry_t *tlb_set(tlb_entry_t *cpu_tlb, vpn_t vpn, uint8_t huge)
+{
+    if (huge) {
+        vpn >>= huge_order;
+    }
+    return cpu_tlb + (vpn & (tlb_sets - 1)) * tlb_ways;
+}
+
+/* Invalidates entry, in the TLB of cpu. Once the CPU caches nothing of the
+   address space, invalidations need not reach it. */
+static void tlb_drop(uint32_t cpu, tlb_entry_t *entry)
+{
+    entry->valid = 0;
+    if (!--tlb_counts[(size_t) cpu * MAX_PID + entry->asid]) {
+        tlb_cpus[entry->asid] &= ~((uint64_t) 1 << cpu);
+    }
+}
+
+static tlb_entry_t *tlb_find(tlb_entry_t *cpu_tlb, uint16_t asid, vpn_t vpn, uint8_t huge)
+{
+    tlb_entry_t *set = tlb_set(cpu_tlb, vpn, huge);
+    for (uint32_t i = 0; i < tlb_ways; i++) {
+        if (set[i].valid && set[i].vpn == vpn && set[i].asid == asid && set[i].huge == huge) {
+            return set + i;
+        }
+    }
+    return NULL;
+}
+
+tlb_entry_t *tlb_lookup(uint16_t asid, vpn_t vpn)
+{
+    if (!tlb) {
+        return NULL;
+    }
+    tlb_entry_t *entry = tlb_find(tlb, asid, vpn, 0);
+    if (!entry && huge_order) {
+        entry = tlb_find(tlb, asid, tlb_huge_base(vpn), 1);
+    }
+    if (entry) {
+        entry->last_used = ++tlb_clock;
+        stats.tlb_hits++;
+    } else {
+        stats.tlb_misses++;
+    }
+    return entry;
+}
+
+static void tlb_place(uint16_t asid, vpn_t vpn, pfn_t pfn, uint8_t dirty, uint8_t huge)
+{
+    tlb_entry_t *set = tlb_set(tlb, vpn, huge);
+    tlb_entry_t *victim = tlb_find(tlb, asid, vpn, huge);
+    for (uint32_t i = 0; !victim && i < tlb_ways; i++) {
+        if (!set[i].valid) {
+            victim = set + i;
+        }
+    }
+    if (!victim) {
+        victim = set;
+        for (uint32_t i = 1; i < tlb_ways; i++) {
+            if (set[i].last_used < victim->last_used) {
+                victim = set + i;
+            }
+        }
+    }
+    if (victim->valid) {
+        tlb_drop(tlb_cpu, victim);
+    }
+    victim->valid = 1;
+    victim->dirty = dirty & 1;
+    victim->huge = huge & 1;
+    victim->asid = asid;
+    victim->vpn = vpn;
+    victim->pfn = pfn;
+    victim->last_used = ++tlb_clock;
+    tlb_counts[(size_t) tlb_cpu * MAX_PID + asid]++;
+    tlb_cpus[asid] |= (uint64_t) 1 << tlb_cpu;
+}
+
+void tlb_insert(uint16_t asid, vpn_t vpn, pfn_t pfn, uint8_t dirty)
+{
+    if (!tlb) {
+        return;
+    }
+    tlb_place(asid, vpn, pfn, dirty, 0);
+}
+
+void tlb_insert_huge(uint16_t asid, vpn_t vpn, pfn_t pfn, uint8_t dirty)
+{
+    if (!tlb) {
+        return;
+    }
+    vpn_t base = tlb_huge_base(vpn);
+    tlb_place(asid, base, pfn - (vpn - base), dirty, 1);
+}
+
+/* The next CPU in *cpus, which it is removed from, counting the shootdown
+   interrupt it takes if that is not the running CPU. Within a batch the
+   interrupt is only counted at the end, once for every CPU. */
+static uint32_t tlb_next_cpu(uint64_t *cpus)
+{
+    uint32_t cpu = (uint32_t) __builtin_ctzll(*cpus);
+    *cpus &= *cpus - 1;
+    if (tlb_batch_depth) {
+        tlb_batch_cpus |= (uint64_t) 1 << cpu;
+    } else if (cpu != tlb_cpu) {
+        stats.tlb_ipis++;
+    }
+    return cpu;
+}
+
+void tlb_invalidate(uint16_t asid, vpn_t vpn)
+{
+    if (!tlb) {
+        return;
+    }
+    for (uint64_t cpus = tlb_cpus[asid]; cpus;) {
+        uint32_t cpu = tlb_next_cpu(&cpus);
+        tlb_entry_t *entry = tlb_find(tlb_of(cpu), asid, vpn, 0);
+        if (entry) {
+            tlb_drop(cpu, entry);
+            stats.tlb_shootdowns++;
+        }
+        if (huge_order && (entry = tlb_find(tlb_of(cpu), asid, tlb_huge_base(vpn), 1))) {
+            tlb_drop(cpu, entry);
+            stats.tlb_shootdowns++;
+        }
+    }
+}
+
+void tlb_invalidate_asid(uint16_t asid)
+{
+    if (!tlb) {
+        return;
+    }
+    for (uint64_t cpus = tlb_cpus[asid]; cpus;) {
+        uint32_t cpu = tlb_next_cpu(&cpus);
+        tlb_entry_t *cpu_tlb = tlb_of(cpu);
+        for (uint32_t i = 0; i < tlb_sets * tlb_ways; i++) {
+            if (cpu_tlb[i].valid && cpu_tlb[i].asid == asid) {
+                tlb_drop(cpu, cpu_tlb + i);
+                stats.tlb_shootdowns++;
+            }
+        }
+    }
+}
+
+void tlb_batch_begin(void)
+{
+    tlb_batch_depth++;
+}
+
+void tlb_batch_end(void)
+{
+    if (--tlb_batch_depth) {
+        return;
+    }
+    stats.tlb_ipis += (uint64_t) __builtin_popcountll(tlb_batch_cpus & ~((uint64_t) 1 << tlb_cpu));
+    tlb_batch_cpus = 0;
+}
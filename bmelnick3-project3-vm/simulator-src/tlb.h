@@ -0,0 +1,111 @@
+#pragma once
+
+#include "pagesim.h"
+#include "types.h"
+
+/*
+ * The translation lookaside buffer (TLB).
+ *
+ * A set-associative cache of VPN -> PFN translations sitting in front of the
+ * page table. Entries are tagged with an address space identifier (the PID of
+ * the owning process), so context switches do not need to flush it. The OS
+ * must instead invalidate translations whenever it tears a mapping down:
+ * when free_frame() evicts a page and when proc_cleanup() tears down a whole
+ * process.
+ *
+ * With -H, one entry can also cache a whole huge page (see paging.h): its
+ * vpn and pfn are then those of the first page, and it sits in the set the
+ * huge page's number selects. A lookup that finds no entry for the page
+ * itself tries the huge page it would be part of.
+ *
+ * With -P every CPU has a TLB of its own, and lookups and inserts use that
+ * of the CPU running the step (see tlb_select_cpu()). Invalidations must
+ * then reach every CPU that still caches translations of the address
+ * space, which is tracked as entries come and go. Each CPU other than the
+ * running one costs a TLB shootdown interrupt, counted in stats_t and
+ * charged to the access time. Invalidations made between tlb_batch_begin()
+ * and tlb_batch_end() interrupt each CPU they reach once, at the end.
+ *
+ * The TLB is disabled unless the simulator is run with -t, in which case
+ * lookups, misses and invalidations are counted in stats_t.
+ */
+typedef struct tlb_entry {
+    uint8_t valid;
+    unsigned dirty : 1;         /* The page table entry is known to be dirty,
+                                   so writes need not walk the page table */
+    unsigned huge : 1;          /* The entry maps a whole huge page */
+    uint16_t asid;
+    vpn_t vpn;
+    pfn_t pfn;
+    uint32_t last_used;         /* For LRU replacement within a set */
+} tlb_entry_t;
+
+/**
+ * Sizes the TLB. Both entries and ways must be powers of two, with
+ * ways <= entries. Passing zero entries leaves the TLB disabled.
+ */
+void tlb_init(uint32_t entries, uint32_t ways);
+
+/**
+ * Frees the TLB, leaving it disabled.
+ */
+void tlb_teardown(void);
+
+/**
+ * Returns 1 if the TLB has been enabled with tlb_init().
+ */
+int tlb_enabled(void);
+
+/**
+ * Makes the TLB of cpu the one lookups and inserts use.
+ */
+void tlb_select_cpu(uint32_t cpu);
+
+/**
+ * Looks up the translation for vpn in address space asid. Counts a hit or
+ * miss in stats_t and returns the entry on a hit, NULL on a miss.
+ */
+tlb_entry_t *tlb_lookup(uint16_t asid, vpn_t vpn);
+
+/**
+ * Returns the frame entry translates vpn to.
+ */
+static inline pfn_t tlb_entry_pfn(const tlb_entry_t *entry, vpn_t vpn) {
+    return entry->pfn + (vpn - entry->vpn);
+}
+
+/**
+ * Caches the translation vpn -> pfn for address space asid, evicting the
+ * least recently used entry in its set if necessary.
+ */
+void tlb_insert(uint16_t asid, vpn_t vpn, pfn_t pfn, uint8_t dirty);
+
+/**
+ * Caches the translation for the whole huge page vpn is in, which is
+ * resident in the block of frames pfn is in.
+ */
+void tlb_insert_huge(uint16_t asid, vpn_t vpn, pfn_t pfn, uint8_t dirty);
+
+/**
+ * Invalidates the translation for vpn in address space asid, if cached,
+ * along with that of any huge page it is in, on every CPU.
+ */
+void tlb_invalidate(uint16_t asid, vpn_t vpn);
+
+/**
+ * Invalidates every translation belonging to address space asid, on every
+ * CPU.
+ */
+void tlb_invalidate_asid(uint16_t asid);
+
+/**
+ * Starts a batch of invalidations, which may nest. Until the outermost
+ * batch ends, the CPUs invalidations reach are only noted.
+ */
+void tlb_batch_begin(void);
+
+/**
+ * Ends a batch of invalidations. The outermost one then interrupts every
+ * CPU noted but the running one, once.
+ */
+void tlb_batch_end(void);
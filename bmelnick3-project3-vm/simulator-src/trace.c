@@ -0,0 +1,402 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "util.h"
+
+/* Constants used in parsing the trace file */
+static const char *START = "START";
+static const char *STOP = "STOP";
+static const char *FORK = "FORK";
+static const char *SHM_CREATE = "SHM_CREATE";
+static const char *SHM_ATTACH = "SHM_ATTACH";
+static const char *SHM_DETACH = "SHM_DETACH";
+
+// There are seven types of commands:
+//      Start Process:  START <PID>
+//      Stop Process:   STOP <PID>
+//      Fork Process:   FORK <Parent PID> <Child PID>
+//      Create Segment: SHM_CREATE <Segment> <Pages>
+//      Attach Segment: SHM_ATTACH <PID> <Segment> <Address>
+//      Detach Segment: SHM_DETACH <PID> <Segment>
+//      Memory Access:  <PID> <r/w> <Address> <Value> [<CPU>]
+//
+// An access without a CPU runs on CPU 0.
+// Returns NULL on success, or the message to report for a malformed line.
+static const char *trace_decode_line(const char *cmd, trace_record_t *rec)
+{
+    char rw;
+    uint8_t data;
+    uint32_t address;
+    uint32_t pid;
+    uint32_t child;
+    uint32_t id;
+    uint32_t cpu = 0;
+
+    memset(rec, 0, sizeof(*rec));
+
+    if (!strncmp(cmd, START, 5))  // Start Process Command
+    {
+        int ret = sscanf(cmd+6, "%" PRIu32 "\n", &pid);  // Get the PID from the command
+
+        if (ret == 1)
+        {
+            rec->op = TRACE_START;
+            rec->pid = pid;
+        }
+        else
+        {
+            return "Unable to parse trace file: Invalid START command encountered\n";
+        }
+    }
+    else if (!strncmp(cmd, STOP, 4))  // Stop Process Command
+    {
+        /* Start scanning from the pid digits */
+        int ret = sscanf((cmd+5), "%" PRIu32 "\n", &pid);
+        if (ret == 1)
+        {
+            rec->op = TRACE_STOP;
+            rec->pid = pid;
+        }
+        else
+        {
+            return "Unable to parse trace file: Invalid STOP command encountered\n";
+        }
+    }
+    else if (!strncmp(cmd, FORK, 4))  // Fork Process Command
+    {
+        int ret = sscanf((cmd+5), "%" PRIu32 " %" PRIu32 "\n", &pid, &child);
+        if (ret == 2)
+        {
+            rec->op = TRACE_FORK;
+            rec->pid = pid;
+            rec->address = child;
+        }
+        else
+        {
+            return "Unable to parse trace file: Invalid FORK command encountered\n";
+        }
+    }
+    else if (!strncmp(cmd, SHM_CREATE, 10))  // Create Shared Memory Segment
+    {
+        int ret = sscanf((cmd+11), "%" PRIu32 " %" PRIu32 "\n", &id, &address);
+        if (ret == 2 && id <= UINT8_MAX)
+        {
+            rec->op = TRACE_SHM_CREATE;
+            rec->data = (uint8_t) id;
+            rec->address = address;
+        }
+        else
+        {
+            return "Unable to parse trace file: Invalid SHM_CREATE command encountered\n";
+        }
+    }
+    else if (!strncmp(cmd, SHM_ATTACH, 10))  // Attach Shared Memory Segment
+    {
+        int ret = sscanf((cmd+11), "%" PRIu32 " %" PRIu32 " %x\n", &pid, &id, &address);
+        if (ret == 3 && id <= UINT8_MAX)
+        {
+            rec->op = TRACE_SHM_ATTACH;
+            rec->pid = pid;
+            rec->data = (uint8_t) id;
+            rec->address = address;
+        }
+        else
+        {
+            return "Unable to parse trace file: Invalid SHM_ATTACH command encountered\n";
+        }
+    }
+    else if (!strncmp(cmd, SHM_DETACH, 10))  // Detach Shared Memory Segment
+    {
+        int ret = sscanf((cmd+11), "%" PRIu32 " %" PRIu32 "\n", &pid, &id);
+        if (ret == 2 && id <= UINT8_MAX)
+        {
+            rec->op = TRACE_SHM_DETACH;
+            rec->pid = pid;
+            rec->data = (uint8_t) id;
+        }
+        else
+        {
+            return "Unable to parse trace file: Invalid SHM_DETACH command encountered\n";
+        }
+    }
+    else  // Memory Access Command
+    {
+        int ret = sscanf(cmd, "%u %c %x %hhu %u\n", &pid, &rw, &address, &data, &cpu);
+
+        if ((ret == 4 || ret == 5) && cpu <= UINT8_MAX)
+        {
+            rec->op = TRACE_ACCESS;
+            rec->pid = pid;
+            rec->rw = (uint8_t) rw;
+            rec->address = address;
+            rec->data = data;
+            rec->cpu = (uint8_t) cpu;
+        }
+        else
+        {
+            return "Unable to parse trace file: Invalid memory access command encountered\n";
+        }
+    }
+    return NULL;
+}
+
+void trace_parse_line(const char *cmd, trace_record_t *rec)
+{
+    const char *error = trace_decode_line(cmd, rec);
+    if (error) {
+        printf("%s", error);
+        exit(1);
+    }
+}
+
+const trace_record_t *trace_map(const char *path, uint64_t *count)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Unable to open trace file");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("Unable to stat trace file");
+        exit(1);
+    }
+    if ((size_t) st.st_size < sizeof(trace_header_t)) {
+        fprintf(stderr, "ERROR: %s is not a binary trace.\n", path);
+        exit(1);
+    }
+
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Unable to map trace file");
+        exit(1);
+    }
+    close(fd);
+    madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+    const trace_header_t *hdr = map;
+    if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC))
+        || hdr->version != TRACE_VERSION
+        || hdr->record_size != sizeof(trace_record_t)
+        || hdr->count > ((size_t) st.st_size - sizeof(trace_header_t)) / sizeof(trace_record_t)) {
+        fprintf(stderr, "ERROR: %s is not a valid binary trace.\n", path);
+        exit(1);
+    }
+
+    *count = hdr->count;
+    return (const trace_record_t *) (hdr + 1);
+}
+
+void trace_unmap(const trace_record_t *records, uint64_t count)
+{
+    const trace_header_t *hdr = (const trace_header_t *) records - 1;
+    munmap((void *) (uintptr_t) hdr, sizeof(trace_header_t) + count * sizeof(trace_record_t));
+}
+
+trace_record_t *trace_load(FILE *fin, uint64_t *count)
+{
+    uint64_t capacity = 4096;
+    trace_record_t *records = malloc(capacity * sizeof(trace_record_t));
+    if (!records) {
+        panic("could not allocate trace records");
+    }
+
+    char buf[120];
+    *count = 0;
+    while ((fgets(buf, sizeof(buf), fin))) {
+        if (*count == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(trace_record_t));
+            if (!records) {
+                panic("could not allocate trace records");
+            }
+        }
+        trace_parse_line(buf, &records[(*count)++]);
+    }
+    return records;
+}
+
+void trace_convert(FILE *fin, const char *path)
+{
+    FILE *fout = fopen(path, "wb");
+    if (!fout) {
+        perror("Unable to open output trace file");
+        exit(1);
+    }
+
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(trace_record_t);
+
+    /* Reserve room for the header; the count is filled in at the end */
+    fwrite(&hdr, sizeof(hdr), 1, fout);
+
+    char buf[120];
+    trace_record_t rec;
+    while ((fgets(buf, sizeof(buf), fin))) {
+        trace_parse_line(buf, &rec);
+        fwrite(&rec, sizeof(rec), 1, fout);
+        hdr.count++;
+    }
+
+    rewind(fout);
+    fwrite(&hdr, sizeof(hdr), 1, fout);
+    if (ferror(fout) || fclose(fout)) {
+        perror("Unable to write output trace file");
+        exit(1);
+    }
+}
+
+/*
+ * The trace reader. The parser thread fills batches of records and hands
+ * them to the simulation thread through a single-producer/single-consumer
+ * ring. Each side owns one index, published with release stores and read
+ * with acquire loads, so a batch is never touched by both threads at once.
+ * A side that finds the ring full (or empty) yields to the other for a
+ * while, then sleeps until the other side moves its index. Publishing only
+ * takes the lock when someone is asleep.
+ */
+#define TRACE_BATCH_RECORDS 1024
+#define TRACE_RING_BATCHES 32
+#define TRACE_SPINS 64          /* Yields before a waiting side sleeps */
+
+typedef struct trace_batch {
+    uint32_t count;
+    uint8_t last;               /* No batches follow this one */
+    const char *error;          /* Report this after the batch's records */
+    trace_record_t records[TRACE_BATCH_RECORDS];
+} trace_batch_t;
+
+struct trace_reader {
+    FILE *fin;
+    pthread_t thread;
+    trace_batch_t ring[TRACE_RING_BATCHES];
+    /* Free-running batch counters, each on its own cache line */
+    uint32_t head __attribute__((aligned(64)));   /* Next batch to fill */
+    uint32_t tail __attribute__((aligned(64)));   /* Next batch to consume */
+    /* For a side that is done spinning */
+    pthread_mutex_t lock __attribute__((aligned(64)));
+    pthread_cond_t moved;
+    uint32_t sleepers;
+    /* Consumer state */
+    trace_batch_t *current;
+    uint32_t next;
+};
+
+/* Waits until the other side moves *index away from value */
+static void trace_reader_wait(trace_reader_t *reader, const uint32_t *index, uint32_t value)
+{
+    for (uint32_t spins = 0; spins < TRACE_SPINS; spins++) {
+        if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != value) {
+            return;
+        }
+        sched_yield();
+    }
+    pthread_mutex_lock(&reader->lock);
+    /* Announce the sleeper before looking again; trace_reader_publish()
+       stores before it looks for sleepers, so one of them sees the other */
+    __atomic_add_fetch(&reader->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(index, __ATOMIC_SEQ_CST) == value) {
+        pthread_cond_wait(&reader->moved, &reader->lock);
+    }
+    __atomic_sub_fetch(&reader->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+/* Moves *index on to value, waking the other side if it is asleep */
+static void trace_reader_publish(trace_reader_t *reader, uint32_t *index, uint32_t value)
+{
+    __atomic_store_n(index, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&reader->sleepers, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&reader->lock);
+        pthread_cond_broadcast(&reader->moved);
+        pthread_mutex_unlock(&reader->lock);
+    }
+}
+
+static void *trace_reader_run(void *arg)
+{
+    trace_reader_t *reader = arg;
+    char buf[120];
+    uint8_t last = 0;
+
+    while (!last) {
+        uint32_t head = reader->head;
+        if (head - __atomic_load_n(&reader->tail, __ATOMIC_ACQUIRE) == TRACE_RING_BATCHES) {
+            trace_reader_wait(reader, &reader->tail, head - TRACE_RING_BATCHES);
+        }
+
+        trace_batch_t *batch = &reader->ring[head % TRACE_RING_BATCHES];
+        batch->count = 0;
+        batch->error = NULL;
+        while (batch->count < TRACE_BATCH_RECORDS) {
+            if (!fgets(buf, sizeof(buf), reader->fin)) {
+                last = 1;
+                break;
+            }
+            batch->error = trace_decode_line(buf, &batch->records[batch->count]);
+            if (batch->error) {
+                last = 1;
+                break;
+            }
+            batch->count++;
+        }
+        batch->last = last;
+
+        trace_reader_publish(reader, &reader->head, head + 1);
+    }
+    return NULL;
+}
+
+trace_reader_t *trace_reader_start(FILE *fin)
+{
+    trace_reader_t *reader = calloc(1, sizeof(trace_reader_t));
+    if (!reader) {
+        panic("could not allocate trace reader");
+    }
+    reader->fin = fin;
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->moved, NULL);
+    if (pthread_create(&reader->thread, NULL, trace_reader_run, reader)) {
+        panic("could not start trace reader thread");
+    }
+    return reader;
+}
+
+const trace_record_t *trace_reader_next(trace_reader_t *reader)
+{
+    trace_batch_t *batch = reader->current;
+    while (!batch || reader->next == batch->count) {
+        if (batch) {
+            if (batch->error) {
+                printf("%s", batch->error);
+                exit(1);
+            }
+            if (batch->last) {
+                return NULL;
+            }
+            /* Hand the batch back to the parser */
+            trace_reader_publish(reader, &reader->tail, reader->tail + 1);
+        }
+        trace_reader_wait(reader, &reader->head, reader->tail);
+        batch = reader->current = &reader->ring[reader->tail % TRACE_RING_BATCHES];
+        reader->next = 0;
+    }
+    return &batch->records[reader->next++];
+}
+
+void trace_reader_stop(trace_reader_t *reader)
+{
+    pthread_join(reader->thread, NULL);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->moved);
+    free(reader);
+}
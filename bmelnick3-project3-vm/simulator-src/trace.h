@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "types.h"
+
+/*
+ * Trace commands.
+ *
+ * Every line of a text trace is decoded into one fixed-size trace record
+ * before it is simulated. The binary trace format is simply a header
+ * followed by an array of these records, so it can be mmap'd and walked
+ * directly without any parsing.
+ */
+#define TRACE_START 1
+#define TRACE_STOP 2
+#define TRACE_ACCESS 3
+#define TRACE_FORK 4
+#define TRACE_SHM_CREATE 5
+#define TRACE_SHM_ATTACH 6
+#define TRACE_SHM_DETACH 7
+
+typedef struct trace_record {
+    uint8_t op;                 /* One of the TRACE_ constants above */
+    uint8_t rw;                 /* 'r' or 'w' for accesses */
+    uint8_t data;               /* The byte to write for write accesses, or
+                                   the segment for SHM commands */
+    uint8_t cpu;                /* The CPU an access runs on (see -P) */
+    uint32_t pid;               /* The parent, for forks */
+    uint32_t address;           /* The child's PID, for forks, and the size
+                                   in pages, for SHM_CREATE */
+} trace_record_t;
+
+#define TRACE_MAGIC "VMTRACE"
+#define TRACE_VERSION 1
+
+typedef struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;       /* sizeof(trace_record_t) */
+    uint64_t count;             /* Number of records that follow */
+} trace_header_t;
+
+/**
+ * Decodes one line of a text trace into a record. Exits the simulator with
+ * a diagnostic if the line is malformed.
+ */
+void trace_parse_line(const char *line, trace_record_t *rec);
+
+/**
+ * Maps a binary trace into memory read-only. Exits the simulator if the file
+ * cannot be opened or is not a valid binary trace.
+ *
+ * @param path the binary trace to map
+ * @param count set to the number of records in the trace
+ * @return a pointer to the first record
+ */
+const trace_record_t *trace_map(const char *path, uint64_t *count);
+
+/**
+ * Releases a mapping returned by trace_map().
+ */
+void trace_unmap(const trace_record_t *records, uint64_t count);
+
+/**
+ * Reads a whole text trace into memory, for consumers that need to see the
+ * trace before it is simulated. Exits the simulator if a line is malformed.
+ *
+ * @param fin the text trace to read
+ * @param count set to the number of records in the trace
+ * @return the records, to be released with free()
+ */
+trace_record_t *trace_load(FILE *fin, uint64_t *count);
+
+/**
+ * Converts a text trace into the binary format.
+ *
+ * @param fin the text trace to read
+ * @param path the binary trace to write
+ */
+void trace_convert(FILE *fin, const char *path);
+
+/*
+ * Pipelined reading of text traces.
+ *
+ * A parser thread reads and decodes the trace ahead of the simulation, so
+ * parsing overlaps with simulating. Records still come out one at a time,
+ * in trace order, and a malformed line is reported only once every record
+ * before it has been consumed, so output is the same as parsing in line.
+ */
+typedef struct trace_reader trace_reader_t;
+
+/**
+ * Starts a parser thread reading the text trace fin.
+ */
+trace_reader_t *trace_reader_start(FILE *fin);
+
+/**
+ * Returns the next record of the trace, or NULL at its end. The record
+ * stays valid until the next call. Exits the simulator with a diagnostic
+ * when it reaches a malformed line.
+ */
+const trace_record_t *trace_reader_next(trace_reader_t *reader);
+
+/**
+ * Waits for the parser thread, which must have reached the end of the
+ * trace, and frees the reader. The caller still owns fin.
+ */
+void trace_reader_stop(trace_reader_t *reader);
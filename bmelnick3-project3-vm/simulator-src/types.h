@@ -1,6 +1,14 @@
 #pragma once
 
 #include <inttypes.h> /* For uintXX_t types */
+#include <stddef.h>   /* For size_t */
+
+/*
+ * Storage class of the state of a simulated machine. It is thread-local so
+ * a parameter sweep can simulate several machines at once, one per thread;
+ * everything else is set up before the simulation and only read after.
+ */
+#define SIM_LOCAL __thread
 
 /* Virtual addresses are stored in a 32-bit integer. */
 typedef uint32_t vaddr_t;
@@ -8,11 +16,12 @@ typedef uint32_t vaddr_t;
 /* Physical addresses are stored in a 32-bit integer. */
 typedef uint32_t paddr_t;
 
-/* Virtual page numbers can be up to 16 bits. For pedantic reasons. */
-typedef uint16_t vpn_t;
+/* Virtual page numbers can be up to 32 bits, since the memory geometry is
+   chosen at runtime. */
+typedef uint32_t vpn_t;
 
-/* Physical frame numbers can be up to 16 bits. For pedantic reasons. */
-typedef uint16_t pfn_t;
+/* Physical frame numbers can be up to 32 bits, for the same reason. */
+typedef uint32_t pfn_t;
 
 /* This machine is byte addressed, so an unsigned char will suffice. */
 typedef unsigned char word_t;
@@ -1,3 +1,4 @@
+#include "types.h"
 #include "util.h"
 
 typedef struct { uint64_t state;  uint64_t inc; } pcg32_random_t;
@@ -15,7 +16,7 @@ uint32_t pcg32_random_r(pcg32_random_t* rng) {
     return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
 }
 
-pcg32_random_t rstate = {0x57424aae4a2024be, 0x28bfcf2f5a7cdfa3};
+SIM_LOCAL pcg32_random_t rstate = {0x57424aae4a2024be, 0x28bfcf2f5a7cdfa3};
 
 uint32_t prng_rand() {
     return pcg32_random_r(&rstate);
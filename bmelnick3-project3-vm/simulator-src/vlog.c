@@ -0,0 +1,119 @@
+#include "vlog.h"
+#include "util.h"
+
+SIM_LOCAL uint8_t vlog_mode = VLOG_TEXT;
+
+static SIM_LOCAL FILE *vlog_file;
+static SIM_LOCAL vlog_record_t *vlog_buf;
+static SIM_LOCAL size_t vlog_used;
+
+#define VLOG_BUFFER_RECORDS (VLOG_BUFFER_SIZE / sizeof(vlog_record_t))
+
+static void vlog_print(FILE *out, const vlog_record_t *rec)
+{
+    switch (rec->kind) {
+    case 'S':
+        fprintf(out, "%8u: PID %u started\n", rec->step, rec->pid);
+        break;
+    case 'T':
+        fprintf(out, "%8u: PID %u stopped\n", rec->step, rec->pid);
+        break;
+    case 'F':
+        fprintf(out, "%8u: PID %u forked PID %u\n", rec->step, rec->pid, rec->address);
+        break;
+    case 'C':
+        fprintf(out, "%8u: SHM %u created, %u pages\n", rec->step, rec->data, rec->address);
+        break;
+    case 'A':
+        fprintf(out, "%8u: PID %u attached SHM %u at 0x%05x\n", rec->step, rec->pid, rec->data, rec->address);
+        break;
+    case 'D':
+        fprintf(out, "%8u: PID %u detached SHM %u\n", rec->step, rec->pid, rec->data);
+        break;
+    case 'r':
+        fprintf(out, "%8u: %3u  r  0x%05x -> %02hhx\n", rec->step, rec->pid, rec->address, rec->data);
+        break;
+    default:
+        fprintf(out, "%8u: %3u  w  0x%05x <- %02hhx\n", rec->step, rec->pid, rec->address, rec->data);
+        break;
+    }
+}
+
+static void vlog_flush(void)
+{
+    if (vlog_used && fwrite(vlog_buf, sizeof(vlog_record_t), vlog_used, vlog_file) != vlog_used) {
+        perror("Unable to write verification log");
+        exit(1);
+    }
+    vlog_used = 0;
+}
+
+/* Registered with atexit so a panic mid-run still leaves a complete log */
+static void vlog_close(void)
+{
+    vlog_flush();
+    fclose(vlog_file);
+    free(vlog_buf);
+}
+
+void vlog_buffer_stdout(void)
+{
+    /* Text and summary output both go through stdout in large blocks */
+    setvbuf(stdout, NULL, _IOFBF, VLOG_BUFFER_SIZE);
+}
+
+void vlog_open(uint8_t mode, const char *path)
+{
+    vlog_mode = mode;
+
+    if (mode != VLOG_BINARY) {
+        return;
+    }
+    if (!(vlog_file = fopen(path, "wb"))) {
+        perror("Unable to open verification log");
+        exit(1);
+    }
+    if (!(vlog_buf = malloc(VLOG_BUFFER_RECORDS * sizeof(vlog_record_t)))) {
+        panic("could not allocate verification log buffer");
+    }
+    fwrite(VLOG_MAGIC, sizeof(VLOG_MAGIC), 1, vlog_file);
+    atexit(vlog_close);
+}
+
+void vlog_emit(timestamp_t when, uint8_t kind, uint32_t pid, uint32_t address, uint8_t data)
+{
+    vlog_record_t rec = { .step = when, .pid = pid, .address = address, .kind = kind, .data = data };
+
+    if (vlog_mode == VLOG_TEXT) {
+        vlog_print(stdout, &rec);
+    } else if (vlog_mode == VLOG_BINARY) {
+        vlog_buf[vlog_used++] = rec;
+        if (vlog_used == VLOG_BUFFER_RECORDS) {
+            vlog_flush();
+        }
+    }
+}
+
+void vlog_render(const char *path)
+{
+    FILE *fin = fopen(path, "rb");
+    if (!fin) {
+        perror("Unable to open verification log");
+        exit(1);
+    }
+
+    char magic[sizeof(VLOG_MAGIC)];
+    if (fread(magic, sizeof(magic), 1, fin) != 1 || memcmp(magic, VLOG_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "ERROR: %s is not a verification log.\n", path);
+        exit(1);
+    }
+
+    vlog_record_t recs[4096];
+    size_t n;
+    while ((n = fread(recs, sizeof(vlog_record_t), sizeof(recs) / sizeof(recs[0]), fin)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            vlog_print(stdout, &recs[i]);
+        }
+    }
+    fclose(fin);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "pagesim.h"
+#include "types.h"
+
+/*
+ * The verification log.
+ *
+ * Every trace command produces one line of output that is diffed against
+ * reference runs. The log can be written as text (the default), suppressed
+ * entirely for summary-only runs, or written as fixed-size binary records that are rendered back to the exact same text later with -L.
+ */
+#define VLOG_TEXT 0
+#define VLOG_QUIET 1
+#define VLOG_BINARY 2
+
+/* Size of the user-space buffers used for both text and binary logs */
+#define VLOG_BUFFER_SIZE (1 << 20)
+
+typedef struct vlog_record {
+    timestamp_t step;
+    uint32_t pid;
+    uint32_t address;
+    uint8_t kind;               /* 'S'tart, s'T'op, 'F'ork, 'r'ead, 'w'rite,
+                                   or SHM segment 'C'reate, 'A'ttach, 'D'etach */
+    uint8_t data;               /* Byte read or written, or the segment */
+    uint8_t reserved[2];
+} vlog_record_t;
+
+#define VLOG_MAGIC "VMVLOG"
+
+extern SIM_LOCAL uint8_t vlog_mode;
+
+/**
+ * Gives stdout a large buffer for the log and the summary. Must be called
+ * before anything is written to stdout.
+ */
+void vlog_buffer_stdout(void);
+
+/**
+ * Sets up the verification log. For VLOG_BINARY, path names the log file.
+ */
+void vlog_open(uint8_t mode, const char *path);
+
+/**
+ * Writes one event to the verification log.
+ */
+void vlog_emit(timestamp_t when, uint8_t kind, uint32_t pid, uint32_t address, uint8_t data);
+
+/**
+ * Renders the binary verification log at path to stdout as text.
+ */
+void vlog_render(const char *path);
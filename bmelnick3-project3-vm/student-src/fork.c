@@ -0,0 +1,197 @@
+#include "paging.h"
+#include "pagesim.h"
+#include "swapops.h"
+#include "stats.h"
+#include "tlb.h"
+#include "util.h"
+#include "replacement.h"
+
+/*
+ * FORK with copy-on-write (see paging.h).
+ *
+ * The reverse map chains hang off the frame table entries, through indices
+ * into one node pool that grows by doubling and recycles its nodes through a
+ * free list. Node 0 is never handed out, so an rmap of 0 is an empty chain.
+ * Pages of SHM segments share frames through the same chains (see shm.c).
+ *
+ * Replacement policies know a frame by the page in its frame table entry
+ * (see page_key()), so every change to a chain goes through policy_on_share(),
+ * which for most policies only shows the frame evicted and faulted in anew
+ * when that page stops sharing the frame and another takes its place.
+ */
+
+typedef struct rmap_node {
+    pcb_t *process;
+    vpn_t vpn;
+    uint32_t next;
+} rmap_node_t;
+
+static SIM_LOCAL rmap_node_t *rmap_nodes;
+static SIM_LOCAL uint32_t rmap_capacity;
+static SIM_LOCAL uint32_t rmap_free;
+
+static uint32_t rmap_node_alloc(void) {
+    if (!rmap_free) {
+        uint32_t old_capacity = rmap_capacity ? rmap_capacity : 1;
+        rmap_capacity = old_capacity * 2;
+        rmap_nodes = realloc(rmap_nodes, rmap_capacity * sizeof(rmap_node_t));
+        if (!rmap_nodes) {
+            panic("could not allocate reverse map");
+        }
+        for (uint32_t i = rmap_capacity; i-- > old_capacity;) {
+            rmap_nodes[i].next = rmap_free;
+            rmap_free = i;
+        }
+    }
+    uint32_t n = rmap_free;
+    rmap_free = rmap_nodes[n].next;
+    return n;
+}
+
+static void rmap_node_free(uint32_t n) {
+    rmap_nodes[n].next = rmap_free;
+    rmap_free = n;
+}
+
+/* Every page sharing a frame beyond the first is a frame saved */
+static void rmap_count(pfn_t pfn, int delta) {
+    frame_table[pfn].refcount = (uint16_t) (frame_table[pfn].refcount + delta);
+    stats.frames_saved = (uint64_t) ((int64_t) stats.frames_saved + delta);
+    if (stats.frames_saved > stats.frames_saved_max) {
+        stats.frames_saved_max = stats.frames_saved;
+    }
+    if (check_corruption) {
+        check_touch_frame(pfn);
+    }
+}
+
+void rmap_add(pfn_t pfn, pcb_t *proc, vpn_t vpn) {
+    uint32_t n = rmap_node_alloc();
+    rmap_nodes[n].process = proc;
+    rmap_nodes[n].vpn = vpn;
+    rmap_nodes[n].next = frame_table[pfn].rmap;
+    frame_table[pfn].rmap = n;
+    rmap_count(pfn, 1);
+    policy_on_share(pfn, 0);
+}
+
+int rmap_pop(pfn_t pfn, pcb_t **proc, vpn_t *vpn) {
+    uint32_t n = frame_table[pfn].rmap;
+    if (!n) {
+        return 0;
+    }
+    *proc = rmap_nodes[n].process;
+    *vpn = rmap_nodes[n].vpn;
+    frame_table[pfn].rmap = rmap_nodes[n].next;
+    rmap_node_free(n);
+    rmap_count(pfn, -1);
+    return 1;
+}
+
+void rmap_remove(pfn_t pfn, pcb_t *proc, vpn_t vpn) {
+    fte_t *fte = frame_table + pfn;
+    if (fte->process == proc && fte->vpn == vpn) {
+        policy_before_owner_change(pfn);
+        if (!rmap_pop(pfn, &fte->process, &fte->vpn)) {
+            panic("Attempted to unshare a frame that is not shared");
+        }
+        policy_on_share(pfn, 1);
+        return;
+    }
+    for (uint32_t *link = &fte->rmap; *link; link = &rmap_nodes[*link].next) {
+        uint32_t n = *link;
+        if (rmap_nodes[n].process == proc && rmap_nodes[n].vpn == vpn) {
+            *link = rmap_nodes[n].next;
+            rmap_node_free(n);
+            rmap_count(pfn, -1);
+            policy_on_share(pfn, 0);
+            return;
+        }
+    }
+    panic("Attempted to unshare a frame from a page that does not map it");
+}
+
+int rmap_next(pfn_t pfn, uint32_t *cursor, pcb_t **proc, vpn_t *vpn) {
+    uint32_t n = *cursor ? rmap_nodes[*cursor].next : frame_table[pfn].rmap;
+    if (!n) {
+        return 0;
+    }
+    *cursor = n;
+    *proc = rmap_nodes[n].process;
+    *vpn = rmap_nodes[n].vpn;
+    return 1;
+}
+
+int rmap_maps(pfn_t pfn, const pcb_t *proc, vpn_t vpn) {
+    if (frame_table[pfn].process == proc && frame_table[pfn].vpn == vpn) {
+        return 1;
+    }
+    for (uint32_t n = frame_table[pfn].rmap; n; n = rmap_nodes[n].next) {
+        if (rmap_nodes[n].process == proc && rmap_nodes[n].vpn == vpn) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void rmap_teardown(void) {
+    free(rmap_nodes);
+    rmap_nodes = NULL;
+    rmap_capacity = 0;
+    rmap_free = 0;
+}
+
+void proc_fork(pcb_t *parent, pcb_t *child) {
+    proc_init(child);
+    shm_fork(parent, child);
+
+    for (uint32_t i = 0; i < parent->page_count; i++) {
+        vpn_t vpn = parent->pages[i];
+        pte_t *pte = pt_walk(parent->saved_ptbr, vpn, 0);
+        if (!pte->valid && !pte->swap) {
+            continue;
+        }
+
+        /* Allocating the child's page tables may evict pages, so look the
+           parent's entry up again afterwards */
+        pte_t *child_pte = pt_walk(child->saved_ptbr, vpn, 1);
+        pte = pt_walk(parent->saved_ptbr, vpn, 0);
+        if (!pte->valid && !pte->swap) {
+            continue;
+        }
+
+        /* The parent's huge pages are about to be shared page by page */
+        if (pte->huge) {
+            huge_split(parent, vpn);
+        }
+
+        child_pte->valid = pte->valid;
+        child_pte->zero = pte->zero;
+        child_pte->pfn = pte->pfn;
+        child_pte->swap = 0;
+        if (pte->shm) {
+            /* The child attached the segment too, so the page is simply
+               mapped by one more process */
+            child_pte->shm = 1;
+            child_pte->dirty = 0;
+            rmap_add(pte->pfn, child, vpn);
+        } else if (pte->valid && !pte->zero) {
+            /* The child has no swap entry to go back to, so unless the frame
+               still holds a page of zeroes it must be written back */
+            child_pte->dirty = pte->dirty || pte->swap;
+            child_pte->cow = 1;
+            pte->cow = 1;
+            rmap_add(pte->pfn, child, vpn);
+        } else {
+            child_pte->dirty = 0;
+            if (pte->swap) {
+                swap_duplicate(pte, child_pte);
+            }
+        }
+        proc_track_page(child, vpn, child_pte);
+    }
+
+    /* The parent's cached translations may still allow writes */
+    tlb_invalidate_asid((uint16_t) parent->pid);
+    stats.forks++;
+}
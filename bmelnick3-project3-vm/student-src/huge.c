@@ -0,0 +1,132 @@
+#include "paging.h"
+#include "pagesim.h"
+#include "stats.h"
+#include "tlb.h"
+#include "util.h"
+
+/*
+ * Huge pages (see paging.h).
+ *
+ * Only pages a process has to itself can be part of a huge page: zero
+ * pages, pages shared copy-on-write and pages of SHM segments never are. A
+ * huge page is split before any of its frames changes hands, so every
+ * mapping of a huge page always covers its whole, aligned block.
+ */
+
+#define HUGE_PAGES ((uint32_t) 1 << huge_order)
+#define HUGE_MASK (HUGE_PAGES - 1)
+
+/* Whether pte maps a page that may be part of a huge page */
+static inline int huge_eligible(const pte_t *pte) {
+    return pte && pte->valid && !pte->zero && !pte->cow && !pte->shm;
+}
+
+pfn_t huge_frame(vpn_t vpn) {
+    vpn_t base = vpn & ~HUGE_MASK;
+    pfn_t block = NUM_FRAMES;
+
+    /* The block the region's resident pages are in, if they are in one */
+    for (uint32_t i = 0; i < HUGE_PAGES; i++) {
+        pte_t *pte = base + i == vpn ? NULL : pt_walk(PTBR, base + i, 0);
+        if (huge_eligible(pte)) {
+            if (pte->pfn >= i && !((pte->pfn - i) & HUGE_MASK)) {
+                block = pte->pfn - i;
+            }
+            break;
+        }
+    }
+    /* Or else a whole free block to reserve for the region */
+    if (block == NUM_FRAMES) {
+        block = frame_find_free_block(huge_order);
+    }
+
+    if (block + HUGE_PAGES <= NUM_FRAMES && frame_is_free(block + (vpn & HUGE_MASK))) {
+        frame_mark_used(block + (vpn & HUGE_MASK));
+        stats.huge_reserved++;
+        return block + (vpn & HUGE_MASK);
+    }
+    return free_frame();
+}
+
+/* Promotes the region starting at base to a huge page if all of it is
+   resident */
+static void huge_promote(pcb_t *proc, vpn_t base) {
+    pte_t *ptes[64];
+    int in_place = 1;
+    uint8_t dirty = 0;
+
+    for (uint32_t i = 0; i < HUGE_PAGES; i++) {
+        ptes[i] = pt_walk(proc->saved_ptbr, base + i, 0);
+        if (!huge_eligible(ptes[i])) {
+            return;
+        }
+        in_place &= ptes[i]->pfn == ptes[0]->pfn + i;
+        dirty |= ptes[i]->dirty;
+    }
+
+    if (in_place && !(ptes[0]->pfn & HUGE_MASK)) {
+        /* The cached translations of its pages would shadow the huge one */
+        for (uint32_t i = 0; i < HUGE_PAGES; i++) {
+            tlb_invalidate((uint16_t) proc->pid, base + i);
+        }
+    } else {
+        pfn_t block = frame_find_free_block(huge_order);
+        if (block == NUM_FRAMES) {
+            return;
+        }
+        for (uint32_t i = 0; i < HUGE_PAGES; i++) {
+            frame_move(ptes[i]->pfn, block + i);
+        }
+        stats.huge_copies += HUGE_PAGES;
+    }
+
+    for (uint32_t i = 0; i < HUGE_PAGES; i++) {
+        ptes[i]->huge = 1;
+        ptes[i]->dirty = dirty;
+        if (check_corruption) {
+            check_touch_page(proc, base + i);
+        }
+    }
+    stats.huge_promotions++;
+    if (++stats.huge_mappings > stats.huge_mappings_max) {
+        stats.huge_mappings_max = stats.huge_mappings;
+    }
+}
+
+void huge_scan(pcb_t *proc) {
+    /* Every resident page is on the resident set, so each region that is
+       fully resident shows up through its first page. The translations the
+       promotions replace are shot down together. */
+    tlb_batch_begin();
+    for (uint32_t i = 0; i < proc->page_count; i++) {
+        vpn_t vpn = proc->pages[i];
+        if (vpn & HUGE_MASK) {
+            continue;
+        }
+        pte_t *pte = pt_walk(proc->saved_ptbr, vpn, 0);
+        if (huge_eligible(pte) && !pte->huge) {
+            huge_promote(proc, vpn);
+        }
+    }
+    tlb_batch_end();
+}
+
+void huge_split(pcb_t *proc, vpn_t vpn) {
+    vpn_t base = vpn & ~HUGE_MASK;
+    for (uint32_t i = 0; i < HUGE_PAGES; i++) {
+        pt_walk(proc->saved_ptbr, base + i, 0)->huge = 0;
+        if (check_corruption) {
+            check_touch_page(proc, base + i);
+        }
+    }
+    tlb_invalidate((uint16_t) proc->pid, base);
+    stats.huge_splits++;
+    stats.huge_mappings--;
+}
+
+void huge_mark_dirty(pcb_t *proc, vpn_t vpn) {
+    vpn_t base = vpn & ~HUGE_MASK;
+    for (uint32_t i = 0; i < HUGE_PAGES; i++) {
+        pt_walk(proc->saved_ptbr, base + i, 0)->dirty = 1;
+    }
+}
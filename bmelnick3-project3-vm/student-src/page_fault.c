@@ -2,6 +2,8 @@
 #include "pagesim.h"
 #include "swapops.h"
 #include "stats.h"
+#include "replacement.h"
+#include "tlb.h"
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -26,32 +28,104 @@
     data will have been swapped to the disk when the page was
     evicted. Call swap_read() to pull the data back in.
 
+    With -z (see zero_pages), a read of a page that would just be zeroed
+    maps the shared zero frame instead, and the first write to such a page
+    faults again to copy it into a frame of its own. rw is the access that
+    faulted, 'r' or 'w'.
+
+    A page of an SHM segment the process has attached is left to
+    shm_fault() (see shm.c).
+
+    A write to a page shared copy-on-write since a FORK (see fork.c) copies
+    it into a frame of its own, unless no other page shares the frame any
+    more, in which case the frame just becomes writable again.
+
     HINTS:
          - You will need to use the global variable current_process when
            setting the frame table entry.
 
     ----------------------------------------------------------------------------------
  */
-void page_fault(vaddr_t address) {
+void page_fault(vaddr_t address, char rw) {
     /* First, split the faulting address and locate the page table entry.
        Remember to keep a pointer to the entry so you can modify it later. */
    vpn_t vpn = vaddr_vpn(address);
    //fte_t *pt_fte = frame_table + PTBR; // address for start of page table
-   pte_t *vpn_pte = (pte_t*)(mem + PTBR * PAGE_SIZE) + vpn; // address for specific entry
+   pte_t *vpn_pte = pt_walk(PTBR, vpn, 1); // address for specific entry
+
+   if (!vpn_pte->valid && shm_fault(vpn, vpn_pte)) {
+     return;
+   }
+
+    /* A write to a zero page: drop the read-only mapping and fall through
+       to give the page a frame of its own, which is zeroed below */
+   if (vpn_pte->valid && vpn_pte->zero) {
+     vpn_pte->valid = 0;
+     vpn_pte->zero = 0;
+     tlb_invalidate((uint16_t) current_process->pid, vpn);
+     stats.zero_copies++;
+   } else if (zero_pages && rw == 'r' && (!swap_exists(vpn_pte) || swap_is_zero(vpn_pte))) {
+     /* A read of a page of zeroes needs no frame until it is written */
+     vpn_pte->pfn = zero_frame;
+     vpn_pte->valid = 1;
+     vpn_pte->zero = 1;
+     vpn_pte->dirty = 0;
+     if (!vpn_pte->listed) {
+       proc_track_page(current_process, vpn, vpn_pte);
+     }
+     if (check_corruption) {
+       check_touch_page(current_process, vpn);
+     }
+     stats.zero_maps++;
+     return;
+   } else if (vpn_pte->valid && vpn_pte->cow && frame_table[vpn_pte->pfn].refcount == 1) {
+     /* The last page left sharing its frame can keep it, so the policy
+        sees no more than an access */
+     vpn_pte->cow = 0;
+     tlb_invalidate((uint16_t) current_process->pid, vpn);
+     policy_on_access(vpn_pte->pfn, rw);
+     if (check_corruption) {
+       check_touch_page(current_process, vpn);
+     }
+     stats.cow_reuses++;
+     return;
+   }
     
     /* It's a page fault, so the entry obviously won't be valid. Grab
-       a frame to use by calling free_frame(). */
-   pfn_t new_frame = free_frame();
+       a frame to use by calling free_frame(), or with -H, huge_frame(),
+       which keeps the page's region together. */
+   pfn_t new_frame = huge_order ? huge_frame(vpn) : free_frame();
+
+    /* A write to a shared page: copy it out of the frame it shares. If
+       free_frame() evicted that frame instead, the page is now in swap and
+       is read back in below like any other. */
+   int copied = 0;
+   if (vpn_pte->valid && vpn_pte->cow) {
+     memcpy(mem + (new_frame * PAGE_SIZE), mem + (vpn_pte->pfn * PAGE_SIZE), PAGE_SIZE);
+     rmap_remove(vpn_pte->pfn, current_process, vpn);
+     vpn_pte->cow = 0;
+     tlb_invalidate((uint16_t) current_process->pid, vpn);
+     stats.cow_faults++;
+     copied = 1;
+   }
 
     /* Update the page table entry. Make sure you set any relevant values. */
    vpn_pte->pfn = new_frame;
    vpn_pte->valid = 1;
+   if (!vpn_pte->listed) {
+     proc_track_page(current_process, vpn, vpn_pte);
+   }
 
     /* Update the frame table. Make sure you set any relevant values. */
    fte_t *pfn_fte = frame_table + new_frame;
    pfn_fte->process = current_process;
    pfn_fte->vpn = vpn;
    pfn_fte->mapped = 1;
+   pfn_fte->prefetched = 0;
+   pfn_fte->refcount = 1;
+   pfn_fte->heat = 0;
+   mapped_frames++;
+   policy_on_fault(new_frame);
 
     /* Initialize the page's memory. On a page fault, it is not enough
      * just to allocate a new frame. We must load in the old data from
@@ -64,13 +138,20 @@ void page_fault(vaddr_t address) {
      * 3) Else, just zero the page's memory. If the page is later written
      *    back, swap_write() will automatically allocate a swap entry.
      */
-   if(swap_exists(vpn_pte)) {
+   if (copied) {
+     /* Already filled in above */
+   } else if(swap_exists(vpn_pte)) {
      swap_read(vpn_pte, mem + (new_frame * PAGE_SIZE));
    } else {
      // zero out the memory
      memset(mem + (new_frame * PAGE_SIZE), 0, PAGE_SIZE);
      vpn_pte->dirty = 0;
    }
+
+    /* Map whatever a sequential or strided scan is about to need next */
+   if (readahead_max && !copied) {
+     readahead(vpn);
+   }
 }
 
 #pragma GCC diagnostic pop
@@ -4,9 +4,184 @@
 #include "swapops.h"
 #include "stats.h"
 #include "util.h"
+#include "tlb.h"
+#include "replacement.h"
 
 pfn_t select_victim_frame(void);
 
+SIM_LOCAL const replacement_policy_t *policy;
+
+SIM_LOCAL uint64_t *reclaim_last_use;
+
+SIM_LOCAL uint32_t *page_generation;
+
+/* Indexed by the replacement constants in pagesim.h */
+static const replacement_policy_t *const policies[] = {
+    [RANDOM] = &random_policy,
+    [CLOCKSWEEP] = &clocksweep_policy,
+    [AGING] = &aging_policy,
+    [WSCLOCK] = &wsclock_policy,
+    [TWOQ] = &twoq_policy,
+    [ARC] = &arc_policy,
+    [CLOCKPRO] = &clockpro_policy,
+    [OPT] = &opt_policy,
+};
+
+uint8_t replacement_lookup(const char *name) {
+    for (uint8_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (policies[i] && strcmp(policies[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+const char *replacement_name(uint8_t id) {
+    return policies[id]->name;
+}
+
+void replacement_init(void) {
+    policy = policies[replacement];
+    page_generation = policy_alloc(MAX_PID, sizeof(uint32_t));
+    if (policy->init) {
+        policy->init();
+    }
+    if (reclaim_high) {
+        reclaim_last_use = policy_alloc(NUM_FRAMES, sizeof(uint64_t));
+    }
+}
+
+/* Everything allocated with policy_alloc() */
+static SIM_LOCAL void **policy_allocs;
+static SIM_LOCAL uint32_t policy_alloc_count;
+static SIM_LOCAL uint32_t policy_alloc_capacity;
+
+void *policy_alloc(size_t count, size_t size) {
+    if (policy_alloc_count == policy_alloc_capacity) {
+        policy_alloc_capacity = policy_alloc_capacity ? policy_alloc_capacity * 2 : 16;
+        policy_allocs = realloc(policy_allocs, policy_alloc_capacity * sizeof(void *));
+        if (!policy_allocs) {
+            panic("could not allocate replacement policy state");
+        }
+    }
+    void *ptr = calloc(count, size);
+    if (!ptr) {
+        panic("could not allocate replacement policy state");
+    }
+    policy_allocs[policy_alloc_count++] = ptr;
+    return ptr;
+}
+
+void replacement_teardown(void) {
+    for (uint32_t i = 0; i < policy_alloc_count; i++) {
+        free(policy_allocs[i]);
+    }
+    free(policy_allocs);
+    policy_allocs = NULL;
+    policy_alloc_count = policy_alloc_capacity = 0;
+    reclaim_last_use = NULL;
+    page_generation = NULL;
+}
+
+
+/*
+    Writes the page in pfn back to the swap entry of pte. background says
+    whether the eviction is reclaim()'s, whose writebacks are counted apart
+    from those on the fault path.
+ */
+static void write_back(pte_t *pte, pfn_t pfn, int background) {
+    if (zero_pages && page_is_zero(mem + (pfn * PAGE_SIZE))) {
+        /* No need to write out a page of zeroes */
+        swap_write_zero(pte);
+        stats.zero_writebacks = stats.zero_writebacks + 1;
+    } else if (swap_write(pte, mem + (pfn * PAGE_SIZE), background)) {
+        if (background) {
+            stats.bg_writebacks = stats.bg_writebacks + 1;
+        } else {
+            stats.writebacks = stats.writebacks + 1;
+        }
+    }
+}
+
+/*
+    Unmaps vpn of victim_pcb from victim_pfn, writing it to disk first if it
+    is dirty. A page of an SHM segment is instead only marked dirty in its
+    backing entry, which is written once every mapping is gone.
+ */
+static void evict_page(pcb_t *victim_pcb, vpn_t victim_vpn, pfn_t victim_pfn, pte_t *backing, int background) {
+    //fte_t *victim_pt = frame_table + victim_pcb->saved_ptbr;
+    pte_t *victim_pte = pt_walk(victim_pcb->saved_ptbr, victim_vpn, 0);
+
+    if (backing) {
+        backing->dirty |= victim_pte->dirty;
+    } else if (victim_pte->dirty == 1) {
+        write_back(victim_pte, victim_pfn, background);
+    }
+
+    victim_pte->valid = 0;
+    victim_pte->dirty = 0;
+    victim_pte->cow = 0;
+    victim_pte->shm = 0;
+    tlb_invalidate((uint16_t) victim_pcb->pid, victim_vpn);
+}
+
+/*
+    Evicts the page mapped in victim_pfn:
+
+    1) Look up the corresponding page table entry
+    2) If the entry is dirty, write it to disk with swap_write()
+    3) Mark the original page table entry as invalid
+    4) Unmap the corresponding frame table entry
+
+    A frame shared since a FORK is unmapped from every page sharing it, each
+    of which is written back on its own if dirty, as swap entries are never
+    shared. A frame holding a page of an SHM segment is unmapped from every
+    process attached to it too, but written back only once, to the segment.
+    A page that is part of a huge page splits it first.
+    The caller frees or reuses the frame.
+ */
+void evict_frame(pfn_t victim_pfn, int background) {
+    pcb_t *victim_pcb = frame_table[victim_pfn].process;
+    vpn_t victim_vpn = frame_table[victim_pfn].vpn;
+    pte_t *victim_pte = pt_walk(victim_pcb->saved_ptbr, victim_vpn, 0);
+    pte_t *backing = NULL;
+
+    if (victim_pte->huge) {
+        huge_split(victim_pcb, victim_vpn);
+    }
+    if (victim_pte->shm) {
+        backing = shm_backing(victim_pcb, victim_vpn);
+    }
+
+    policy_on_evict(victim_pfn, 0);
+
+    while (rmap_pop(victim_pfn, &victim_pcb, &victim_vpn)) {
+        evict_page(victim_pcb, victim_vpn, victim_pfn, backing, background);
+    }
+    victim_pcb = frame_table[victim_pfn].process;
+    evict_page(victim_pcb, frame_table[victim_pfn].vpn, victim_pfn, backing, background);
+
+    if (backing) {
+        if (backing->dirty) {
+            write_back(backing, victim_pfn, background);
+        }
+        backing->valid = 0;
+        backing->dirty = 0;
+    }
+
+    if (frame_table[victim_pfn].prefetched) {
+        /* Read ahead for nothing: read less far ahead */
+        frame_table[victim_pfn].prefetched = 0;
+        stats.prefetch_wasted = stats.prefetch_wasted + 1;
+        if (victim_pcb->ra_window > 1) {
+            victim_pcb->ra_window /= 2;
+        }
+    }
+
+    frame_table[victim_pfn].mapped = 0;
+    frame_table[victim_pfn].refcount = 0;
+    mapped_frames--;
+}
 
 /*  --------------------------------- PROBLEM 7 --------------------------------------
     Checkout PDF section 7 for this problem
@@ -30,43 +205,102 @@ pfn_t free_frame(void) {
        mapping. */
     victim_pfn = select_victim_frame();
 
-    /*
-     * If victim frame is currently mapped, we must evict it:
-     *
-     * 1) Look up the corresponding page table entry
-     * 2) If the entry is dirty, write it to disk with swap_write()
-     * 3) Mark the original page table entry as invalid
-     * 4) Unmap the corresponding frame table entry
-     *
-     */
+    /* If victim frame is currently mapped, we must evict it */
     if (frame_table[victim_pfn].mapped == 1) {
-        vpn_t victim_vpn = frame_table[victim_pfn].vpn;
-        pcb_t *victim_pcb = frame_table[victim_pfn].process;
-        //fte_t *victim_pt = frame_table + victim_pcb->saved_ptbr;
-        pte_t *victim_pte = (pte_t*)(mem + victim_pcb->saved_ptbr * PAGE_SIZE) + victim_vpn;
-
-        if (victim_pte->dirty == 1) {
-            swap_write(victim_pte, mem + (victim_pfn * PAGE_SIZE));
-            stats.writebacks = stats.writebacks + 1;
-        }
-
-        victim_pte->valid = 0;
-        victim_pte->dirty = 0;
-        frame_table[victim_pfn].mapped = 0;
+        evict_frame(victim_pfn, 0);
+        stats.direct_evictions = stats.direct_evictions + 1;
     }
 
+    /* The frame is about to be mapped or protected by our caller */
+    frame_mark_used(victim_pfn);
 
     /* Return the pfn */
     return victim_pfn;
 }
 
+/* Where the last cleaning pass stopped */
+static SIM_LOCAL pfn_t reclaim_clean_hand;
+
+/*
+    Writes back the page in pfn for every page mapping it that is dirty,
+    and marks them clean, leaving the frame mapped. Pages of an SHM segment
+    are written once, to the segment. Returns whether anything was dirty.
+ */
+static int clean_frame(pfn_t pfn) {
+    pcb_t *proc = frame_table[pfn].process;
+    vpn_t vpn = frame_table[pfn].vpn;
+    pte_t *backing = NULL;
+    uint32_t cursor = 0;
+    int cleaned = 0;
+
+    do {
+        pte_t *pte = pt_walk(proc->saved_ptbr, vpn, 0);
+        if (!pte->dirty) {
+            continue;
+        }
+        if (pte->shm) {
+            backing = shm_backing(proc, vpn);
+            backing->dirty = 1;
+        } else {
+            write_back(pte, pfn, 1);
+        }
+        /* The TLB may hold the dirty bit too, and the next write through it
+           has to set the page's again */
+        pte->dirty = 0;
+        tlb_invalidate((uint16_t) proc->pid, vpn);
+        if (check_corruption) {
+            check_touch_page(proc, vpn);
+        }
+        cleaned = 1;
+    } while (rmap_next(pfn, &cursor, &proc, &vpn));
+
+    if (backing) {
+        write_back(backing, pfn, 1);
+        backing->dirty = 0;
+    }
+    return cleaned;
+}
 
+/*
+    Background reclaim, see paging.h. Frame-scanning policies may also offer
+    frames that are already free, which are skipped; the number of tries is
+    bounded so such a policy cannot keep the pass going forever.
+ */
+void reclaim(void) {
+    stats.reclaim_passes = stats.reclaim_passes + 1;
+    for (uint32_t tries = 0; free_frames < reclaim_high && mapped_frames && tries < 2 * NUM_FRAMES; tries++) {
+        pfn_t victim_pfn = policy->select_victim();
+        if (frame_table[victim_pfn].mapped == 1) {
+            evict_frame(victim_pfn, 1);
+            frame_mark_free(victim_pfn);
+            stats.reclaim_evictions = stats.reclaim_evictions + 1;
+        }
+    }
+
+    /* Clean idle dirty pages, so the evictions to come need no writeback.
+       The pages of huge pages share their dirty bit, so they are left be. */
+    uint32_t cleaned = 0;
+    for (uint32_t n = 0; n < NUM_FRAMES && cleaned < RECLAIM_CLEAN_MAX; n++) {
+        pfn_t pfn = reclaim_clean_hand;
+        reclaim_clean_hand = reclaim_clean_hand + 1 < NUM_FRAMES ? reclaim_clean_hand + 1 : 0;
+        fte_t *fte = frame_table + pfn;
+        if (!fte->mapped || fte->protected
+            || stats.accesses - reclaim_last_use[pfn] < RECLAIM_CLEAN_AGE
+            || pt_walk(fte->process->saved_ptbr, fte->vpn, 0)->huge) {
+            continue;
+        }
+        if (clean_frame(pfn)) {
+            stats.reclaim_cleans = stats.reclaim_cleans + 1;
+            cleaned++;
+        }
+    }
+}
 
 /*  --------------------------------- PROBLEM 9 --------------------------------------
     Checkout PDF section 7, 9, and 11 for this problem
 
-    Finds a free physical frame. If none are available, uses either a
-    randomized or clocksweep algorithm to find a used frame for
+    Finds a free physical frame. If none are available, asks the selected
+    replacement policy (see replacement.h) to find a used frame for
     eviction.
 
     Return:
@@ -77,56 +311,71 @@ pfn_t free_frame(void) {
     ----------------------------------------------------------------------------------
 */
 pfn_t select_victim_frame() {
-    /* Pointer to the frame chosen on the last iteration of clocksweep */
-    static pfn_t clocksweep_pointer = 0;
-
     /* See if there are any free frames first */
-    size_t num_entries = MEM_SIZE / PAGE_SIZE;
-    for (size_t i = 0; i < num_entries; i++) {
-        if (!frame_table[i].protected && !frame_table[i].mapped) {
-            return i;
-        }
+    pfn_t free_pfn = frame_find_free();
+    if (free_pfn < NUM_FRAMES) {
+        return free_pfn;
     }
 
-    if (replacement == RANDOM) {
-        /* Play Russian Roulette to decide which frame to evict */
-        pfn_t last_unprotected = NUM_FRAMES;
-        for (pfn_t i = 0; i < num_entries; i++) {
-            if (!frame_table[i].protected) {
-                last_unprotected = i;
-                if (prng_rand() % 2) {
-                    return i;
-                }
+    /* Otherwise let the replacement policy pick a mapped frame */
+    return policy->select_victim();
+}
+
+static pfn_t random_select_victim(void) {
+    /* Play Russian Roulette to decide which frame to evict */
+    pfn_t last_unprotected = NUM_FRAMES;
+    for (pfn_t i = 0; i < NUM_FRAMES; i++) {
+        if (!frame_table[i].protected) {
+            last_unprotected = i;
+            if (prng_rand() % 2) {
+                return i;
             }
         }
-        /* If no victim found yet take the last unprotected frame
-           seen */
-        if (last_unprotected < NUM_FRAMES) {
-            return last_unprotected;
-        }
-    } else if (replacement == CLOCKSWEEP) {
-        /* Implement a clocksweep page replacement algorithm here */
-        for (pfn_t i = clocksweep_pointer; i < NUM_FRAMES; i++) {
-            if (!frame_table[i].protected) {
-                // don't select referenced frames
-                if (frame_table[i].referenced) {
-                    // if referenced bit is set, clear it, but don't choose as victim
-                    frame_table[i].referenced = 0;
+    }
+    /* If no victim found yet take the last unprotected frame
+       seen */
+    if (last_unprotected < NUM_FRAMES) {
+        return last_unprotected;
+    }
+
+    /* If every frame is protected, give up. This should never happen
+       on the traces we provide you. */
+    panic("System ran out of memory\n");
+    exit(1);
+}
+
+const replacement_policy_t random_policy = {
+    .name = "random",
+    .select_victim = random_select_victim,
+};
+
+/* Pointer to the frame chosen on the last iteration of clocksweep */
+static SIM_LOCAL pfn_t clocksweep_pointer = 0;
+
+static pfn_t clocksweep_select_victim(void) {
+    /* Implement a clocksweep page replacement algorithm here. Two full
+       revolutions are enough to find a victim if any frame is unprotected. */
+    uint32_t examined = 0;
+    for (pfn_t i = clocksweep_pointer; i < NUM_FRAMES && examined++ <= 2 * NUM_FRAMES; i++) {
+        if (!frame_table[i].protected) {
+            // don't select referenced frames
+            if (frame_table[i].referenced) {
+                // if referenced bit is set, clear it, but don't choose as victim
+                frame_table[i].referenced = 0;
+            } else {
+                // update the clocksweep pointer to point to next frame after victim
+                if (i == NUM_FRAMES - 1) {
+                    // if the victim frame is the last available frame, need to start the pointer at the beginning
+                    clocksweep_pointer = 0;
                 } else {
-                    // update the clocksweep pointer to point to next frame after victim
-                    if (i == NUM_FRAMES - 1) {
-                        // if the victim frame is the last available frame, need to start the pointer at the beginning
-                        clocksweep_pointer = 0;
-                    } else {
-                        clocksweep_pointer = i + 1;
-                    }
-                    return i;
+                    clocksweep_pointer = i + 1;
                 }
-            } 
-            if (i == NUM_FRAMES - 1) {
-                // if we are currently indexing the last frame, loop back around
-                i = 0;
+                return i;
             }
+        } 
+        if (i == NUM_FRAMES - 1) {
+            // if we are currently indexing the last frame, loop back around
+            i = 0;
         }
     }
 
@@ -135,3 +384,8 @@ pfn_t select_victim_frame() {
     panic("System ran out of memory\n");
     exit(1);
 }
+
+const replacement_policy_t clocksweep_policy = {
+    .name = "clocksweep",
+    .select_victim = clocksweep_select_victim,
+};
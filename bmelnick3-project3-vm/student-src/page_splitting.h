@@ -22,14 +22,17 @@
     -----------------------------------------------------------------------------------
  */
 
+/* PAGE_SIZE is only known at runtime, so a division here would be a real
+   divide instruction; pages are powers of two, so shift and mask instead. */
+
 /* Get the virtual page number from a virtual address. */
 static inline vpn_t vaddr_vpn(vaddr_t addr) {
-    return (addr / PAGE_SIZE);                   
+    return (addr >> OFFSET_LEN);
 }
 
 /* Get the offset into the page from a virtual address. */
-static inline uint16_t vaddr_offset(vaddr_t addr) {
-    return (addr % PAGE_SIZE);                   
+static inline uint32_t vaddr_offset(vaddr_t addr) {
+    return (addr & (uint32_t) (PAGE_SIZE - 1));
 }
 
 #pragma GCC diagnostic pop
@@ -3,13 +3,25 @@
 #include "page_splitting.h"
 #include "swapops.h"
 #include "stats.h"
+#include "tlb.h"
+#include "replacement.h"
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
  /* The frame table pointer. You will set this up in system_init. */
  /* fte_t is a struct in paging.h - contains all info needed for a frame table entry */
-fte_t *frame_table;
+SIM_LOCAL fte_t *frame_table;
+
+/* Free frame bitmap, see paging.h. Set up in system_init. */
+SIM_LOCAL uint64_t *free_frame_map;
+
+/* The shared zero frame, see paging.h. Set up in system_init. */
+SIM_LOCAL pfn_t zero_frame;
+
+/* Frame counts, see paging.h */
+SIM_LOCAL uint32_t free_frames;
+SIM_LOCAL uint32_t mapped_frames;
 
 /*  --------------------------------- PROBLEM 2 --------------------------------------
     Checkout PDF section 4 for this problem
@@ -25,7 +37,9 @@ fte_t *frame_table;
 
     You should then mark the first entry in the frame table as protected. We do
     this because we do not want our free frame allocator to give out the frame
-    used by the frame table.
+    used by the frame table. On machines with many frames the frame table
+    spills over into the following frames (see FRAME_TABLE_FRAMES), which must
+    be protected as well.
 
     HINTS:
         You will need to use the following global variables:
@@ -60,8 +74,28 @@ void system_init(void) {
      * however, there are some frames we never want to evict.
      * We mark these special pages as "protected" to indicate this.
      */
-    frame_table->protected = 1;
+    for (pfn_t i = 0; i < FRAME_TABLE_FRAMES; i++) {
+        frame_table[i].protected = 1;
+    }
+
+    /* With -z, the next frame holds the zeroes every zero page maps. It was
+       zeroed above and is never written, so it stays that way. */
+    zero_frame = 0;
+    if (zero_pages) {
+        zero_frame = FRAME_TABLE_FRAMES;
+        frame_table[zero_frame].protected = 1;
+    }
 
+    /* Every other frame starts out free */
+    if (!(free_frame_map = calloc(FREE_MAP_WORDS, sizeof(uint64_t)))) {
+        panic("could not allocate free frame bitmap");
+    }
+    for (pfn_t i = FRAME_TABLE_FRAMES + zero_pages; i < NUM_FRAMES; i++) {
+        frame_mark_free(i);
+    }
+
+    /* Set up the page replacement policy selected with -r */
+    replacement_init();
 }
 
 /*  --------------------------------- PROBLEM 3 --------------------------------------
@@ -104,6 +138,8 @@ void proc_init(pcb_t *proc) {
      */
     proc->saved_ptbr = pt_frame;
     frame_table[pt_frame].protected = 1;
+    frame_mark_used(pt_frame);
+    readahead_reset(proc);
 }
 
 /*  --------------------------------- PROBLEM 4 --------------------------------------
@@ -120,6 +156,7 @@ void proc_init(pcb_t *proc) {
     -----------------------------------------------------------------------------------
  */
 void context_switch(pcb_t *proc) {
+    /* The TLB is tagged with the PID, so it doesn't need flushing here */
     current_process = proc;
     PTBR = proc->saved_ptbr;
 }
@@ -160,17 +197,46 @@ uint8_t mem_access(vaddr_t address, char rw, uint8_t data) {
        Remember to keep a pointer to the entry so you can modify it later.*/
     /* If an entry is invalid, just page fault to allocate a page for the page table. */
     vpn_t vpn = vaddr_vpn(address);
-    uint16_t offset = vaddr_offset(address);
+    uint32_t offset = vaddr_offset(address);
     /* The PTBR gives you the PFN (physical frame number) for the frame containing the page table for the 
         current process. All of the page table entries for a process are inside of one page (in this frame) and this 
         makes up the page table that we talk about (the page table is made up of multiple page table entries).
         So this is accessing the frame which starts with the 0th page table entry (VPN=0).
         We need to do pointer arithmetic to mem w/ PTBR to get the actual frame that holds the page table. */
     /* PTBR IS NOT AN INDEX IN THE FRAME TABLE */
-    pte_t *vpn_pte = (pte_t*)(mem + PTBR * PAGE_SIZE) + vpn;  
-    if (vpn_pte->valid == 0) {
-        page_fault(address);
-        stats.page_faults  = stats.page_faults + 1;
+    /* Try the TLB first. A write through a clean translation still has to
+       walk the page table to set the dirty bit. */
+    pfn_t pfn;
+    pte_t *vpn_pte = NULL;
+    int faulted = 0;
+    tlb_entry_t *tlb_entry = tlb_lookup((uint16_t) current_process->pid, vpn);
+    if (tlb_entry && (rw == 'r' || tlb_entry->dirty)) {
+        pfn = tlb_entry_pfn(tlb_entry, vpn);
+    } else {
+        if (tlb_entry) {
+            /* A hit, but the walk to set the dirty bit still costs */
+            stats.tlb_dirty_walks++;
+        }
+        vpn_pte = pt_walk(PTBR, vpn, 0);
+        if (!vpn_pte || vpn_pte->valid == 0 || (rw != 'r' && (vpn_pte->zero || vpn_pte->cow))) {
+            page_fault(address, rw);
+            stats.page_faults  = stats.page_faults + 1;
+            vpn_pte = pt_walk(PTBR, vpn, 0);
+            faulted = 1;
+        }
+        pfn = vpn_pte->pfn;
+        if (rw != 'r') {
+            if (vpn_pte->huge && !vpn_pte->dirty) {
+                huge_mark_dirty(current_process, vpn);
+            }
+            vpn_pte->dirty = 1;
+        }
+        /* Writes to a copy-on-write page must still fault */
+        if (vpn_pte->huge) {
+            tlb_insert_huge((uint16_t) current_process->pid, vpn, pfn, vpn_pte->dirty);
+        } else {
+            tlb_insert((uint16_t) current_process->pid, vpn, pfn, vpn_pte->dirty && !vpn_pte->cow);
+        }
     }
     /* Update the referenced bit of the appropriate frame table entry. */
     
@@ -188,18 +254,41 @@ uint8_t mem_access(vaddr_t address, char rw, uint8_t data) {
         Also, find the frame table entry corresponding to the VPN,
         and make sure set any relevant values.
     */
-    pfn_t pfn = vpn_pte->pfn;
     frame_table[pfn].referenced = 1; // frame table maps PFNs (as indices) to the VPN + PID for that frame
+    if (reclaim_last_use) {
+        reclaim_last_use[pfn] = stats.accesses;
+    }
+    if (fast_frames) {
+        /* Count the access towards the page's heat and its tier */
+        if (frame_table[pfn].heat < UINT16_MAX) {
+            frame_table[pfn].heat++;
+        }
+        if (pfn < fast_frames) {
+            stats.fast_accesses++;
+        } else {
+            stats.slow_accesses++;
+        }
+    }
+    if (frame_table[pfn].prefetched) {
+        /* The first access to a page that was read ahead */
+        frame_table[pfn].prefetched = 0;
+        frame_table[pfn].process->ra_hits++;
+        stats.prefetch_hits++;
+    }
+    if (!faulted && pfn != zero_frame) {
+        /* page_fault() already told the policy about this page, and the
+           zero frame is no policy's business */
+        policy_on_access(pfn, rw);
+    }
     /* Either read or write the data to the physical address
        depending on 'rw' */
-    paddr_t addr = (paddr_t) ((size_t)((vpn_pte->pfn)<<OFFSET_LEN) + (size_t)offset);  
+    paddr_t addr = (paddr_t) (((size_t)pfn<<OFFSET_LEN) + (size_t)offset);  
     stats.accesses = stats.accesses + 1;
     if (rw == 'r') {
         stats.reads = stats.reads + 1;
         return mem[addr];
     } else {
         mem[addr] = data;
-        vpn_pte->dirty = 1;
         stats.writes = stats.writes + 1;
     }
 
@@ -207,6 +296,37 @@ uint8_t mem_access(vaddr_t address, char rw, uint8_t data) {
     return data;
 }
 
+/*
+    Finds the page table entry for vpn in the page table rooted at frame root.
+
+    With a single-level page table this is just an index into the root
+    frame. Otherwise the inner tables are walked from the top down; a missing
+    inner table either makes the walk return NULL, or, if alloc is set, is
+    allocated with free_frame(), zeroed and protected.
+ */
+pte_t *pt_walk(pfn_t root, vpn_t vpn, int alloc) {
+    pte_t *table = (pte_t*)(mem + root * PAGE_SIZE);
+    for (uint32_t level = 0; level + 1 < pt_levels; level++) {
+        pte_t *dir = table + pt_index(vpn, level);
+        if (!dir->valid) {
+            if (!alloc) {
+                return NULL;
+            }
+            pfn_t pt_frame = free_frame();
+            memset(mem + (pt_frame * PAGE_SIZE), 0, PAGE_SIZE);
+            frame_table[pt_frame].protected = 1;
+            dir->pfn = pt_frame;
+            dir->valid = 1;
+            stats.pt_frames++;
+            if (stats.pt_frames > stats.pt_frames_max) {
+                stats.pt_frames_max = stats.pt_frames;
+            }
+        }
+        table = (pte_t*)(mem + dir->pfn * PAGE_SIZE);
+    }
+    return table + pt_index(vpn, pt_levels - 1);
+}
+
 /*  --------------------------------- PROBLEM 8 --------------------------------------
     Checkout PDF section 8 for this problem
     
@@ -221,26 +341,112 @@ uint8_t mem_access(vaddr_t address, char rw, uint8_t data) {
     You must also clear the "protected" bits for the page table itself.
     -----------------------------------------------------------------------------------
 */
+/* Releases the inner tables below table. The pages themselves are released
+   through the resident set, so the last level is never scanned. */
+static void pt_release(pfn_t table, uint32_t level) {
+    pte_t *dir = (pte_t*)(mem + table * PAGE_SIZE);
+    if (level + 1 >= pt_levels) {
+        return;
+    }
+    for (size_t i = 0; i < pt_entries(level); i++) {
+        if (dir[i].valid) {
+            pt_release(dir[i].pfn, level + 1);
+            dir[i].valid = 0;
+            frame_table[dir[i].pfn].protected = 0;
+            frame_mark_free(dir[i].pfn);
+            stats.pt_frames--;
+        }
+    }
+}
+
 void proc_cleanup(pcb_t *proc) {
-    /* Look up the process's page table */
-    pte_t *proc_pt = (pte_t*)(mem + proc->saved_ptbr * PAGE_SIZE);
-    /* Iterate the page table and clean up each valid page */
-    for (size_t i = 0; i < NUM_PAGES; i++) {
-        // i represents page number
-        if (proc_pt[i].valid) {
-            proc_pt[i].valid = 0;
+    /* Detach from every SHM segment first, which unmaps their pages */
+    while (proc->shm_count) {
+        shm_detach(proc, proc->shm[proc->shm_count - 1].id);
+    }
+
+    /* Clean up each page on the process's resident set */
+    for (uint32_t i = 0; i < proc->page_count; i++) {
+        pte_t *pte = pt_walk(proc->saved_ptbr, proc->pages[i], 0);
+        if (pte->zero) {
+            pte->valid = 0;
+            pte->zero = 0;
+        } else if (pte->valid && frame_table[pte->pfn].refcount > 1) {
+            /* The pages still sharing the frame keep it */
+            rmap_remove(pte->pfn, proc, proc->pages[i]);
+            pte->valid = 0;
+            pte->cow = 0;
+        } else if (pte->valid) {
+            if (pte->huge) {
+                /* Torn down with the rest, not split */
+                pte->huge = 0;
+                stats.huge_mappings -= !(proc->pages[i] & (((vpn_t) 1 << huge_order) - 1));
+            }
+            policy_on_evict(pte->pfn, 1);
+            pte->valid = 0;
             // find the corresponding fte for the current page
-            frame_table[proc_pt[i].pfn].mapped = 0;
-            frame_table[proc_pt[i].pfn].referenced = 0;
-            frame_table[proc_pt[i].pfn].process = 0;
+            frame_table[pte->pfn].mapped = 0;
+            mapped_frames--;
+            pte->cow = 0;
+            frame_table[pte->pfn].refcount = 0;
+            frame_table[pte->pfn].referenced = 0;
+            frame_table[pte->pfn].process = 0;
+            if (frame_table[pte->pfn].prefetched) {
+                frame_table[pte->pfn].prefetched = 0;
+                stats.prefetch_wasted++;
+            }
+            frame_mark_free(pte->pfn);
         }
-        if (proc_pt[i].swap != 0) {
-            swap_free(proc_pt + i);
+        if (pte->swap != 0) {
+            swap_free(pte);
         }
+        pte->listed = 0;
     }
+    proc->page_count = 0;
+
+    /* Release the inner levels of the page table */
+    pt_release(proc->saved_ptbr, 0);
+
+    /* Drop any translations the process still has cached, and move its pid
+       on to a new generation so the pages the replacement policy remembers
+       of it match nothing any more */
+    tlb_invalidate_asid((uint16_t) proc->pid);
+    policy_on_exit(proc->pid);
 
     /* Free the page table itself in the frame table */
     frame_table[proc->saved_ptbr].protected = 0;
+    frame_mark_free(proc->saved_ptbr);
+}
+
+/*
+    Adds vpn, whose page table entry is pte, to proc's resident set (see
+    paging.h). When the list is full it is first compacted, dropping the
+    pages that are neither mapped nor swapped out; it only grows if that
+    leaves it more than half full.
+ */
+void proc_track_page(pcb_t *proc, vpn_t vpn, pte_t *pte) {
+    if (proc->page_count == proc->page_capacity) {
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < proc->page_count; i++) {
+            pte_t *old = pt_walk(proc->saved_ptbr, proc->pages[i], 0);
+            if (old->valid || old->swap) {
+                proc->pages[kept++] = proc->pages[i];
+            } else {
+                old->listed = 0;
+            }
+        }
+        proc->page_count = kept;
+
+        if (kept * 2 >= proc->page_capacity) {
+            proc->page_capacity = proc->page_capacity ? proc->page_capacity * 2 : 16;
+            proc->pages = realloc(proc->pages, proc->page_capacity * sizeof(vpn_t));
+            if (!proc->pages) {
+                panic("could not allocate resident set");
+            }
+        }
+    }
+    proc->pages[proc->page_count++] = vpn;
+    pte->listed = 1;
 }
 
 #pragma GCC diagnostic pop
@@ -0,0 +1,126 @@
+#include "paging.h"
+#include "pagesim.h"
+#include "swapops.h"
+#include "stats.h"
+#include "replacement.h"
+
+/*
+ * Readahead (fault-around).
+ *
+ * Every process watches its own page faults for a sequential or strided
+ * pattern: two faults in a row the same distance apart (at most
+ * READAHEAD_MAX_STRIDE pages), or a fault exactly where the last batch of
+ * readahead left off. On such a fault, readahead() maps the next ra_window
+ * pages along the stride that are not mapped, as long as there are free
+ * frames; it never evicts anything to make room. Prefetched pages are
+ * marked in the frame table, so the first access to one counts as useful
+ * and an eviction or exit before that as wasted.
+ *
+ * The window adapts to how well the last batch did: if every page of it was
+ * used by the time the scan comes back for more, the window doubles (up to
+ * readahead_max); if fewer than half were, or a prefetched page is evicted
+ * unused, it halves.
+ *
+ * Prefetched pages are not page faults: their I/O rides along with the
+ * fault that triggered them, so a page read from swap costs only
+ * DISK_PAGE_READAHEAD_TIME, and a zero-filled one nothing.
+ */
+
+#define READAHEAD_MAX_STRIDE 64
+
+void readahead_reset(pcb_t *proc) {
+    proc->ra_prev = 0;
+    proc->ra_expect = 0;
+    proc->ra_stride = 0;
+    proc->ra_window = readahead_max < 4 ? readahead_max : 4;
+    proc->ra_issued = 0;
+    proc->ra_hits = 0;
+}
+
+/* Whether the page behind pte is worth reading ahead */
+static int readahead_wanted(pte_t *pte) {
+    if (pte->valid) {
+        return 0;
+    }
+    if (!swap_exists(pte)) {
+        /* With -z an untouched page is better served by the zero frame */
+        return !zero_pages;
+    }
+    /* Compressed pages are cheap to fault in, and zero markers are free */
+    uint8_t kind = swap_kind(pte);
+    return kind == SWAP_PAGE || kind == SWAP_FILE;
+}
+
+static void prefetch(vpn_t vpn, pte_t *pte) {
+    pfn_t pfn = free_frame();
+    pte->pfn = pfn;
+    pte->valid = 1;
+    if (!pte->listed) {
+        proc_track_page(current_process, vpn, pte);
+    }
+
+    fte_t *fte = frame_table + pfn;
+    fte->process = current_process;
+    fte->vpn = vpn;
+    fte->mapped = 1;
+    fte->refcount = 1;
+    mapped_frames++;
+    fte->referenced = 0;
+    fte->prefetched = 1;
+    fte->heat = 0;
+    policy_on_fault(pfn);
+
+    if (swap_exists(pte)) {
+        swap_read(pte, mem + (pfn * PAGE_SIZE));
+        stats.prefetch_reads++;
+    } else {
+        memset(mem + (pfn * PAGE_SIZE), 0, PAGE_SIZE);
+        pte->dirty = 0;
+    }
+    stats.prefetches++;
+}
+
+void readahead(vpn_t vpn) {
+    pcb_t *proc = current_process;
+    int64_t delta = (int64_t) vpn - (int64_t) proc->ra_prev;
+
+    if (!(proc->ra_stride && vpn == proc->ra_expect) && !(delta && delta == proc->ra_stride)) {
+        /* No pattern yet; remember this stride for the next fault */
+        int within = delta >= -READAHEAD_MAX_STRIDE && delta <= READAHEAD_MAX_STRIDE;
+        proc->ra_stride = within ? (int32_t) delta : 0;
+        proc->ra_prev = vpn;
+        proc->ra_expect = vpn;
+        return;
+    }
+
+    /* Adapt the window to how much of the last batch was used */
+    if (proc->ra_issued) {
+        if (proc->ra_hits >= proc->ra_issued) {
+            proc->ra_window = proc->ra_window * 2 < readahead_max ? proc->ra_window * 2 : readahead_max;
+        } else if (proc->ra_hits * 2 < proc->ra_issued && proc->ra_window > 1) {
+            proc->ra_window /= 2;
+        }
+    }
+
+    /* next ends up at the first page along the stride not covered, which
+       is where the scan should fault next */
+    uint32_t issued = 0;
+    int64_t next = (int64_t) vpn + proc->ra_stride;
+    for (uint32_t i = 0; i < proc->ra_window; i++, next += proc->ra_stride) {
+        if (next < 0 || next >= NUM_PAGES || frame_find_free() == NUM_FRAMES) {
+            break;
+        }
+        /* Never allocate page tables just to read ahead */
+        pte_t *pte = pt_walk(PTBR, (vpn_t) next, 0);
+        /* Nor read ahead into SHM segments, which have their own swap */
+        if (pte && readahead_wanted(pte) && !shm_backing(proc, (vpn_t) next)) {
+            prefetch((vpn_t) next, pte);
+            issued++;
+        }
+    }
+
+    proc->ra_issued = issued;
+    proc->ra_hits = 0;
+    proc->ra_prev = (vpn_t) (next - proc->ra_stride);
+    proc->ra_expect = (vpn_t) next;
+}
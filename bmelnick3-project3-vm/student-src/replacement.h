@@ -0,0 +1,177 @@
+#pragma once
+
+#include "paging.h"
+#include "pagesim.h"
+#include "trace.h"
+
+/*
+ * Page replacement policies.
+ *
+ * Every replacement algorithm selectable with -r implements this interface.
+ * select_victim_frame() hands out free frames on its own and only asks the
+ * policy for a victim once every unprotected frame is mapped. The hooks let
+ * a policy keep its own bookkeeping in step with the paging code:
+ *
+ *   on_access      every access in mem_access() that did not fault
+ *   on_fault       a page was just mapped into pfn by page_fault(); the frame
+ *                  table entry already names the new owner and VPN
+ *   on_evict       pfn is about to be unmapped, either by free_frame() or
+ *                  (with exiting set) by proc_cleanup()
+ *   on_move        the page in from was copied to the free frame to, whose
+ *                  frame table entry already names it; without this hook the
+ *                  policy sees from evicted (exiting) and to faulted in
+ *   on_exchange    the pages in a and b traded frames, whose frame table
+ *                  entries already name their new pages; without this hook
+ *                  the policy sees both evicted (exiting) before the trade
+ *                  and faulted in after it
+ *   on_share       the pages mapping pfn changed: rmap_add() gave it one more
+ *                  or rmap_remove() took one away, and if that was the page
+ *                  its frame table entry named, the entry now names another;
+ *                  without this hook the policy only sees that last case, as
+ *                  pfn evicted (exiting) before and faulted in after
+ *   select_victim  pick a mapped frame to evict
+ *
+ * Any hook but select_victim may be NULL. All hooks must run in O(1)
+ * amortized time, since they sit on the access and fault paths.
+ *
+ * A policy that remembers pages after eviction knows them by page_key(),
+ * which includes how many times their pid has exited. A new process with
+ * the same pid never matches the pages of an old one. Those pages simply
+ * age out of whatever the policy keeps them on, so nothing has to go
+ * looking for them when a process exits.
+ */
+typedef struct replacement_policy {
+    const char *name;
+    void (*init)(void);
+    void (*on_access)(pfn_t pfn, char rw);
+    void (*on_fault)(pfn_t pfn);
+    void (*on_evict)(pfn_t pfn, int exiting);
+    void (*on_move)(pfn_t from, pfn_t to);
+    void (*on_exchange)(pfn_t a, pfn_t b);
+    void (*on_share)(pfn_t pfn);
+    pfn_t (*select_victim)(void);
+} replacement_policy_t;
+
+/* The policy selected by replacement, set up by replacement_init() */
+extern SIM_LOCAL const replacement_policy_t *policy;
+
+/* For each pid, how many processes with it have exited (see page_key()) */
+extern SIM_LOCAL uint32_t *page_generation;
+
+extern const replacement_policy_t random_policy;
+extern const replacement_policy_t clocksweep_policy;
+extern const replacement_policy_t aging_policy;
+extern const replacement_policy_t wsclock_policy;
+extern const replacement_policy_t twoq_policy;
+extern const replacement_policy_t arc_policy;
+extern const replacement_policy_t clockpro_policy;
+extern const replacement_policy_t opt_policy;
+
+/**
+ * Returns the replacement constant (see pagesim.h) for a policy name, or 0
+ * if there is no such policy.
+ */
+uint8_t replacement_lookup(const char *name);
+
+/**
+ * Returns the name of the policy with the given replacement constant.
+ */
+const char *replacement_name(uint8_t id);
+
+/**
+ * Selects and initializes the policy named by the replacement global.
+ */
+void replacement_init(void);
+
+/**
+ * Frees everything the policy allocated with policy_alloc().
+ */
+void replacement_teardown(void);
+
+/**
+ * Allocates zeroed policy state, which lives until replacement_teardown().
+ */
+void *policy_alloc(size_t count, size_t size);
+
+/**
+ * Builds the next-use index OPT replaces pages by. OPT looks into the
+ * future, so this must see the whole trace before the simulation starts.
+ */
+void opt_prepare(const trace_record_t *records, uint64_t count);
+
+static inline void policy_on_access(pfn_t pfn, char rw) {
+    if (policy->on_access) {
+        policy->on_access(pfn, rw);
+    }
+}
+
+static inline void policy_on_fault(pfn_t pfn) {
+    if (policy->on_fault) {
+        policy->on_fault(pfn);
+    }
+}
+
+static inline void policy_on_evict(pfn_t pfn, int exiting) {
+    if (policy->on_evict) {
+        policy->on_evict(pfn, exiting);
+    }
+}
+
+static inline void policy_on_move(pfn_t from, pfn_t to) {
+    if (policy->on_move) {
+        policy->on_move(from, to);
+    } else {
+        policy_on_evict(from, 1);
+        policy_on_fault(to);
+    }
+}
+
+/* Called before the pages in a and b trade frames, and policy_on_exchange()
+   after */
+static inline void policy_before_exchange(pfn_t a, pfn_t b) {
+    if (!policy->on_exchange) {
+        policy_on_evict(a, 1);
+        policy_on_evict(b, 1);
+    }
+}
+
+static inline void policy_on_exchange(pfn_t a, pfn_t b) {
+    if (policy->on_exchange) {
+        policy->on_exchange(a, b);
+    } else {
+        policy_on_fault(a);
+        policy_on_fault(b);
+    }
+}
+
+/* Called before the frame table entry of the shared frame pfn passes to
+   another of the pages sharing it, and policy_on_share() after */
+static inline void policy_before_owner_change(pfn_t pfn) {
+    if (!policy->on_share) {
+        policy_on_evict(pfn, 1);
+    }
+}
+
+/* Called whenever the pages sharing pfn change; owner_changed is set if
+   policy_before_owner_change() came first */
+static inline void policy_on_share(pfn_t pfn, int owner_changed) {
+    if (policy->on_share) {
+        policy->on_share(pfn);
+    } else if (owner_changed) {
+        policy_on_fault(pfn);
+    }
+}
+
+/* Called once process pid has exited, after every frame it had was evicted
+   or passed on */
+static inline void policy_on_exit(uint32_t pid) {
+    page_generation[pid]++;
+}
+
+/* The key policies use to remember pages that are no longer resident: the
+   VPN, the pid (below 1024, see MAX_PID) and the pid's generation. The
+   generation wraps after 2^22 exits, long after any page of it is gone. */
+static inline uint64_t page_key(const fte_t *fte) {
+    uint32_t pid = fte->process->pid;
+    return ((uint64_t) page_generation[pid] << 42) | ((uint64_t) pid << 32) | fte->vpn;
+}
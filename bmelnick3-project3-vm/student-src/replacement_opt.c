@@ -0,0 +1,528 @@
+#include "types.h"
+#include "pagesim.h"
+#include "paging.h"
+#include "page_splitting.h"
+#include "util.h"
+#include "replacement.h"
+
+/*
+ * Belady's optimal replacement (OPT).
+ *
+ * OPT evicts the page whose next use lies furthest in the future, which
+ * needs the whole trace up front. opt_prepare() scans the trace backwards
+ * once and records, for every access, the step at which the same page is
+ * next accessed. At run time the resident frames sit in a max-heap keyed
+ * by the next use of their page, so every hook is O(log frames).
+ *
+ * A page's next use never crosses a STOP of its process: proc_cleanup()
+ * frees the page there, so a later process reusing the pid starts afresh.
+ * It does follow the page across a FORK, since the child goes on to share
+ * the parent's frame: an access by the child (or by its own children) is
+ * a use of the parent's page too, if it comes before the parent's next.
+ *
+ * A frame shared since a FORK or through SHM is needed at the first next
+ * use of any of the pages sharing it, which need not be the page accessed
+ * in this step. For those opt_prepare() also keeps, for every lifetime of
+ * a page between STOPs of its process, the steps it is accessed at and the
+ * FORKs that pass it on, so on_access() and on_share() can look the next
+ * use of each of those pages up.
+ */
+
+#define NIL UINT32_MAX
+
+/* Never accessed again, sorts above every real step */
+#define OPT_NEVER UINT32_MAX
+
+/* For each step of the trace, the step its page is next accessed at */
+static SIM_LOCAL uint32_t *opt_next_use;
+static SIM_LOCAL uint64_t opt_steps;
+
+/* Max-heap of resident frames, keyed by opt_key */
+static SIM_LOCAL pfn_t *opt_heap;
+static SIM_LOCAL uint32_t *opt_heap_pos;  /* NIL for frames not in the heap */
+static SIM_LOCAL uint32_t *opt_key;
+static SIM_LOCAL uint32_t opt_heap_size;
+
+/* For scratch state that opt_prepare() frees itself */
+static void *opt_alloc(size_t count, size_t size) {
+    void *ptr = calloc(count, size);
+    if (!ptr) {
+        panic("could not allocate replacement policy state");
+    }
+    return ptr;
+}
+
+static void *opt_grow(void *ptr, uint32_t *capacity, size_t size) {
+    *capacity = *capacity ? *capacity * 2 : 16;
+    ptr = realloc(ptr, *capacity * size);
+    if (!ptr) {
+        panic("could not allocate replacement policy state");
+    }
+    return ptr;
+}
+
+/* -------------------------------------------------------------------------
+ * Next-use index
+ * ------------------------------------------------------------------------- */
+
+/* The most recent (in scan order) access to a page, for the backward scan */
+typedef struct opt_seen {
+    uint64_t key;
+    uint32_t step;              /* OPT_NEVER marks an empty slot */
+    uint32_t generation;        /* Of the owning pid when the step was seen */
+    uint32_t life;              /* The page's lifetime in that generation */
+} opt_seen_t;
+
+typedef struct opt_seen_map {
+    opt_seen_t *slots;
+    uint64_t mask;
+    uint64_t size;
+} opt_seen_map_t;
+
+static void seen_map_alloc(opt_seen_map_t *map, uint64_t capacity) {
+    map->slots = opt_alloc(capacity, sizeof(opt_seen_t));
+    map->mask = capacity - 1;
+    map->size = 0;
+    for (uint64_t i = 0; i < capacity; i++) {
+        map->slots[i].step = OPT_NEVER;
+    }
+}
+
+static inline uint64_t seen_map_home(const opt_seen_map_t *map, uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ULL >> 17) & map->mask;
+}
+
+static opt_seen_t *seen_map_slot(opt_seen_map_t *map, uint64_t key) {
+    uint64_t i = seen_map_home(map, key);
+    while (map->slots[i].step != OPT_NEVER && map->slots[i].key != key) {
+        i = (i + 1) & map->mask;
+    }
+    return &map->slots[i];
+}
+
+static void seen_map_grow(opt_seen_map_t *map) {
+    opt_seen_map_t old = *map;
+    seen_map_alloc(map, (old.mask + 1) * 2);
+    for (uint64_t i = 0; i <= old.mask; i++) {
+        if (old.slots[i].step != OPT_NEVER) {
+            *seen_map_slot(map, old.slots[i].key) = old.slots[i];
+            map->size++;
+        }
+    }
+    free(old.slots);
+}
+
+/* A FORK that passes a page lifetime on to a child, which first uses its
+   copy at the given step */
+typedef struct opt_fork_use {
+    uint32_t life;
+    uint32_t fork;
+    uint32_t use;
+} opt_fork_use_t;
+
+/* Scratch state of the backward scan */
+typedef struct opt_scan {
+    opt_seen_map_t seen;
+    /* Bumped at every STOP seen by the scan, which retires the pages the
+       process touched after it */
+    uint32_t *generation;
+    /* The VPNs each pid touched in its current generation */
+    vpn_t **touched;
+    uint32_t *touched_count;
+    uint32_t *touched_capacity;
+    /* The key and generation of each page lifetime */
+    uint64_t *life_key;
+    uint32_t *life_generation;
+    uint32_t lives;
+    uint32_t lives_capacity;
+    opt_fork_use_t *fork_uses;
+    uint32_t fork_use_count;
+    uint32_t fork_use_capacity;
+} opt_scan_t;
+
+/* The slot of vpn in the current generation of pid, which starts a new
+   page lifetime (with no next use yet) if pid has not touched vpn since */
+static opt_seen_t *scan_page(opt_scan_t *scan, uint32_t pid, vpn_t vpn) {
+    uint64_t key = ((uint64_t) pid << 32) | vpn;
+    opt_seen_t *slot = seen_map_slot(&scan->seen, key);
+    if (slot->step != OPT_NEVER && slot->generation == scan->generation[pid]) {
+        return slot;
+    }
+    if (slot->step == OPT_NEVER && ++scan->seen.size * 2 > scan->seen.mask + 1) {
+        seen_map_grow(&scan->seen);
+        slot = seen_map_slot(&scan->seen, key);
+    }
+
+    if (scan->lives == scan->lives_capacity) {
+        uint32_t capacity = scan->lives_capacity;
+        scan->life_key = opt_grow(scan->life_key, &capacity, sizeof(uint64_t));
+        scan->life_generation = opt_grow(scan->life_generation, &scan->lives_capacity, sizeof(uint32_t));
+    }
+    scan->life_key[scan->lives] = key;
+    scan->life_generation[scan->lives] = scan->generation[pid];
+
+    if (scan->touched_count[pid] == scan->touched_capacity[pid]) {
+        scan->touched[pid] = opt_grow(scan->touched[pid], &scan->touched_capacity[pid], sizeof(vpn_t));
+    }
+    scan->touched[pid][scan->touched_count[pid]++] = vpn;
+
+    slot->key = key;
+    slot->step = OPT_NEVER - 1;
+    slot->generation = scan->generation[pid];
+    slot->life = scan->lives++;
+    return slot;
+}
+
+/* Page lifetimes, found by their key and the number of STOPs of their pid
+   before them */
+typedef struct opt_life_slot {
+    uint64_t key;
+    uint32_t generation;
+    uint32_t life;              /* NIL marks an empty slot */
+} opt_life_slot_t;
+
+static SIM_LOCAL opt_life_slot_t *opt_lives;
+static SIM_LOCAL uint64_t opt_lives_mask;
+/* The steps each page lifetime is accessed at, in order, from
+   opt_access_first[life] up to opt_access_first[life + 1] */
+static SIM_LOCAL uint32_t *opt_access_first;
+static SIM_LOCAL uint32_t *opt_access_steps;
+/* The FORKs that pass each page lifetime on, in order, with the first use
+   by that child or any later one */
+static SIM_LOCAL uint32_t *opt_fork_first;
+static SIM_LOCAL uint32_t *opt_fork_steps;
+static SIM_LOCAL uint32_t *opt_fork_next;
+
+static opt_life_slot_t *life_slot(uint64_t key, uint32_t generation) {
+    uint64_t i = ((key ^ ((uint64_t) generation << 40)) * 0x9E3779B97F4A7C15ULL >> 17) & opt_lives_mask;
+    while (opt_lives[i].life != NIL && (opt_lives[i].key != key || opt_lives[i].generation != generation)) {
+        i = (i + 1) & opt_lives_mask;
+    }
+    return &opt_lives[i];
+}
+
+/* Lists the steps each page lifetime is accessed at, and the FORKs the
+   backward scan saw pass it on */
+static void opt_index_lives(opt_scan_t *scan, uint64_t count, const uint32_t *access_life) {
+    uint32_t lives = scan->lives;
+    uint32_t *cursor = opt_alloc(lives ? lives : 1, sizeof(uint32_t));
+
+    opt_access_first = policy_alloc(lives + 1, sizeof(uint32_t));
+    uint32_t accesses = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (access_life[i] != NIL) {
+            opt_access_first[access_life[i] + 1]++;
+            accesses++;
+        }
+    }
+    opt_access_steps = policy_alloc(accesses ? accesses : 1, sizeof(uint32_t));
+    for (uint32_t life = 0; life < lives; life++) {
+        opt_access_first[life + 1] += opt_access_first[life];
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        uint32_t life = access_life[i];
+        if (life != NIL) {
+            opt_access_steps[opt_access_first[life] + cursor[life]++] = (uint32_t) i;
+        }
+    }
+
+    /* The scan saw the FORKs last first, so take them in reverse */
+    memset(cursor, 0, (lives ? lives : 1) * sizeof(uint32_t));
+    uint32_t forks = scan->fork_use_count;
+    opt_fork_first = policy_alloc(lives + 1, sizeof(uint32_t));
+    opt_fork_steps = policy_alloc(forks ? forks : 1, sizeof(uint32_t));
+    opt_fork_next = policy_alloc(forks ? forks : 1, sizeof(uint32_t));
+    for (uint32_t i = 0; i < forks; i++) {
+        opt_fork_first[scan->fork_uses[i].life + 1]++;
+    }
+    for (uint32_t life = 0; life < lives; life++) {
+        opt_fork_first[life + 1] += opt_fork_first[life];
+    }
+    for (uint32_t i = forks; i-- > 0;) {
+        const opt_fork_use_t *use = &scan->fork_uses[i];
+        uint32_t at = opt_fork_first[use->life] + cursor[use->life]++;
+        opt_fork_steps[at] = use->fork;
+        opt_fork_next[at] = use->use;
+    }
+    /* Each FORK's entry holds the first use by its child or any later one */
+    for (uint32_t life = 0; life < lives; life++) {
+        for (uint32_t at = opt_fork_first[life + 1]; at-- > opt_fork_first[life] + 1;) {
+            if (opt_fork_next[at] < opt_fork_next[at - 1]) {
+                opt_fork_next[at - 1] = opt_fork_next[at];
+            }
+        }
+    }
+    free(cursor);
+
+    /* The scan counted generations from the end of the trace */
+    uint64_t capacity = 1;
+    while (capacity < (uint64_t) lives * 2) {
+        capacity *= 2;
+    }
+    opt_lives = policy_alloc(capacity, sizeof(opt_life_slot_t));
+    opt_lives_mask = capacity - 1;
+    for (uint64_t i = 0; i < capacity; i++) {
+        opt_lives[i].life = NIL;
+    }
+    for (uint32_t life = 0; life < lives; life++) {
+        uint64_t key = scan->life_key[life];
+        uint32_t generation = scan->generation[key >> 32] - scan->life_generation[life];
+        opt_life_slot_t *slot = life_slot(key, generation);
+        slot->key = key;
+        slot->generation = generation;
+        slot->life = life;
+    }
+}
+
+void opt_prepare(const trace_record_t *records, uint64_t count) {
+    if (count >= OPT_NEVER - 1) {
+        panic("trace is too long for the OPT next-use index");
+    }
+    opt_next_use = policy_alloc(count ? count : 1, sizeof(uint32_t));
+    opt_steps = count;
+
+    opt_scan_t scan = {0};
+    seen_map_alloc(&scan.seen, 1024);
+    scan.generation = opt_alloc(MAX_PID, sizeof(uint32_t));
+    scan.touched = opt_alloc(MAX_PID, sizeof(vpn_t *));
+    scan.touched_count = opt_alloc(MAX_PID, sizeof(uint32_t));
+    scan.touched_capacity = opt_alloc(MAX_PID, sizeof(uint32_t));
+    uint32_t *access_life = opt_alloc(count ? count : 1, sizeof(uint32_t));
+
+    for (uint64_t i = count; i-- > 0;) {
+        const trace_record_t *rec = &records[i];
+        opt_next_use[i] = OPT_NEVER;
+        access_life[i] = NIL;
+        if (rec->pid >= MAX_PID) {
+            continue;
+        }
+        if (rec->op == TRACE_STOP) {
+            scan.generation[rec->pid]++;
+            scan.touched_count[rec->pid] = 0;
+        } else if (rec->op == TRACE_FORK && rec->address < MAX_PID) {
+            /* Every page the child touches is a use of the parent's too */
+            uint32_t child = rec->address;
+            for (uint32_t j = 0; j < scan.touched_count[child]; j++) {
+                vpn_t vpn = scan.touched[child][j];
+                uint32_t use = seen_map_slot(&scan.seen, ((uint64_t) child << 32) | vpn)->step;
+                opt_seen_t *slot = scan_page(&scan, rec->pid, vpn);
+                if (use < slot->step) {
+                    slot->step = use;
+                }
+                if (scan.fork_use_count == scan.fork_use_capacity) {
+                    scan.fork_uses = opt_grow(scan.fork_uses, &scan.fork_use_capacity, sizeof(opt_fork_use_t));
+                }
+                scan.fork_uses[scan.fork_use_count++] = (opt_fork_use_t) {slot->life, (uint32_t) i, use};
+            }
+        } else if (rec->op == TRACE_ACCESS) {
+            opt_seen_t *slot = scan_page(&scan, rec->pid, vaddr_vpn(rec->address));
+            if (slot->step != OPT_NEVER - 1) {
+                opt_next_use[i] = slot->step;
+            }
+            slot->step = (uint32_t) i;
+            access_life[i] = slot->life;
+        }
+    }
+
+    opt_index_lives(&scan, count, access_life);
+
+    for (uint32_t pid = 0; pid < MAX_PID; pid++) {
+        free(scan.touched[pid]);
+    }
+    free(access_life);
+    free(scan.fork_uses);
+    free(scan.life_generation);
+    free(scan.life_key);
+    free(scan.touched_capacity);
+    free(scan.touched_count);
+    free(scan.touched);
+    free(scan.generation);
+    free(scan.seen.slots);
+}
+
+/* The index of the first of count steps, in order, that comes after this
+   one */
+static uint32_t opt_first_after(const uint32_t *steps, uint32_t count) {
+    uint32_t lo = 0;
+    uint32_t hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (steps[mid] <= step) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* The step after this one at which vpn of pid, or of a child it has yet
+   to fork, is next accessed */
+static uint32_t opt_page_next(uint32_t pid, vpn_t vpn) {
+    uint32_t life = life_slot(((uint64_t) pid << 32) | vpn, page_generation[pid])->life;
+    if (life == NIL) {
+        return OPT_NEVER;
+    }
+    uint32_t first = opt_access_first[life];
+    uint32_t count = opt_access_first[life + 1] - first;
+    uint32_t i = opt_first_after(opt_access_steps + first, count);
+    uint32_t next = i < count ? opt_access_steps[first + i] : OPT_NEVER;
+
+    first = opt_fork_first[life];
+    count = opt_fork_first[life + 1] - first;
+    i = opt_first_after(opt_fork_steps + first, count);
+    if (i < count && opt_fork_next[first + i] < next) {
+        next = opt_fork_next[first + i];
+    }
+    return next;
+}
+
+/* -------------------------------------------------------------------------
+ * Frame heap
+ * ------------------------------------------------------------------------- */
+
+static inline void heap_set(uint32_t i, pfn_t pfn) {
+    opt_heap[i] = pfn;
+    opt_heap_pos[pfn] = i;
+}
+
+static void heap_sift_up(uint32_t i) {
+    pfn_t pfn = opt_heap[i];
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (opt_key[opt_heap[parent]] >= opt_key[pfn]) {
+            break;
+        }
+        heap_set(i, opt_heap[parent]);
+        i = parent;
+    }
+    heap_set(i, pfn);
+}
+
+static void heap_sift_down(uint32_t i) {
+    pfn_t pfn = opt_heap[i];
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        if (child >= opt_heap_size) {
+            break;
+        }
+        if (child + 1 < opt_heap_size && opt_key[opt_heap[child + 1]] > opt_key[opt_heap[child]]) {
+            child++;
+        }
+        if (opt_key[opt_heap[child]] <= opt_key[pfn]) {
+            break;
+        }
+        heap_set(i, opt_heap[child]);
+        i = child;
+    }
+    heap_set(i, pfn);
+}
+
+/* The step at which the page accessed in this step is next accessed */
+static inline uint32_t opt_next(void) {
+    return step < opt_steps ? opt_next_use[step] : OPT_NEVER;
+}
+
+/* -------------------------------------------------------------------------
+ * Policy
+ * ------------------------------------------------------------------------- */
+
+static void opt_init(void) {
+    if (!opt_next_use) {
+        panic("OPT needs the whole trace, but opt_prepare() was not called");
+    }
+    opt_heap = policy_alloc(NUM_FRAMES, sizeof(pfn_t));
+    opt_heap_pos = policy_alloc(NUM_FRAMES, sizeof(uint32_t));
+    opt_key = policy_alloc(NUM_FRAMES, sizeof(uint32_t));
+    for (pfn_t i = 0; i < NUM_FRAMES; i++) {
+        opt_heap_pos[i] = NIL;
+    }
+}
+
+/* The step after this one at which any of the pages sharing pfn is next
+   accessed */
+static uint32_t opt_shared_next(pfn_t pfn) {
+    const fte_t *fte = frame_table + pfn;
+    uint32_t next = opt_page_next(fte->process->pid, fte->vpn);
+    uint32_t cursor = 0;
+    pcb_t *proc;
+    vpn_t vpn;
+    while (rmap_next(pfn, &cursor, &proc, &vpn)) {
+        uint32_t use = opt_page_next(proc->pid, vpn);
+        if (use < next) {
+            next = use;
+        }
+    }
+    return next;
+}
+
+static void opt_rekey(pfn_t pfn, uint32_t key) {
+    opt_key[pfn] = key;
+    heap_sift_up(opt_heap_pos[pfn]);
+    heap_sift_down(opt_heap_pos[pfn]);
+}
+
+static void opt_on_access(pfn_t pfn, char rw) {
+    (void) rw;
+    opt_rekey(pfn, frame_table[pfn].refcount > 1 ? opt_shared_next(pfn) : opt_next());
+}
+
+static void opt_on_fault(pfn_t pfn) {
+    opt_key[pfn] = opt_next();
+    opt_heap[opt_heap_size] = pfn;
+    heap_sift_up(opt_heap_size++);
+}
+
+static void opt_on_evict(pfn_t pfn, int exiting) {
+    (void) exiting;
+    uint32_t i = opt_heap_pos[pfn];
+    opt_heap_pos[pfn] = NIL;
+    if (i == --opt_heap_size) {
+        return;
+    }
+    pfn_t moved = opt_heap[opt_heap_size];
+    heap_set(i, moved);
+    heap_sift_up(i);
+    heap_sift_down(opt_heap_pos[moved]);
+}
+
+/* The page keeps its next use; to simply takes from's place in the heap */
+static void opt_on_move(pfn_t from, pfn_t to) {
+    opt_key[to] = opt_key[from];
+    heap_set(opt_heap_pos[from], to);
+    opt_heap_pos[from] = NIL;
+}
+
+/* The pages keep their next uses; each takes the other's place in the heap */
+static void opt_on_exchange(pfn_t a, pfn_t b) {
+    uint32_t key = opt_key[a];
+    uint32_t pos = opt_heap_pos[a];
+    opt_key[a] = opt_key[b];
+    opt_key[b] = key;
+    heap_set(opt_heap_pos[b], a);
+    heap_set(pos, b);
+}
+
+/* The frame stays put, but may now be needed sooner or later */
+static void opt_on_share(pfn_t pfn) {
+    opt_rekey(pfn, opt_shared_next(pfn));
+}
+
+static pfn_t opt_select_victim(void) {
+    if (!opt_heap_size) {
+        panic("System ran out of memory\n");
+    }
+    return opt_heap[0];
+}
+
+const replacement_policy_t opt_policy = {
+    .name = "opt",
+    .init = opt_init,
+    .on_access = opt_on_access,
+    .on_fault = opt_on_fault,
+    .on_evict = opt_on_evict,
+    .on_move = opt_on_move,
+    .on_exchange = opt_on_exchange,
+    .on_share = opt_on_share,
+    .select_victim = opt_select_victim,
+};
@@ -0,0 +1,931 @@
+#include "types.h"
+#include "pagesim.h"
+#include "paging.h"
+#include "stats.h"
+#include "util.h"
+#include "replacement.h"
+
+/*
+ * LRU-approximating replacement policies: aging, WSClock, 2Q, ARC and
+ * CLOCK-Pro. See replacement.h for the interface they implement.
+ *
+ * Policies only ever see data frames: page tables are allocated through
+ * free_frame() too, but never reach on_fault(), so they are never victims.
+ */
+
+#define NIL UINT32_MAX
+
+/* The number of frames that can ever hold data pages */
+#define DATA_FRAMES (NUM_FRAMES - FRAME_TABLE_FRAMES)
+
+static void policy_out_of_memory(void) {
+    panic("System ran out of memory\n");
+}
+
+/* -------------------------------------------------------------------------
+ * Frame lists
+ *
+ * Intrusive doubly-linked lists of frames, with the links kept in per-frame
+ * arrays. A frame is on at most one list at a time; frame_list_on records
+ * which (0 for none), so policies can find it again in O(1).
+ * ------------------------------------------------------------------------- */
+
+typedef struct frame_list {
+    pfn_t head;
+    pfn_t tail;
+    uint32_t size;
+} frame_list_t;
+
+static SIM_LOCAL pfn_t *frame_list_prev;
+static SIM_LOCAL pfn_t *frame_list_next;
+static SIM_LOCAL uint16_t *frame_list_on;
+
+static void frame_lists_init(void) {
+    frame_list_prev = policy_alloc(NUM_FRAMES, sizeof(pfn_t));
+    frame_list_next = policy_alloc(NUM_FRAMES, sizeof(pfn_t));
+    frame_list_on = policy_alloc(NUM_FRAMES, sizeof(uint16_t));
+}
+
+static void frame_list_clear(frame_list_t *list) {
+    list->head = list->tail = NIL;
+    list->size = 0;
+}
+
+static void frame_list_push_head(frame_list_t *list, uint16_t id, pfn_t pfn) {
+    frame_list_prev[pfn] = NIL;
+    frame_list_next[pfn] = list->head;
+    if (list->head != NIL) {
+        frame_list_prev[list->head] = pfn;
+    } else {
+        list->tail = pfn;
+    }
+    list->head = pfn;
+    list->size++;
+    frame_list_on[pfn] = id;
+}
+
+static void frame_list_push_tail(frame_list_t *list, uint16_t id, pfn_t pfn) {
+    frame_list_next[pfn] = NIL;
+    frame_list_prev[pfn] = list->tail;
+    if (list->tail != NIL) {
+        frame_list_next[list->tail] = pfn;
+    } else {
+        list->head = pfn;
+    }
+    list->tail = pfn;
+    list->size++;
+    frame_list_on[pfn] = id;
+}
+
+static void frame_list_remove(frame_list_t *list, pfn_t pfn) {
+    pfn_t prev = frame_list_prev[pfn], next = frame_list_next[pfn];
+    if (prev != NIL) {
+        frame_list_next[prev] = next;
+    } else {
+        list->head = next;
+    }
+    if (next != NIL) {
+        frame_list_prev[next] = prev;
+    } else {
+        list->tail = prev;
+    }
+    list->size--;
+    frame_list_on[pfn] = 0;
+}
+
+/* Puts pfn, which is on no list, in old's place on list, taking old off */
+static void frame_list_replace(frame_list_t *list, pfn_t old, pfn_t pfn) {
+    pfn_t prev = frame_list_prev[old], next = frame_list_next[old];
+    frame_list_prev[pfn] = prev;
+    frame_list_next[pfn] = next;
+    if (prev != NIL) {
+        frame_list_next[prev] = pfn;
+    } else {
+        list->head = pfn;
+    }
+    if (next != NIL) {
+        frame_list_prev[next] = pfn;
+    } else {
+        list->tail = pfn;
+    }
+    frame_list_on[pfn] = frame_list_on[old];
+    frame_list_on[old] = 0;
+}
+
+/* Trades the places of a, on list_a, and b, on list_b */
+static void frame_list_exchange(frame_list_t *list_a, frame_list_t *list_b, pfn_t a, pfn_t b) {
+    uint16_t id_b = frame_list_on[b];
+    pfn_t after = frame_list_prev[b];
+    frame_list_remove(list_b, b);
+    frame_list_replace(list_a, a, b);
+    if (after == a) {
+        /* a was just ahead of b, so it goes just behind it now */
+        after = b;
+    }
+    if (after == NIL) {
+        frame_list_push_head(list_b, id_b, a);
+        return;
+    }
+    frame_list_prev[a] = after;
+    frame_list_next[a] = frame_list_next[after];
+    if (frame_list_next[after] != NIL) {
+        frame_list_prev[frame_list_next[after]] = a;
+    } else {
+        list_b->tail = a;
+    }
+    frame_list_next[after] = a;
+    list_b->size++;
+    frame_list_on[a] = id_b;
+}
+
+/* -------------------------------------------------------------------------
+ * Key map
+ *
+ * Maps page keys (see page_key()) to node indices, for policies that
+ * remember pages after they have been evicted. Open addressing with linear
+ * probing and backward-shift deletion, sized for at least twice the number
+ * of nodes so it never needs to grow.
+ * ------------------------------------------------------------------------- */
+
+typedef struct keymap {
+    uint64_t *keys;
+    uint32_t *vals;             /* NIL marks an empty slot */
+    uint64_t mask;
+} keymap_t;
+
+static void keymap_init(keymap_t *map, uint32_t nodes) {
+    uint64_t capacity = 16;
+    while (capacity < (uint64_t) nodes * 2) {
+        capacity *= 2;
+    }
+    map->keys = policy_alloc(capacity, sizeof(uint64_t));
+    map->vals = policy_alloc(capacity, sizeof(uint32_t));
+    map->mask = capacity - 1;
+    for (uint64_t i = 0; i < capacity; i++) {
+        map->vals[i] = NIL;
+    }
+}
+
+static inline uint64_t keymap_home(const keymap_t *map, uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ULL >> 17) & map->mask;
+}
+
+static uint32_t keymap_get(const keymap_t *map, uint64_t key) {
+    for (uint64_t i = keymap_home(map, key); map->vals[i] != NIL; i = (i + 1) & map->mask) {
+        if (map->keys[i] == key) {
+            return map->vals[i];
+        }
+    }
+    return NIL;
+}
+
+static void keymap_put(keymap_t *map, uint64_t key, uint32_t val) {
+    uint64_t i = keymap_home(map, key);
+    while (map->vals[i] != NIL && map->keys[i] != key) {
+        i = (i + 1) & map->mask;
+    }
+    map->keys[i] = key;
+    map->vals[i] = val;
+}
+
+static void keymap_del(keymap_t *map, uint64_t key) {
+    uint64_t hole = keymap_home(map, key);
+    while (map->vals[hole] != NIL && map->keys[hole] != key) {
+        hole = (hole + 1) & map->mask;
+    }
+    if (map->vals[hole] == NIL) {
+        return;
+    }
+    map->vals[hole] = NIL;
+    for (uint64_t i = (hole + 1) & map->mask; map->vals[i] != NIL; i = (i + 1) & map->mask) {
+        uint64_t home = keymap_home(map, map->keys[i]);
+        if (((i - home) & map->mask) >= ((i - hole) & map->mask)) {
+            map->keys[hole] = map->keys[i];
+            map->vals[hole] = map->vals[i];
+            map->vals[i] = NIL;
+            hole = i;
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * Ghost lists
+ *
+ * Ordered lists of the keys of recently evicted pages, used by 2Q and ARC.
+ * All ghost lists of a policy share one node pool and one key map.
+ * ------------------------------------------------------------------------- */
+
+typedef struct ghost {
+    uint64_t key;
+    uint32_t prev;
+    uint32_t next;
+    uint8_t list;               /* Which ghost list the node is on */
+} ghost_t;
+
+typedef struct ghost_list {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t size;
+} ghost_list_t;
+
+static SIM_LOCAL ghost_t *ghosts;
+static SIM_LOCAL uint32_t ghost_free;
+static SIM_LOCAL keymap_t ghost_map;
+
+static void ghosts_init(uint32_t capacity) {
+    ghosts = policy_alloc(capacity, sizeof(ghost_t));
+    for (uint32_t i = 0; i < capacity; i++) {
+        ghosts[i].next = i + 1 < capacity ? i + 1 : NIL;
+    }
+    ghost_free = 0;
+    keymap_init(&ghost_map, capacity);
+}
+
+static void ghost_list_clear(ghost_list_t *list) {
+    list->head = list->tail = NIL;
+    list->size = 0;
+}
+
+static void ghost_push_head(ghost_list_t *list, uint8_t id, uint64_t key) {
+    uint32_t g = ghost_free;
+    if (g == NIL) {
+        panic("replacement policy ghost list overflow");
+    }
+    ghost_free = ghosts[g].next;
+
+    ghosts[g].key = key;
+    ghosts[g].list = id;
+    ghosts[g].prev = NIL;
+    ghosts[g].next = list->head;
+    if (list->head != NIL) {
+        ghosts[list->head].prev = g;
+    } else {
+        list->tail = g;
+    }
+    list->head = g;
+    list->size++;
+    keymap_put(&ghost_map, key, g);
+}
+
+static void ghost_remove(ghost_list_t *list, uint32_t g) {
+    if (ghosts[g].prev != NIL) {
+        ghosts[ghosts[g].prev].next = ghosts[g].next;
+    } else {
+        list->head = ghosts[g].next;
+    }
+    if (ghosts[g].next != NIL) {
+        ghosts[ghosts[g].next].prev = ghosts[g].prev;
+    } else {
+        list->tail = ghosts[g].prev;
+    }
+    list->size--;
+    keymap_del(&ghost_map, ghosts[g].key);
+
+    ghosts[g].next = ghost_free;
+    ghost_free = g;
+}
+
+/* -------------------------------------------------------------------------
+ * Aging
+ *
+ * Each frame has an 8-bit age. Every NUM_FRAMES accesses the ages are
+ * shifted right and the referenced bit is shifted in at the top, so recently
+ * used pages have large ages. Frames are kept in one FIFO bucket per age,
+ * rebuilt at every tick (O(NUM_FRAMES) per NUM_FRAMES accesses), so the
+ * victim is found by looking at the lowest non-empty bucket. Pages referenced
+ * since the last tick are moved to the top bucket instead of being evicted.
+ * ------------------------------------------------------------------------- */
+
+#define AGING_BUCKETS 256
+
+static SIM_LOCAL uint8_t *aging_age;
+static SIM_LOCAL frame_list_t aging_buckets[AGING_BUCKETS];
+static SIM_LOCAL uint32_t aging_accesses;
+
+static void aging_init(void) {
+    frame_lists_init();
+    aging_age = policy_alloc(NUM_FRAMES, sizeof(uint8_t));
+    for (uint32_t b = 0; b < AGING_BUCKETS; b++) {
+        frame_list_clear(&aging_buckets[b]);
+    }
+}
+
+static void aging_tick(void) {
+    for (uint32_t b = 0; b < AGING_BUCKETS; b++) {
+        frame_list_clear(&aging_buckets[b]);
+    }
+    for (pfn_t pfn = 0; pfn < NUM_FRAMES; pfn++) {
+        if (!frame_list_on[pfn]) {
+            continue;
+        }
+        aging_age[pfn] = (uint8_t) ((aging_age[pfn] >> 1) | (frame_table[pfn].referenced ? 0x80 : 0));
+        frame_table[pfn].referenced = 0;
+        frame_list_push_tail(&aging_buckets[aging_age[pfn]], (uint16_t) (aging_age[pfn] + 1), pfn);
+    }
+}
+
+static void aging_on_access(pfn_t pfn, char rw) {
+    (void) pfn;
+    (void) rw;
+    if (++aging_accesses >= NUM_FRAMES) {
+        aging_accesses = 0;
+        aging_tick();
+    }
+}
+
+static void aging_on_fault(pfn_t pfn) {
+    aging_age[pfn] = 0;
+    frame_list_push_tail(&aging_buckets[0], 1, pfn);
+}
+
+static void aging_on_evict(pfn_t pfn, int exiting) {
+    (void) exiting;
+    frame_list_remove(&aging_buckets[frame_list_on[pfn] - 1], pfn);
+}
+
+static void aging_on_move(pfn_t from, pfn_t to) {
+    aging_age[to] = aging_age[from];
+    frame_list_replace(&aging_buckets[frame_list_on[from] - 1], from, to);
+}
+
+static void aging_on_exchange(pfn_t a, pfn_t b) {
+    uint8_t age = aging_age[a];
+    aging_age[a] = aging_age[b];
+    aging_age[b] = age;
+    frame_list_exchange(&aging_buckets[frame_list_on[a] - 1], &aging_buckets[frame_list_on[b] - 1], a, b);
+}
+
+static pfn_t aging_select_victim(void) {
+    for (uint32_t b = 0; b < AGING_BUCKETS; b++) {
+        while (aging_buckets[b].size) {
+            pfn_t pfn = aging_buckets[b].head;
+            if (b + 1 == AGING_BUCKETS || !frame_table[pfn].referenced) {
+                return pfn;
+            }
+            frame_list_remove(&aging_buckets[b], pfn);
+            frame_list_push_tail(&aging_buckets[AGING_BUCKETS - 1], AGING_BUCKETS, pfn);
+        }
+    }
+    policy_out_of_memory();
+    return NIL;
+}
+
+const replacement_policy_t aging_policy = {
+    .name = "aging",
+    .init = aging_init,
+    .on_access = aging_on_access,
+    .on_fault = aging_on_fault,
+    .on_evict = aging_on_evict,
+    .on_move = aging_on_move,
+    .on_exchange = aging_on_exchange,
+    .select_victim = aging_select_victim,
+};
+
+/* -------------------------------------------------------------------------
+ * WSClock
+ *
+ * A clock over the frame table that also remembers when each frame was last
+ * seen referenced, in accesses. Unreferenced frames older than the working
+ * set window are evicted, clean ones first. A real kernel would schedule a
+ * write for old dirty pages and keep sweeping; here writebacks happen at
+ * eviction, so the first old dirty frame is remembered and used if the
+ * sweep finds nothing clean. Failing that the least recently used frame
+ * seen is taken. The sweep gives up looking for something better after
+ * WSCLOCK_SCAN unreferenced frames, so a fault costs O(1) amortized:
+ * beyond those it only passes referenced frames, each of which an access
+ * paid for.
+ * ------------------------------------------------------------------------- */
+
+/* The working set window, in accesses */
+#define WSCLOCK_TAU (2 * (uint64_t) NUM_FRAMES)
+/* The most unreferenced frames a sweep looks at */
+#define WSCLOCK_SCAN 64
+
+static SIM_LOCAL uint64_t *wsclock_last_use;
+static SIM_LOCAL pfn_t wsclock_hand;
+
+static void wsclock_init(void) {
+    wsclock_last_use = policy_alloc(NUM_FRAMES, sizeof(uint64_t));
+}
+
+static void wsclock_on_fault(pfn_t pfn) {
+    wsclock_last_use[pfn] = stats.accesses;
+}
+
+static void wsclock_on_move(pfn_t from, pfn_t to) {
+    wsclock_last_use[to] = wsclock_last_use[from];
+}
+
+static void wsclock_on_exchange(pfn_t a, pfn_t b) {
+    uint64_t last_use = wsclock_last_use[a];
+    wsclock_last_use[a] = wsclock_last_use[b];
+    wsclock_last_use[b] = last_use;
+}
+
+static int frame_is_dirty(pfn_t pfn) {
+    pte_t *pte = pt_walk(frame_table[pfn].process->saved_ptbr, frame_table[pfn].vpn, 0);
+    return pte->dirty;
+}
+
+static pfn_t wsclock_select_victim(void) {
+    uint64_t now = stats.accesses;
+    pfn_t dirty_old = NIL, oldest = NIL;
+    uint32_t seen = 0;
+
+    /* The first revolution clears referenced bits, so a second one is
+       guaranteed to see at least one candidate */
+    for (uint32_t n = 0; n < 2 * NUM_FRAMES && seen < WSCLOCK_SCAN; n++) {
+        pfn_t pfn = wsclock_hand;
+        wsclock_hand = wsclock_hand + 1 < NUM_FRAMES ? wsclock_hand + 1 : 0;
+        if (frame_table[pfn].protected || !frame_table[pfn].mapped) {
+            continue;
+        }
+        if (frame_table[pfn].referenced) {
+            frame_table[pfn].referenced = 0;
+            wsclock_last_use[pfn] = now;
+            continue;
+        }
+        if (now - wsclock_last_use[pfn] > WSCLOCK_TAU) {
+            if (!frame_is_dirty(pfn)) {
+                return pfn;
+            }
+            if (dirty_old == NIL) {
+                dirty_old = pfn;
+            }
+        }
+        if (oldest == NIL || wsclock_last_use[pfn] < wsclock_last_use[oldest]) {
+            oldest = pfn;
+        }
+        seen++;
+    }
+
+    pfn_t victim = dirty_old != NIL ? dirty_old : oldest;
+    if (victim == NIL) {
+        policy_out_of_memory();
+    }
+    wsclock_hand = victim + 1 < NUM_FRAMES ? victim + 1 : 0;
+    return victim;
+}
+
+const replacement_policy_t wsclock_policy = {
+    .name = "wsclock",
+    .init = wsclock_init,
+    .on_fault = wsclock_on_fault,
+    .on_move = wsclock_on_move,
+    .on_exchange = wsclock_on_exchange,
+    .select_victim = wsclock_select_victim,
+};
+
+/* -------------------------------------------------------------------------
+ * 2Q
+ *
+ * New pages enter the FIFO A1in. Pages evicted from A1in are remembered in
+ * the ghost FIFO A1out; faulting on one of those means it was reused soon
+ * after eviction, so it goes to the LRU list Am instead. Pages touched only
+ * once, as in a scan, never displace Am.
+ * ------------------------------------------------------------------------- */
+
+#define TWOQ_A1IN 1
+#define TWOQ_AM 2
+
+static SIM_LOCAL frame_list_t twoq_a1in;
+static SIM_LOCAL frame_list_t twoq_am;
+static SIM_LOCAL ghost_list_t twoq_a1out;
+static SIM_LOCAL uint32_t twoq_kin;
+static SIM_LOCAL uint32_t twoq_kout;
+
+static void twoq_init(void) {
+    frame_lists_init();
+    frame_list_clear(&twoq_a1in);
+    frame_list_clear(&twoq_am);
+    ghost_list_clear(&twoq_a1out);
+    twoq_kin = DATA_FRAMES / 4 ? DATA_FRAMES / 4 : 1;
+    twoq_kout = DATA_FRAMES / 2 ? DATA_FRAMES / 2 : 1;
+    ghosts_init(twoq_kout);
+}
+
+static frame_list_t *twoq_list(pfn_t pfn) {
+    return frame_list_on[pfn] == TWOQ_AM ? &twoq_am : &twoq_a1in;
+}
+
+static void twoq_on_access(pfn_t pfn, char rw) {
+    (void) rw;
+    if (frame_list_on[pfn] == TWOQ_AM) {
+        frame_list_remove(&twoq_am, pfn);
+        frame_list_push_head(&twoq_am, TWOQ_AM, pfn);
+    }
+}
+
+static void twoq_on_fault(pfn_t pfn) {
+    uint32_t g = keymap_get(&ghost_map, page_key(&frame_table[pfn]));
+    if (g != NIL) {
+        ghost_remove(&twoq_a1out, g);
+        frame_list_push_head(&twoq_am, TWOQ_AM, pfn);
+    } else {
+        frame_list_push_head(&twoq_a1in, TWOQ_A1IN, pfn);
+    }
+}
+
+static void twoq_on_evict(pfn_t pfn, int exiting) {
+    if (frame_list_on[pfn] == TWOQ_AM) {
+        frame_list_remove(&twoq_am, pfn);
+        return;
+    }
+    frame_list_remove(&twoq_a1in, pfn);
+    if (!exiting) {
+        if (twoq_a1out.size >= twoq_kout) {
+            ghost_remove(&twoq_a1out, twoq_a1out.tail);
+        }
+        ghost_push_head(&twoq_a1out, 1, page_key(&frame_table[pfn]));
+    }
+}
+
+static void twoq_on_move(pfn_t from, pfn_t to) {
+    frame_list_replace(twoq_list(from), from, to);
+}
+
+static void twoq_on_exchange(pfn_t a, pfn_t b) {
+    frame_list_exchange(twoq_list(a), twoq_list(b), a, b);
+}
+
+static pfn_t twoq_select_victim(void) {
+    if (twoq_a1in.size && (twoq_a1in.size > twoq_kin || !twoq_am.size)) {
+        return twoq_a1in.tail;
+    }
+    if (twoq_am.size) {
+        return twoq_am.tail;
+    }
+    policy_out_of_memory();
+    return NIL;
+}
+
+const replacement_policy_t twoq_policy = {
+    .name = "2q",
+    .init = twoq_init,
+    .on_access = twoq_on_access,
+    .on_fault = twoq_on_fault,
+    .on_evict = twoq_on_evict,
+    .on_move = twoq_on_move,
+    .on_exchange = twoq_on_exchange,
+    .select_victim = twoq_select_victim,
+};
+
+/* -------------------------------------------------------------------------
+ * ARC
+ *
+ * T1 holds pages seen once recently and T2 pages seen at least twice, both
+ * in LRU order; B1 and B2 remember pages recently evicted from each. A fault
+ * on a B1 page grows the target size p of T1, a fault on a B2 page shrinks
+ * it, and the victim comes from T1 whenever T1 is larger than p. The victim
+ * is chosen before the faulting page is known, so the "x in B2" tie-break of
+ * the original REPLACE is not applied.
+ * ------------------------------------------------------------------------- */
+
+#define ARC_T1 1
+#define ARC_T2 2
+#define ARC_B1 1
+#define ARC_B2 2
+
+static SIM_LOCAL frame_list_t arc_t1;
+static SIM_LOCAL frame_list_t arc_t2;
+static SIM_LOCAL ghost_list_t arc_b1;
+static SIM_LOCAL ghost_list_t arc_b2;
+static SIM_LOCAL uint32_t arc_c;
+static SIM_LOCAL uint32_t arc_p;
+
+static void arc_init(void) {
+    frame_lists_init();
+    frame_list_clear(&arc_t1);
+    frame_list_clear(&arc_t2);
+    ghost_list_clear(&arc_b1);
+    ghost_list_clear(&arc_b2);
+    arc_c = DATA_FRAMES;
+    arc_p = 0;
+    ghosts_init(2 * arc_c + 1);
+}
+
+static frame_list_t *arc_list(pfn_t pfn) {
+    return frame_list_on[pfn] == ARC_T1 ? &arc_t1 : &arc_t2;
+}
+
+static void arc_on_access(pfn_t pfn, char rw) {
+    (void) rw;
+    frame_list_remove(arc_list(pfn), pfn);
+    frame_list_push_head(&arc_t2, ARC_T2, pfn);
+}
+
+static void arc_on_fault(pfn_t pfn) {
+    uint32_t g = keymap_get(&ghost_map, page_key(&frame_table[pfn]));
+    if (g == NIL) {
+        frame_list_push_head(&arc_t1, ARC_T1, pfn);
+        return;
+    }
+    if (ghosts[g].list == ARC_B1) {
+        uint32_t delta = arc_b2.size > arc_b1.size ? arc_b2.size / arc_b1.size : 1;
+        arc_p = arc_p + delta < arc_c ? arc_p + delta : arc_c;
+        ghost_remove(&arc_b1, g);
+    } else {
+        uint32_t delta = arc_b1.size > arc_b2.size ? arc_b1.size / arc_b2.size : 1;
+        arc_p = arc_p > delta ? arc_p - delta : 0;
+        ghost_remove(&arc_b2, g);
+    }
+    frame_list_push_head(&arc_t2, ARC_T2, pfn);
+}
+
+static void arc_on_evict(pfn_t pfn, int exiting) {
+    int from_t1 = frame_list_on[pfn] == ARC_T1;
+    frame_list_remove(from_t1 ? &arc_t1 : &arc_t2, pfn);
+    if (exiting) {
+        return;
+    }
+
+    if (from_t1) {
+        ghost_push_head(&arc_b1, ARC_B1, page_key(&frame_table[pfn]));
+    } else {
+        ghost_push_head(&arc_b2, ARC_B2, page_key(&frame_table[pfn]));
+    }
+
+    /* Keep |T1| + |B1| <= c and the whole directory <= 2c */
+    while (arc_b1.size && arc_t1.size + arc_b1.size > arc_c) {
+        ghost_remove(&arc_b1, arc_b1.tail);
+    }
+    while (arc_t1.size + arc_t2.size + arc_b1.size + arc_b2.size > 2 * arc_c) {
+        if (arc_b2.size) {
+            ghost_remove(&arc_b2, arc_b2.tail);
+        } else {
+            ghost_remove(&arc_b1, arc_b1.tail);
+        }
+    }
+}
+
+static void arc_on_move(pfn_t from, pfn_t to) {
+    frame_list_replace(arc_list(from), from, to);
+}
+
+static void arc_on_exchange(pfn_t a, pfn_t b) {
+    frame_list_exchange(arc_list(a), arc_list(b), a, b);
+}
+
+static pfn_t arc_select_victim(void) {
+    if (arc_t1.size && (arc_t1.size > arc_p || !arc_t2.size)) {
+        return arc_t1.tail;
+    }
+    if (arc_t2.size) {
+        return arc_t2.tail;
+    }
+    policy_out_of_memory();
+    return NIL;
+}
+
+const replacement_policy_t arc_policy = {
+    .name = "arc",
+    .init = arc_init,
+    .on_access = arc_on_access,
+    .on_fault = arc_on_fault,
+    .on_evict = arc_on_evict,
+    .on_move = arc_on_move,
+    .on_exchange = arc_on_exchange,
+    .select_victim = arc_select_victim,
+};
+
+/* -------------------------------------------------------------------------
+ * CLOCK-Pro
+ *
+ * Resident hot pages, resident cold pages and non-resident cold pages still
+ * in their test period all sit on one circular list, swept by three hands:
+ *
+ *   hand_cold  evicts unreferenced cold pages, which stay on the list as
+ *              non-resident test entries, and promotes referenced cold
+ *              pages to hot
+ *   hand_hot   demotes unreferenced hot pages to cold once there are more
+ *              hot pages than the hot target allows
+ *   hand_test  ends the test period of non-resident pages, dropping them
+ *              and shrinking the cold target
+ *
+ * A fault on a page still in its test period means its reuse distance beats
+ * the cold pages', so the cold target grows and the page comes back hot.
+ * New pages are inserted just behind hand_hot, the list head. Reference bits
+ * are kept here rather than in the frame table, since the access that faults
+ * a page in does not count as a reuse.
+ * ------------------------------------------------------------------------- */
+
+static SIM_LOCAL uint64_t *cp_key;
+static SIM_LOCAL pfn_t *cp_pfn;           /* NIL for non-resident test entries */
+static SIM_LOCAL uint32_t *cp_prev;
+static SIM_LOCAL uint32_t *cp_next;
+static SIM_LOCAL uint8_t *cp_hot;
+static SIM_LOCAL uint8_t *cp_ref;
+static SIM_LOCAL uint32_t *cp_node;       /* Node holding each resident frame */
+static SIM_LOCAL uint32_t cp_free;
+static SIM_LOCAL keymap_t cp_map;
+
+static SIM_LOCAL uint32_t cp_hand_hot = NIL;
+static SIM_LOCAL uint32_t cp_hand_cold = NIL;
+static SIM_LOCAL uint32_t cp_hand_test = NIL;
+static SIM_LOCAL uint32_t cp_count_hot;
+static SIM_LOCAL uint32_t cp_count_cold;
+static SIM_LOCAL uint32_t cp_count_test;
+static SIM_LOCAL uint32_t cp_mem;         /* Data frames available */
+static SIM_LOCAL uint32_t cp_cold_target;
+
+static void clockpro_init(void) {
+    uint32_t nodes = 2 * DATA_FRAMES + 2;
+    cp_key = policy_alloc(nodes, sizeof(uint64_t));
+    cp_pfn = policy_alloc(nodes, sizeof(pfn_t));
+    cp_prev = policy_alloc(nodes, sizeof(uint32_t));
+    cp_next = policy_alloc(nodes, sizeof(uint32_t));
+    cp_hot = policy_alloc(nodes, sizeof(uint8_t));
+    cp_ref = policy_alloc(nodes, sizeof(uint8_t));
+    cp_node = policy_alloc(NUM_FRAMES, sizeof(uint32_t));
+    for (uint32_t i = 0; i < nodes; i++) {
+        cp_next[i] = i + 1 < nodes ? i + 1 : NIL;
+    }
+    cp_free = 0;
+    keymap_init(&cp_map, nodes);
+    cp_mem = DATA_FRAMES;
+    cp_cold_target = cp_mem;
+}
+
+/* Inserts a node at the list head, just behind hand_hot */
+static uint32_t clockpro_insert(uint64_t key, pfn_t pfn, uint8_t hot) {
+    uint32_t n = cp_free;
+    if (n == NIL) {
+        panic("CLOCK-Pro node pool overflow");
+    }
+    cp_free = cp_next[n];
+
+    cp_key[n] = key;
+    cp_pfn[n] = pfn;
+    cp_hot[n] = hot;
+    cp_ref[n] = 0;
+    if (cp_hand_hot == NIL) {
+        cp_prev[n] = cp_next[n] = n;
+        cp_hand_hot = cp_hand_cold = cp_hand_test = n;
+    } else {
+        cp_prev[n] = cp_prev[cp_hand_hot];
+        cp_next[n] = cp_hand_hot;
+        cp_next[cp_prev[n]] = n;
+        cp_prev[cp_hand_hot] = n;
+    }
+    keymap_put(&cp_map, key, n);
+    if (pfn != NIL) {
+        cp_node[pfn] = n;
+    }
+    return n;
+}
+
+/* Unlinks a node, moving any hand that points at it along */
+static void clockpro_remove(uint32_t n) {
+    uint32_t next = cp_next[n] == n ? NIL : cp_next[n];
+    if (cp_hand_hot == n) {
+        cp_hand_hot = next;
+    }
+    if (cp_hand_cold == n) {
+        cp_hand_cold = next;
+    }
+    if (cp_hand_test == n) {
+        cp_hand_test = next;
+    }
+    cp_next[cp_prev[n]] = cp_next[n];
+    cp_prev[cp_next[n]] = cp_prev[n];
+    keymap_del(&cp_map, cp_key[n]);
+
+    cp_next[n] = cp_free;
+    cp_free = n;
+}
+
+static void clockpro_run_hand_test(void) {
+    uint32_t n = cp_hand_test;
+    cp_hand_test = cp_next[n];
+    if (cp_pfn[n] == NIL) {
+        clockpro_remove(n);
+        cp_count_test--;
+        if (cp_cold_target > 1) {
+            cp_cold_target--;
+        }
+    }
+}
+
+static void clockpro_run_hand_hot(void) {
+    if (cp_hand_hot == cp_hand_test) {
+        clockpro_run_hand_test();
+    }
+    uint32_t n = cp_hand_hot;
+    cp_hand_hot = cp_next[n];
+    if (cp_pfn[n] != NIL && cp_hot[n]) {
+        if (cp_ref[n]) {
+            cp_ref[n] = 0;
+        } else {
+            cp_hot[n] = 0;
+            cp_count_hot--;
+            cp_count_cold++;
+        }
+    }
+}
+
+/* Demotes hot pages until they fit within the hot target */
+static void clockpro_balance(void) {
+    while (cp_count_hot && cp_count_hot > cp_mem - cp_cold_target) {
+        clockpro_run_hand_hot();
+    }
+}
+
+static void clockpro_on_access(pfn_t pfn, char rw) {
+    (void) rw;
+    cp_ref[cp_node[pfn]] = 1;
+}
+
+static void clockpro_on_fault(pfn_t pfn) {
+    uint64_t key = page_key(&frame_table[pfn]);
+    uint32_t n = keymap_get(&cp_map, key);
+    if (n != NIL) {
+        /* Reused during its test period */
+        if (cp_cold_target < cp_mem) {
+            cp_cold_target++;
+        }
+        clockpro_remove(n);
+        cp_count_test--;
+        clockpro_insert(key, pfn, 1);
+        cp_count_hot++;
+    } else {
+        clockpro_insert(key, pfn, 0);
+        cp_count_cold++;
+    }
+    clockpro_balance();
+}
+
+static void clockpro_on_evict(pfn_t pfn, int exiting) {
+    uint32_t n = cp_node[pfn];
+    if (cp_hot[n]) {
+        cp_count_hot--;
+    } else {
+        cp_count_cold--;
+    }
+    if (exiting || cp_hot[n]) {
+        clockpro_remove(n);
+        return;
+    }
+
+    /* Cold pages stay on the list in their test period */
+    cp_pfn[n] = NIL;
+    cp_count_test++;
+    if (cp_hand_cold == n) {
+        cp_hand_cold = cp_next[n];
+    }
+    while (cp_count_test > cp_mem) {
+        clockpro_run_hand_test();
+    }
+}
+
+static void clockpro_on_move(pfn_t from, pfn_t to) {
+    cp_node[to] = cp_node[from];
+    cp_pfn[cp_node[to]] = to;
+}
+
+static void clockpro_on_exchange(pfn_t a, pfn_t b) {
+    uint32_t n = cp_node[a];
+    cp_node[a] = cp_node[b];
+    cp_node[b] = n;
+    cp_pfn[cp_node[a]] = a;
+    cp_pfn[cp_node[b]] = b;
+}
+
+static pfn_t clockpro_select_victim(void) {
+    if (!cp_count_hot && !cp_count_cold) {
+        policy_out_of_memory();
+    }
+    for (;;) {
+        if (!cp_count_cold) {
+            /* Everything is hot: force hand_hot round until something is
+               demoted */
+            clockpro_run_hand_hot();
+            continue;
+        }
+        uint32_t n = cp_hand_cold;
+        if (cp_pfn[n] != NIL && !cp_hot[n]) {
+            if (!cp_ref[n]) {
+                return cp_pfn[n];
+            }
+            /* Referenced during its test period: promote */
+            cp_ref[n] = 0;
+            cp_hot[n] = 1;
+            cp_count_cold--;
+            cp_count_hot++;
+            cp_hand_cold = cp_next[n];
+            clockpro_balance();
+            continue;
+        }
+        cp_hand_cold = cp_next[n];
+    }
+}
+
+const replacement_policy_t clockpro_policy = {
+    .name = "clockpro",
+    .init = clockpro_init,
+    .on_access = clockpro_on_access,
+    .on_fault = clockpro_on_fault,
+    .on_evict = clockpro_on_evict,
+    .on_move = clockpro_on_move,
+    .on_exchange = clockpro_on_exchange,
+    .select_victim = clockpro_select_victim,
+};
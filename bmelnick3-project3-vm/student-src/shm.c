@@ -0,0 +1,179 @@
+#include "paging.h"
+#include "pagesim.h"
+#include "swapops.h"
+#include "stats.h"
+#include "tlb.h"
+#include "util.h"
+#include "replacement.h"
+
+/*
+ * Shared memory segments (see paging.h).
+ *
+ * A resident page of a segment is mapped by at least one of the processes
+ * attached to it: the frame table entry names one of them, and the reverse
+ * map the rest, as for pages shared since a FORK. Their page table entries
+ * never hold swap entries of their own; each keeps its own dirty bit, which
+ * is folded into the backing entry whenever it stops mapping the frame.
+ */
+
+SIM_LOCAL shm_segment_t shm_segments[MAX_SHM];
+
+void shm_create(uint32_t id, uint32_t pages) {
+    shm_segment_t *seg = shm_segments + id;
+    seg->backing = calloc(pages, sizeof(pte_t));
+    if (!seg->backing) {
+        panic("could not allocate shared memory segment");
+    }
+    seg->pages = pages;
+    seg->attached = 0;
+    stats.shm_creates++;
+}
+
+void shm_attach(pcb_t *proc, uint32_t id, vpn_t base) {
+    if (proc->shm_count == proc->shm_capacity) {
+        proc->shm_capacity = proc->shm_capacity ? proc->shm_capacity * 2 : 4;
+        proc->shm = realloc(proc->shm, proc->shm_capacity * sizeof(shm_attachment_t));
+        if (!proc->shm) {
+            panic("could not allocate shared memory attachments");
+        }
+    }
+    proc->shm[proc->shm_count].id = id;
+    proc->shm[proc->shm_count].base = base;
+    proc->shm_count++;
+    shm_segments[id].attached++;
+}
+
+/* Unmaps a page of a segment the last attached process is leaving, so its
+   contents are of no use to anyone any more */
+static void shm_drop(pfn_t pfn) {
+    fte_t *fte = frame_table + pfn;
+    policy_on_evict(pfn, 1);
+    fte->mapped = 0;
+    fte->refcount = 0;
+    fte->referenced = 0;
+    fte->process = 0;
+    mapped_frames--;
+    frame_mark_free(pfn);
+}
+
+void shm_detach(pcb_t *proc, uint32_t id) {
+    shm_attachment_t *att = shm_find(proc, id);
+    shm_segment_t *seg = shm_segments + id;
+
+    for (uint32_t i = 0; i < seg->pages; i++) {
+        vpn_t vpn = att->base + i;
+        pte_t *pte = pt_walk(proc->saved_ptbr, vpn, 0);
+        if (!pte || !pte->valid) {
+            continue;
+        }
+        pte_t *backing = seg->backing + i;
+        pfn_t pfn = pte->pfn;
+        if (frame_table[pfn].refcount > 1) {
+            /* The other processes mapping the page keep the frame */
+            backing->dirty |= pte->dirty;
+            rmap_remove(pfn, proc, vpn);
+        } else if (seg->attached > 1) {
+            /* The page outlives this mapping, so it goes back to swap */
+            evict_frame(pfn, 0);
+            frame_mark_free(pfn);
+            continue;
+        } else {
+            shm_drop(pfn);
+            backing->valid = 0;
+            backing->dirty = 0;
+        }
+        pte->valid = 0;
+        pte->dirty = 0;
+        pte->shm = 0;
+        tlb_invalidate((uint16_t) proc->pid, vpn);
+    }
+
+    *att = proc->shm[--proc->shm_count];
+    if (--seg->attached == 0) {
+        for (uint32_t i = 0; i < seg->pages; i++) {
+            if (seg->backing[i].swap) {
+                swap_free(seg->backing + i);
+            }
+        }
+        free(seg->backing);
+        seg->backing = NULL;
+        seg->pages = 0;
+    }
+}
+
+void shm_fork(pcb_t *parent, pcb_t *child) {
+    for (uint32_t i = 0; i < parent->shm_count; i++) {
+        shm_attach(child, parent->shm[i].id, parent->shm[i].base);
+    }
+}
+
+shm_attachment_t *shm_find(const pcb_t *proc, uint32_t id) {
+    for (uint32_t i = 0; i < proc->shm_count; i++) {
+        if (proc->shm[i].id == id) {
+            return proc->shm + i;
+        }
+    }
+    return NULL;
+}
+
+pte_t *shm_backing(const pcb_t *proc, vpn_t vpn) {
+    for (uint32_t i = 0; i < proc->shm_count; i++) {
+        const shm_segment_t *seg = shm_segments + proc->shm[i].id;
+        if (vpn >= proc->shm[i].base && vpn - proc->shm[i].base < seg->pages) {
+            return seg->backing + (vpn - proc->shm[i].base);
+        }
+    }
+    return NULL;
+}
+
+int shm_fault(vpn_t vpn, pte_t *pte) {
+    pte_t *backing = shm_backing(current_process, vpn);
+    if (!backing) {
+        return 0;
+    }
+
+    if (backing->valid) {
+        /* Another process has the page resident already */
+        rmap_add(backing->pfn, current_process, vpn);
+        stats.shm_minor_faults++;
+    } else {
+        pfn_t pfn = free_frame();
+        fte_t *fte = frame_table + pfn;
+        fte->process = current_process;
+        fte->vpn = vpn;
+        fte->mapped = 1;
+        fte->prefetched = 0;
+        fte->refcount = 1;
+        fte->heat = 0;
+        mapped_frames++;
+        policy_on_fault(pfn);
+
+        if (swap_exists(backing)) {
+            swap_read(backing, mem + (pfn * PAGE_SIZE));
+        } else {
+            memset(mem + (pfn * PAGE_SIZE), 0, PAGE_SIZE);
+            backing->dirty = 0;
+        }
+        backing->pfn = pfn;
+        backing->valid = 1;
+    }
+
+    pte->pfn = backing->pfn;
+    pte->valid = 1;
+    pte->dirty = 0;
+    pte->shm = 1;
+    if (!pte->listed) {
+        proc_track_page(current_process, vpn, pte);
+    }
+    stats.shm_faults++;
+    return 1;
+}
+
+void shm_teardown(void) {
+    for (uint32_t id = 0; id < MAX_SHM; id++) {
+        free(shm_segments[id].backing);
+        shm_segments[id].backing = NULL;
+        shm_segments[id].pages = 0;
+        shm_segments[id].attached = 0;
+    }
+}
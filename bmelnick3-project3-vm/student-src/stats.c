@@ -2,7 +2,7 @@
 #include "stats.h"
 
 /* The stats. See the definition in stats.h. */
-stats_t stats;
+SIM_LOCAL stats_t stats;
 
 /*  --------------------------------- PROBLEM 10 --------------------------------------
     Checkout PDF section 10 for this problem
@@ -19,8 +19,20 @@ stats_t stats;
     -----------------------------------------------------------------------------------
 */
 void compute_stats() {
-    stats.aat = ((double) ((long) (stats.writes + stats.reads)*MEMORY_ACCESS_TIME)
-				+ ((long) (stats.writebacks)*(DISK_PAGE_WRITE_TIME))
-				+ ((long) (stats.page_faults)*(DISK_PAGE_READ_TIME)))
+    stats.migration_time = ((double) ((long) (stats.tier_promotions + stats.tier_demotions + stats.huge_copies)*PAGE_MIGRATE_TIME))
+				/ ((double) stats.accesses);
+    stats.aat = ((double) ((long) (stats.writes + stats.reads - stats.slow_accesses)*MEMORY_ACCESS_TIME)
+				+ ((long) (stats.slow_accesses)*(SLOW_MEMORY_ACCESS_TIME))
+				+ ((long) (stats.tier_promotions + stats.tier_demotions + stats.huge_copies + stats.cow_faults)*(PAGE_MIGRATE_TIME))
+				+ ((long) (stats.writebacks + stats.bg_writebacks)*(DISK_PAGE_WRITE_TIME))
+				+ ((long) (stats.page_faults - stats.zswap_hits - stats.shm_minor_faults
+				           - stats.cow_faults - stats.cow_reuses - stats.zero_copies)*(DISK_PAGE_READ_TIME))
+				+ ((long) (stats.zero_copies)*(PAGE_ZERO_TIME))
+				+ ((long) (stats.prefetch_reads)*(DISK_PAGE_READAHEAD_TIME))
+				+ ((long) (stats.zswap_hits)*(DECOMPRESS_PAGE_TIME))
+				+ ((long) (stats.zswap_stores)*(COMPRESS_PAGE_TIME))
+				+ ((long) (stats.tlb_hits + stats.tlb_misses)*(TLB_ACCESS_TIME))
+				+ ((long) (stats.tlb_misses + stats.tlb_dirty_walks)*(PAGE_WALK_TIME))
+				+ ((long) (stats.tlb_ipis)*(TLB_SHOOTDOWN_TIME)))
 				/ ((double) stats.accesses);
 }
@@ -0,0 +1,163 @@
+#include "paging.h"
+#include "pagesim.h"
+#include "stats.h"
+#include "tlb.h"
+#include "util.h"
+#include "replacement.h"
+
+/*
+ * Memory tiers (see paging.h).
+ *
+ * Moving a page only takes its frame table entry along: the entry names the
+ * page, and the reverse map chain hanging off it the others sharing the
+ * frame, which is how every page table entry mapping the frame is found.
+ */
+
+/* Whether the page in pfn may move to another frame */
+static int tier_movable(pfn_t pfn) {
+    const fte_t *fte = frame_table + pfn;
+    if (!fte->mapped || fte->protected) {
+        return 0;
+    }
+    return !pt_walk(fte->process->saved_ptbr, fte->vpn, 0)->huge;
+}
+
+/* Points every page mapping from at to instead */
+static void tier_remap(pfn_t from, pfn_t to) {
+    pcb_t *proc = frame_table[from].process;
+    vpn_t vpn = frame_table[from].vpn;
+    uint32_t cursor = 0;
+    do {
+        pte_t *pte = pt_walk(proc->saved_ptbr, vpn, 0);
+        pte->pfn = to;
+        if (pte->shm) {
+            shm_backing(proc, vpn)->pfn = to;
+        }
+        tlb_invalidate((uint16_t) proc->pid, vpn);
+    } while (rmap_next(from, &cursor, &proc, &vpn));
+}
+
+void frame_move(pfn_t from, pfn_t to) {
+    fte_t *src = frame_table + from;
+    fte_t *dst = frame_table + to;
+
+    tier_remap(from, to);
+    frame_mark_used(to);
+    memcpy(mem + (to * PAGE_SIZE), mem + (from * PAGE_SIZE), PAGE_SIZE);
+    *dst = *src;
+    policy_on_move(from, to);
+
+    memset(src, 0, sizeof(fte_t));
+    frame_mark_free(from);
+}
+
+void frame_exchange(pfn_t a, pfn_t b) {
+    uint8_t *page_a = mem + (a * PAGE_SIZE);
+    uint8_t *page_b = mem + (b * PAGE_SIZE);
+
+    if (check_corruption) {
+        check_touch_frame(a);
+        check_touch_frame(b);
+    }
+    policy_before_exchange(a, b);
+    tier_remap(a, b);
+    tier_remap(b, a);
+
+    for (size_t i = 0; i < PAGE_SIZE; i += sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, page_a + i, sizeof(x));
+        memcpy(&y, page_b + i, sizeof(y));
+        memcpy(page_a + i, &y, sizeof(y));
+        memcpy(page_b + i, &x, sizeof(x));
+    }
+    fte_t fte = frame_table[a];
+    frame_table[a] = frame_table[b];
+    frame_table[b] = fte;
+
+    policy_on_exchange(a, b);
+}
+
+/* Orders frames hottest first, and by number among equals */
+static int tier_hotter(const void *x, const void *y) {
+    pfn_t a = *(const pfn_t *) x;
+    pfn_t b = *(const pfn_t *) y;
+    if (frame_table[a].heat != frame_table[b].heat) {
+        return frame_table[a].heat > frame_table[b].heat ? -1 : 1;
+    }
+    return a < b ? -1 : a > b;
+}
+
+/* Orders frames coldest first, and by number among equals */
+static int tier_colder(const void *x, const void *y) {
+    pfn_t a = *(const pfn_t *) x;
+    pfn_t b = *(const pfn_t *) y;
+    if (frame_table[a].heat != frame_table[b].heat) {
+        return frame_table[a].heat < frame_table[b].heat ? -1 : 1;
+    }
+    return a < b ? -1 : a > b;
+}
+
+/* Scratch lists of the candidates for each pass, allocated by the first */
+static SIM_LOCAL pfn_t *hot;
+static SIM_LOCAL pfn_t *cold;
+
+void tier_migrate(void) {
+    uint32_t hot_count = 0;
+    uint32_t cold_count = 0;
+    if (!hot) {
+        hot = malloc(NUM_FRAMES * sizeof(pfn_t));
+        cold = malloc(NUM_FRAMES * sizeof(pfn_t));
+        if (!hot || !cold) {
+            panic("could not allocate tier migration state");
+        }
+    }
+
+    /* The hot pages of the slow tier, and every page of the fast tier */
+    for (pfn_t pfn = 0; pfn < NUM_FRAMES; pfn++) {
+        if (!tier_movable(pfn)) {
+            continue;
+        }
+        if (pfn < fast_frames) {
+            cold[cold_count++] = pfn;
+        } else if (frame_table[pfn].heat >= TIER_HOT) {
+            hot[hot_count++] = pfn;
+        }
+    }
+    qsort(hot, hot_count, sizeof(pfn_t), tier_hotter);
+    qsort(cold, cold_count, sizeof(pfn_t), tier_colder);
+
+    /* The translations of every page moved are shot down together */
+    uint32_t copies = 0;
+    uint32_t next_cold = 0;
+    tlb_batch_begin();
+    for (uint32_t i = 0; i < hot_count && copies < TIER_MIGRATE_MAX; i++) {
+        pfn_t to = frame_find_free();
+        if (to < fast_frames) {
+            frame_move(hot[i], to);
+            stats.tier_promotions++;
+            copies++;
+            continue;
+        }
+        /* The fast tier is full, so the page has to trade places with one
+           of its pages, which had better be a lot colder */
+        if (next_cold == cold_count
+            || frame_table[cold[next_cold]].heat * 2 >= frame_table[hot[i]].heat) {
+            break;
+        }
+        frame_exchange(hot[i], cold[next_cold++]);
+        stats.tier_promotions++;
+        stats.tier_demotions++;
+        copies += 2;
+    }
+    tlb_batch_end();
+
+    for (pfn_t pfn = 0; pfn < NUM_FRAMES; pfn++) {
+        frame_table[pfn].heat >>= 1;
+    }
+}
+
+void tier_teardown(void) {
+    free(hot);
+    free(cold);
+    hot = cold = NULL;
+}